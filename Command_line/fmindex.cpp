@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "FMIndex.h"
+#include "line_io.h"
+
+/* Command line interface to FMIndex, for use in shell pipelines:
+
+       fmindex build [options] TEXT INDEX
+       fmindex count|locate|grep [options] INDEX [PATTERN ...]
+       fmindex extract [options] INDEX
+
+   Query commands read newline-delimited patterns from stdin (unless some are
+   given as arguments) in large batches and write one result per pattern, in
+   order, through one large output buffer (see line_io.h). */
+
+namespace
+{
+    const char * usage =
+        "usage: fmindex build [-r RATE] [-k BYTES] [-s] [-e SCRATCH_DIR [-m MB]] [-v] TEXT INDEX\n"
+        "       fmindex count [-v] INDEX [PATTERN ...]\n"
+        "       fmindex locate [-v] INDEX [PATTERN ...]\n"
+        "       fmindex grep [-d CHAR] [-C CONTEXT] [-p] [-v] INDEX [PATTERN ...]\n"
+        "       fmindex extract [-t THREADS] [-v] INDEX\n"
+        "\n"
+        "build   Index the file TEXT and write the index to INDEX.\n"
+        "          -r RATE     Sample every RATE-th suffix array value, for locate and grep (default 32; 0 for none)\n"
+        "          -k BYTES    Add a k-mer table of at most BYTES bytes to speed up searches\n"
+        "          -s          Build the two BWTs one after the other, in half the memory\n"
+        "          -e DIR      Build in blocks, with scratch files in DIR, for texts larger than memory\n"
+        "          -m MB       Memory budget for -e (default 1024)\n"
+        "count   Print the number of occurrences of each pattern.\n"
+        "locate  Print the sorted text positions of each pattern, separated by spaces.\n"
+        "grep    Print the line containing each match of each pattern.\n"
+        "          -d CHAR     Line delimiter (default newline)\n"
+        "          -C CONTEXT  Longest line part, either side of a match, to print (default 100)\n"
+        "          -p          Prefix each line with the pattern and a tab\n"
+        "extract Print the indexed text.\n"
+        "          -t THREADS  Threads decoding it (default one per hardware thread)\n"
+        "\n"
+        "Patterns are read one per line from stdin unless given as arguments. Empty\n"
+        "patterns match nothing. -v reports timings on stderr.\n";
+
+    int build(int argc, char ** argv)
+    {
+        size_t SA_sample_rate = 32, kmer_bytes = 0, memory_mb = 1024;
+        bool parallel = true, verbose = false;
+        std::string scratch_dir;
+        int opt;
+        while((opt = getopt(argc, argv, "r:k:se:m:v")) != -1)
+        {
+            switch(opt)
+            {
+                case 'r': SA_sample_rate = parse_size(optarg, "sample rate"); break;
+                case 'k': kmer_bytes = parse_size(optarg, "k-mer table size"); break;
+                case 's': parallel = false; break;
+                case 'e': scratch_dir = optarg; break;
+                case 'm': memory_mb = parse_size(optarg, "memory budget"); break;
+                case 'v': verbose = true; break;
+                default: std::fputs(usage, stderr); return 2;
+            }
+        }
+        if(argc - optind != 2)
+        {
+            std::fputs(usage, stderr);
+            return 2;
+        }
+
+        timer::time_point start = timer::now();
+        std::unique_ptr<FMIndex> fmi(scratch_dir.empty() ?
+                                     FMIndex::new_from_file(argv[optind], SA_sample_rate, parallel) :
+                                     FMIndex::new_from_file_external(argv[optind], scratch_dir, memory_mb << 20, SA_sample_rate));
+        if(kmer_bytes > 0) fmi->index_kmers(kmer_bytes);
+        double build_ms = milliseconds_since(start);
+        fmi->serialize_to_file(argv[optind + 1]);
+        if(verbose)
+            std::fprintf(stderr, "fmindex: indexed %zu bytes in %.0f ms (k-mer length %zu), wrote %s in %.0f ms\n",
+                         fmi->size(), build_ms, fmi->kmer_table_length(), argv[optind + 1], milliseconds_since(start) - build_ms);
+        return 0;
+    }
+
+    int extract(int argc, char ** argv)
+    {
+        size_t n_threads = 0;
+        bool verbose = false;
+        int opt;
+        while((opt = getopt(argc, argv, "t:v")) != -1)
+        {
+            switch(opt)
+            {
+                case 't': n_threads = parse_size(optarg, "number of threads"); break;
+                case 'v': verbose = true; break;
+                default: std::fputs(usage, stderr); return 2;
+            }
+        }
+        if(argc - optind != 1)
+        {
+            std::fputs(usage, stderr);
+            return 2;
+        }
+
+        timer::time_point start = timer::now();
+        std::unique_ptr<FMIndex> fmi(FMIndex::new_from_serialized_file(argv[optind]));
+        double load_ms = milliseconds_since(start);
+        std::string text;
+        fmi->reconstruct(text, n_threads);
+        double extract_ms = milliseconds_since(start) - load_ms;
+        if(std::fwrite(text.data(), 1, text.size(), stdout) != text.size() || std::fflush(stdout) != 0)
+            throw std::runtime_error("Cannot write output");
+        if(verbose)
+            std::fprintf(stderr, "fmindex: loaded %zu byte index in %.1f ms; extracted it in %.1f ms (%.0f MB/s)\n",
+                         fmi->size(), load_ms, extract_ms, extract_ms > 0 ? fmi->size() / extract_ms / 1000 : 0.0);
+        return 0;
+    }
+
+    int query(const std::string & command, int argc, char ** argv)
+    {
+        char new_line_char = '\n';
+        size_t max_context = 100;
+        bool prefix = false, verbose = false;
+        int opt;
+        while((opt = getopt(argc, argv, command == "grep" ? "d:C:pv" : "v")) != -1)
+        {
+            switch(opt)
+            {
+                case 'd':
+                    if(std::strlen(optarg) != 1) throw std::invalid_argument(std::string("Delimiter must be one character: ") + optarg);
+                    new_line_char = optarg[0];
+                    break;
+                case 'C': max_context = parse_size(optarg, "context"); break;
+                case 'p': prefix = true; break;
+                case 'v': verbose = true; break;
+                default: std::fputs(usage, stderr); return 2;
+            }
+        }
+        if(argc - optind < 1)
+        {
+            std::fputs(usage, stderr);
+            return 2;
+        }
+
+        timer::time_point start = timer::now();
+        std::unique_ptr<FMIndex> fmi(FMIndex::new_from_serialized_file(argv[optind]));
+        double load_ms = milliseconds_since(start);
+
+        output_buffer out;
+        std::vector<std::pair<const char *, size_t>> patterns;
+        std::vector<size_t> positions;
+        size_t n_patterns = 0;
+        auto answer = [&]()
+        {
+            for(auto & pattern : patterns)
+            {
+                if(command == "count")
+                {
+                    out.append(pattern.second == 0 ? 0 : fmi->findn(pattern.first, pattern.second));
+                    out.append('\n');
+                }
+                else if(command == "locate")
+                {
+                    positions.clear();
+                    if(pattern.second > 0)
+                    {
+                        std::pair<size_t, size_t> interval = fmi->find_interval(pattern.first, pattern.second);
+                        for(size_t row = interval.first; row < interval.second; row++) positions.push_back(fmi->locate(row));
+                        std::sort(positions.begin(), positions.end());
+                    }
+                    for(size_t i = 0; i < positions.size(); i++)
+                    {
+                        if(i > 0) out.append(' ');
+                        out.append(positions[i]);
+                    }
+                    out.append('\n');
+                }
+                else if(pattern.second > 0)
+                {
+                    for(auto & line : fmi->find_lines(std::string(pattern.first, pattern.second), new_line_char, max_context))
+                    {
+                        if(prefix)
+                        {
+                            out.append(pattern.first, pattern.second);
+                            out.append('\t');
+                        }
+                        out.append(line);
+                        out.append('\n');
+                    }
+                }
+            }
+            n_patterns += patterns.size();
+        };
+
+        start = timer::now();
+        if(argc - optind > 1)
+        {
+            for(int i = optind + 1; i < argc; i++) patterns.push_back(std::make_pair(argv[i], std::strlen(argv[i])));
+            answer();
+        }
+        else
+        {
+            pattern_reader reader;
+            while(reader.next_batch(patterns)) answer();
+        }
+        out.flush();
+
+        if(verbose)
+        {
+            double query_ms = milliseconds_since(start);
+            std::fprintf(stderr, "fmindex: loaded %zu byte index in %.1f ms; %zu patterns in %.1f ms (%.0f per second)\n",
+                         fmi->size(), load_ms, n_patterns, query_ms, query_ms > 0 ? 1000 * n_patterns / query_ms : 0.0);
+        }
+        return 0;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc < 2)
+    {
+        std::fputs(usage, stderr);
+        return 2;
+    }
+    std::string command = argv[1];
+    try
+    {
+        // Options follow the command, which getopt then treats as the program name.
+        if(command == "build") return build(argc - 1, argv + 1);
+        if(command == "count" || command == "locate" || command == "grep") return query(command, argc - 1, argv + 1);
+        if(command == "extract") return extract(argc - 1, argv + 1);
+        if(command == "-h" || command == "--help" || command == "help")
+        {
+            std::fputs(usage, stdout);
+            return 0;
+        }
+        std::fprintf(stderr, "fmindex: unknown command %s\n%s", command.c_str(), usage);
+        return 2;
+    }
+    catch(const std::exception & e)
+    {
+        std::fflush(stdout);
+        std::fprintf(stderr, "fmindex: %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "QueryClient.h"
+#include "line_io.h"
+
+/* A client of fmindex-server, with the same query commands and output as
+   fmindex, for scripts and for testing and load testing the server. Keeps up
+   to WINDOW requests in flight on one connection and prints the results in
+   the order of the patterns. */
+
+namespace
+{
+    const char * usage =
+        "usage: fmindex-client count|locate [-w WINDOW] [-v] SOCKET [PATTERN ...]\n"
+        "       fmindex-client grep [-d CHAR] [-C CONTEXT] [-p] [-w WINDOW] [-v] SOCKET [PATTERN ...]\n"
+        "       fmindex-client stats SOCKET\n"
+        "\n"
+        "As fmindex count, locate and grep, but queries the fmindex-server listening on SOCKET.\n"
+        "  -w WINDOW  Most requests in flight at once (default 1024)\n"
+        "  -v         Report throughput and latency on stderr\n"
+        "stats prints the server's statistics.\n";
+
+    struct in_flight
+    {
+        std::string pattern;
+        timer::time_point sent;
+        bool done;
+        QueryClient::response response;
+    };
+
+    int query(const std::string & command, int argc, char ** argv)
+    {
+        char new_line_char = '\n';
+        size_t max_context = 100, window = 1024;
+        bool prefix = false, verbose = false;
+        int opt;
+        while((opt = getopt(argc, argv, command == "grep" ? "d:C:pw:v" : "w:v")) != -1)
+        {
+            switch(opt)
+            {
+                case 'd':
+                    if(std::strlen(optarg) != 1) throw std::invalid_argument(std::string("Delimiter must be one character: ") + optarg);
+                    new_line_char = optarg[0];
+                    break;
+                case 'C': max_context = parse_size(optarg, "context"); break;
+                case 'p': prefix = true; break;
+                case 'w': window = std::max<size_t>(parse_size(optarg, "window"), 1); break;
+                case 'v': verbose = true; break;
+                default: std::fputs(usage, stderr); return 2;
+            }
+        }
+        if(argc - optind < 1)
+        {
+            std::fputs(usage, stderr);
+            return 2;
+        }
+
+        QueryClient client(argv[optind]);
+        output_buffer out;
+        std::map<size_t, in_flight> requests; // Not yet printed, in the order of the patterns.
+        std::unordered_map<uint32_t, size_t> sequence_of_id; // Sent but not yet answered.
+        size_t sequence = 0;
+        std::vector<double> latencies_us;
+
+        // Print the responses which have arrived and are next in order.
+        auto print_ready = [&]()
+        {
+            while(!requests.empty() && requests.begin()->second.done)
+            {
+                in_flight & r = requests.begin()->second;
+                if(command == "count")
+                {
+                    out.append(r.pattern.empty() ? 0 : r.response.count());
+                    out.append('\n');
+                }
+                else if(command == "locate")
+                {
+                    std::vector<size_t> positions;
+                    if(!r.pattern.empty()) positions = r.response.positions();
+                    for(size_t i = 0; i < positions.size(); i++)
+                    {
+                        if(i > 0) out.append(' ');
+                        out.append(positions[i]);
+                    }
+                    out.append('\n');
+                }
+                else if(!r.pattern.empty())
+                {
+                    for(auto & line : r.response.lines())
+                    {
+                        if(prefix)
+                        {
+                            out.append(r.pattern);
+                            out.append('\t');
+                        }
+                        out.append(line);
+                        out.append('\n');
+                    }
+                }
+                requests.erase(requests.begin());
+            }
+        };
+
+        auto receive_one = [&]()
+        {
+            QueryClient::response response = client.receive();
+            in_flight & r = requests.at(sequence_of_id.at(response.id));
+            sequence_of_id.erase(response.id);
+            latencies_us.push_back(1000 * milliseconds_since(r.sent));
+            r.response = std::move(response);
+            r.done = true;
+            print_ready();
+        };
+
+        auto send = [&](const char * pattern, const size_t length)
+        {
+            while(requests.size() >= window) receive_one();
+            in_flight r{std::string(pattern, length), timer::now(), false, QueryClient::response()};
+            if(length == 0) r.done = true; // Empty patterns match nothing: not worth a round trip.
+            else if(command == "count") sequence_of_id[client.send_findn(r.pattern)] = sequence;
+            else if(command == "locate") sequence_of_id[client.send_locate(r.pattern)] = sequence;
+            else sequence_of_id[client.send_find_lines(r.pattern, new_line_char, static_cast<uint32_t>(max_context))] = sequence;
+            requests.insert(std::make_pair(sequence++, std::move(r)));
+            print_ready();
+        };
+
+        timer::time_point start = timer::now();
+        size_t n_patterns = 0;
+        std::vector<std::pair<const char *, size_t>> patterns;
+        if(argc - optind > 1)
+            for(int i = optind + 1; i < argc; i++) patterns.push_back(std::make_pair(argv[i], std::strlen(argv[i])));
+        pattern_reader reader;
+        while(argc - optind > 1 ? !patterns.empty() : reader.next_batch(patterns))
+        {
+            for(auto & pattern : patterns) send(pattern.first, pattern.second);
+            n_patterns += patterns.size();
+            patterns.clear();
+            client.flush();
+        }
+        while(!sequence_of_id.empty()) receive_one();
+        print_ready();
+        out.flush();
+
+        if(verbose && !latencies_us.empty())
+        {
+            double ms = milliseconds_since(start);
+            std::sort(latencies_us.begin(), latencies_us.end());
+            std::fprintf(stderr, "fmindex-client: %zu patterns in %.1f ms (%.0f per second); latency p50 %.0f us, p99 %.0f us, max %.0f us\n",
+                         n_patterns, ms, ms > 0 ? 1000 * n_patterns / ms : 0.0,
+                         latencies_us[latencies_us.size() / 2],
+                         latencies_us[latencies_us.size() * 99 / 100],
+                         latencies_us.back());
+        }
+        return 0;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc < 2)
+    {
+        std::fputs(usage, stderr);
+        return 2;
+    }
+    std::string command = argv[1];
+    try
+    {
+        if(command == "count" || command == "locate" || command == "grep") return query(command, argc - 1, argv + 1);
+        if(command == "stats" && argc == 3)
+        {
+            QueryClient client(argv[2]);
+            std::fputs(client.stats().c_str(), stdout);
+            return 0;
+        }
+        std::fputs(usage, stderr);
+        return 2;
+    }
+    catch(const std::exception & e)
+    {
+        std::fflush(stdout);
+        std::fprintf(stderr, "fmindex-client: %s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,96 @@
+#include <csignal>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "FMIndex.h"
+#include "QueryServer.h"
+#include "line_io.h"
+
+/* Loads an index once and serves it to local clients over a Unix domain
+   socket (see QueryServer and query_protocol.h) until interrupted, reloading
+   it on SIGHUP. */
+
+namespace
+{
+    const char * usage =
+        "usage: fmindex-server [-w WORKERS] [-b MAX_BATCH] INDEX SOCKET\n"
+        "\n"
+        "Serves count, locate and grep queries against INDEX on the Unix domain socket SOCKET.\n"
+        "  -w WORKERS    Query threads (default one per hardware thread)\n"
+        "  -b MAX_BATCH  Most requests answered together (default 256)\n"
+        "\n"
+        "SIGHUP reloads INDEX (e.g., after a rebuild) while still serving queries from the\n"
+        "old index, then swaps it in. SIGUSR1 prints throughput and latency statistics on\n"
+        "stderr; SIGINT or SIGTERM prints them and stops the server.\n";
+}
+
+int main(int argc, char ** argv)
+{
+    try
+    {
+        size_t n_workers = 0, max_batch = 256;
+        int opt;
+        while((opt = getopt(argc, argv, "w:b:")) != -1)
+        {
+            switch(opt)
+            {
+                case 'w': n_workers = parse_size(optarg, "number of workers"); break;
+                case 'b': max_batch = parse_size(optarg, "batch size"); break;
+                default: std::fputs(usage, stderr); return 2;
+            }
+        }
+        if(argc - optind != 2)
+        {
+            std::fputs(usage, stderr);
+            return 2;
+        }
+
+        // Block the signals before starting any threads, which inherit the mask, so that only sigwait sees them.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGUSR1);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        timer::time_point start = timer::now();
+        std::shared_ptr<const FMIndex> fmi(FMIndex::new_from_serialized_file(argv[optind]));
+        QueryServer server(fmi, argv[optind + 1], n_workers, max_batch);
+        std::fprintf(stderr, "fmindex-server: loaded %zu byte index in %.1f ms, serving on %s\n",
+                     fmi->size(), milliseconds_since(start), argv[optind + 1]);
+
+        for(int signal = 0; signal != SIGINT && signal != SIGTERM; )
+        {
+            if(sigwait(&signals, &signal) != 0) break;
+            if(signal == SIGHUP)
+            {
+                try
+                {
+                    start = timer::now();
+                    std::shared_ptr<const FMIndex> new_fmi(FMIndex::new_from_serialized_file(argv[optind]));
+                    double load_ms = milliseconds_since(start);
+                    server.index().swap(new_fmi);
+                    std::fprintf(stderr, "fmindex-server: reloaded %zu byte index in %.1f ms, swapped in %.1f ms\n",
+                                 new_fmi->size(), load_ms, milliseconds_since(start) - load_ms);
+                }
+                catch(const std::exception & e)
+                {
+                    std::fprintf(stderr, "fmindex-server: cannot reload index, still serving the old one: %s\n", e.what());
+                }
+            }
+            else std::fputs(server.report().c_str(), stderr);
+        }
+        server.stop();
+        return 0;
+    }
+    catch(const std::exception & e)
+    {
+        std::fprintf(stderr, "fmindex-server: %s\n", e.what());
+        return 1;
+    }
+}
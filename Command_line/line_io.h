@@ -0,0 +1,124 @@
+#ifndef FM_Index_line_io_h
+#define FM_Index_line_io_h
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Batched, buffered stdin and stdout, and argument parsing, for the command line tools.
+
+const size_t batch_bytes = 4 << 20;
+const size_t output_bytes = 1 << 20;
+
+typedef std::chrono::steady_clock timer;
+
+inline double milliseconds_since(const timer::time_point & start)
+{
+    return std::chrono::duration<double, std::milli>(timer::now() - start).count();
+}
+
+inline size_t parse_size(const char * arg, const std::string & what)
+{
+    char * end;
+    unsigned long long value = std::strtoull(arg, &end, 10);
+    if(*arg == '\0' || *end != '\0' || *arg == '-') throw std::invalid_argument("Invalid " + what + ": " + arg);
+    return static_cast<size_t>(value);
+}
+
+class output_buffer
+{
+private:
+    std::string buffer;
+
+public:
+    output_buffer(void) { buffer.reserve(output_bytes + 4096); }
+
+    ~output_buffer(void) { if(!buffer.empty()) std::fwrite(buffer.data(), 1, buffer.size(), stdout); }
+
+    void append(const char * s, const size_t n)
+    {
+        buffer.append(s, n);
+        if(buffer.size() >= output_bytes) flush();
+    }
+
+    void append(const std::string & s) { append(s.data(), s.size()); }
+
+    void append(const char c) { append(&c, 1); }
+
+    void append(size_t x)
+    {
+        char digits[24];
+        char * p = digits + sizeof(digits);
+        do { *--p = '0' + x % 10; x /= 10; } while(x > 0);
+        append(p, digits + sizeof(digits) - p);
+    }
+
+    void flush(void)
+    {
+        if(std::fwrite(buffer.data(), 1, buffer.size(), stdout) != buffer.size() || std::fflush(stdout) != 0)
+            throw std::runtime_error("Cannot write output");
+        buffer.clear();
+    }
+};
+
+/* Reads newline-delimited patterns from stdin a batch (about batch_bytes)
+   at a time. The patterns of a batch point into the reader's buffer, so
+   are only valid until the next call. */
+class pattern_reader
+{
+private:
+    std::vector<char> buffer;
+    size_t begin, end; // The unread part of buffer.
+    bool at_eof;
+
+public:
+    pattern_reader(void) : buffer(batch_bytes), begin(0), end(0), at_eof(false) { }
+
+    bool next_batch(std::vector<std::pair<const char *, size_t>> & patterns)
+    {
+        patterns.clear();
+        if(at_eof && begin == end) return false;
+
+        // Keep the partial last line of the previous batch, making room for at least one whole line.
+        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        if(end == buffer.size()) buffer.resize(2 * buffer.size());
+        while(!at_eof && end < buffer.size())
+        {
+            size_t n = std::fread(buffer.data() + end, 1, buffer.size() - end, stdin);
+            if(n == 0)
+            {
+                if(std::ferror(stdin)) throw std::runtime_error("Cannot read patterns");
+                at_eof = true;
+            }
+            end += n;
+            if(std::memchr(buffer.data() + end - n, '\n', n) != nullptr) break;
+        }
+
+        for(const char * p = buffer.data() + begin; ; )
+        {
+            const char * nl = static_cast<const char *>(std::memchr(p, '\n', buffer.data() + end - p));
+            if(nl == nullptr)
+            {
+                begin = p - buffer.data();
+                if(at_eof && begin < end)
+                {
+                    // An unterminated last line.
+                    patterns.push_back(std::make_pair(p, static_cast<size_t>(end - begin)));
+                    begin = end;
+                }
+                break;
+            }
+            patterns.push_back(std::make_pair(p, static_cast<size_t>(nl - p)));
+            p = nl + 1;
+        }
+        return !patterns.empty() || !(at_eof && begin == end);
+    }
+};
+
+#endif
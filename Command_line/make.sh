@@ -0,0 +1,11 @@
+#!/bin/bash
+rm -f fmindex fmindex-server fmindex-client BWT.o
+CC=${CC:-cc}
+CXX="${CXX:-c++} -std=c++11 -O2 -pthread -I../FM-Index -I../openbwt-v1.5"
+$CC -O2 -I../openbwt-v1.5 -c ../openbwt-v1.5/BWT.c -o BWT.o &&
+$CXX -o fmindex fmindex.cpp ../FM-Index/*.cpp BWT.o &&
+$CXX -o fmindex-server fmindex_server.cpp ../FM-Index/*.cpp BWT.o &&
+$CXX -o fmindex-client fmindex_client.cpp ../FM-Index/QueryClient.cpp
+status=$?
+rm -f BWT.o
+exit $status
@@ -1,36 +1,246 @@
 # distutils: language = c++
 # distutils: include_dirs = ../FM-Index ../openbwt-v1.5
-# distutils: sources = ../FM-Index/FMIndex.cpp ../FM-Index/WaveletTree.cpp ../FM-Index/BitVector.cpp ../openbwt-v1.5/BWT.c
+# distutils: sources = ../FM-Index/FMIndex.cpp ../FM-Index/WaveletTree.cpp ../FM-Index/WaveletMatrix.cpp ../FM-Index/BitVector.cpp ../FM-Index/DocumentCollection.cpp ../FM-Index/Pattern.cpp ../FM-Index/StorageAllocator.cpp ../openbwt-v1.5/BWT.c
 
-from libcpp.list cimport list
+from libcpp.list cimport list as cpp_list
 from libcpp.string cimport string
+from libcpp.vector cimport vector
+from libcpp.pair cimport pair
+from cpython.bytes cimport PyBytes_AS_STRING, PyBytes_GET_SIZE
+
+cdef extern from "Pattern.h":
+    cdef cppclass Pattern:
+        Pattern(string, bint) except +
 
 cdef extern from "FMIndex.h":
     cdef cppclass FMIndex:
-        FMIndex(string) except +
-        int findn(string)
-        list[string] find_lines(string)
-        void serialize_to_file(string)
-        size_t size()
+        FMIndex(string) except + nogil
+        size_t findn(const char *, size_t) except + nogil
+        void findn_batch(const char * const *, const size_t *, size_t, size_t *, size_t *) except + nogil
+        cpp_list[string] find_lines(string) except + nogil
+        cpp_list[string] find_lines_slice(string, size_t, size_t) except + nogil
+        size_t findn(const Pattern &) except + nogil
+        cpp_list[string] find_lines(const Pattern &) except + nogil
+        void serialize_to_file(string) except + nogil
+        size_t size() nogil
     #cdef FMIndex * new_from_serialized_file "FMIndex::new_from_serialized_file"(string)
 
 cdef extern from "FMIndex.h" namespace "FMIndex": # static member function hack
-    FMIndex * new_from_serialized_file(string)
+    FMIndex * new_from_serialized_file(string) except + nogil
+    FMIndex * new_from_buffer(const char *, size_t, size_t) except + nogil
+    FMIndex * new_from_file(string, size_t) except + nogil
+
+cdef extern from "DocumentCollection.h":
+    cdef cppclass DocumentCollection:
+        DocumentCollection(vector[string]) except + nogil
+        size_t n_documents() nogil
+        vector[pair[size_t, size_t]] locate(string) except + nogil
+        vector[pair[size_t, size_t]] list_documents(string) except + nogil
+        size_t document_frequency(string) except + nogil
+        void serialize_to_file(string) except + nogil
+
+cdef extern from "DocumentCollection.h":
+    DocumentCollection * new_document_collection_from_serialized_file "DocumentCollection::new_from_serialized_file"(string) except + nogil
+
+# Patterns may be bytes, str (encoded as UTF-8) or anything else supporting
+# the buffer protocol, e.g., bytearray, memoryview or a NumPy uint8 array.
+# All C++ work is done without the GIL so queries from several Python
+# threads run in parallel.
+
+cdef const unsigned char[::1] as_buffer(pattern) except *:
+    if isinstance(pattern, str):
+        pattern = (<str>pattern).encode('utf8')
+    return pattern
+
+cdef string as_string(pattern) except *:
+    cdef const unsigned char[::1] buf = as_buffer(pattern)
+    if buf.shape[0] == 0:
+        return string()
+    return string(<const char *>&buf[0], buf.shape[0])
+
+# Passed as the text by constructors which set thisptr themselves.
+cdef object _unset = object()
 
 cdef class PyFMIndex:
     cdef FMIndex * thisptr
-    def __cinit__(self, s):
-        self.thisptr = new FMIndex(s)
+    def __cinit__(self, s, size_t SA_sample_rate=32):
+        # The text is read in place, e.g., from bytes or an mmap.mmap, not copied.
+        cdef const unsigned char[::1] buf
+        cdef size_t length
+        if s is _unset:
+            return
+        buf = as_buffer(s)
+        length = buf.shape[0]
+        if length == 0:
+            raise ValueError("Cannot construct zero-length FMIndex")
+        with nogil:
+            self.thisptr = new_from_buffer(<const char *>&buf[0], length, SA_sample_rate)
+    @staticmethod
+    def from_buffer(s, size_t SA_sample_rate=32):
+        return PyFMIndex(s, SA_sample_rate)
+    @staticmethod
+    def from_file(filename, size_t SA_sample_rate=32):
+        """Index of the contents of a file, which is memory mapped rather than read into Python."""
+        cdef string f = as_string(filename)
+        cdef PyFMIndex fmi = PyFMIndex(_unset)
+        with nogil:
+            fmi.thisptr = new_from_file(f, SA_sample_rate)
+        return fmi
     def __dealloc__(self):
         del self.thisptr
     def findn(self, pattern):
-        return self.thisptr.findn(pattern)
+        cdef const unsigned char[::1] buf = as_buffer(pattern)
+        cdef const char * p = <const char *>&buf[0] if buf.shape[0] > 0 else NULL
+        cdef size_t length = buf.shape[0]
+        cdef size_t n
+        with nogil:
+            n = self.thisptr.findn(p, length)
+        return n
+    def findn_batch(self, patterns, return_lbs=False):
+        """Counts of each of patterns, a sequence of patterns or a NumPy array
+           of dtype 'S' (whose trailing NULs are ignored, as NumPy does), as a
+           NumPy array. With return_lbs, also the start of each suffix array
+           interval. Patterns are not copied."""
+        import numpy as np
+        cdef vector[const char *] ptrs
+        cdef vector[size_t] lengths
+        cdef const unsigned char[::1] buf
+        cdef size_t i, n, itemsize, length
+        cdef size_t[::1] counts_view, lbs_view
+        cdef size_t * lbs_ptr = NULL
+        keep = [] # Holds the buffers of the patterns until we are done.
+        if isinstance(patterns, np.ndarray) and patterns.dtype.kind == 'S':
+            patterns = np.ascontiguousarray(patterns).reshape(-1)
+            n = patterns.shape[0]
+            itemsize = patterns.dtype.itemsize
+            if n > 0 and itemsize > 0:
+                buf = patterns.view(np.uint8)
+                keep.append(patterns)
+                for i in range(n):
+                    length = itemsize
+                    while length > 0 and buf[i * itemsize + length - 1] == 0:
+                        length -= 1
+                    ptrs.push_back(<const char *>&buf[i * itemsize])
+                    lengths.push_back(length)
+            else:
+                ptrs.resize(n, NULL)
+                lengths.resize(n, 0)
+        else:
+            for pattern in patterns:
+                if isinstance(pattern, str):
+                    pattern = (<str>pattern).encode('utf8')
+                if isinstance(pattern, bytes): # Common case, so skip making a memoryview.
+                    keep.append(pattern)
+                    ptrs.push_back(PyBytes_AS_STRING(pattern))
+                    lengths.push_back(PyBytes_GET_SIZE(pattern))
+                else:
+                    buf = as_buffer(pattern)
+                    keep.append(buf)
+                    ptrs.push_back(<const char *>&buf[0] if buf.shape[0] > 0 else NULL)
+                    lengths.push_back(buf.shape[0])
+            n = ptrs.size()
+        counts = np.zeros(n, dtype=np.uintp)
+        lbs = np.zeros(n, dtype=np.uintp)
+        if n > 0:
+            counts_view = counts
+            if return_lbs:
+                lbs_view = lbs
+                lbs_ptr = &lbs_view[0]
+            with nogil:
+                self.thisptr.findn_batch(ptrs.data(), lengths.data(), n, &counts_view[0], lbs_ptr)
+        return (counts, lbs) if return_lbs else counts
     def find_lines(self, pattern):
-        return self.thisptr.find_lines(pattern)
+        cdef string p = as_string(pattern)
+        cdef cpp_list[string] lines
+        with nogil:
+            lines = self.thisptr.find_lines(p)
+        return lines
+    def find_lines_batch(self, patterns):
+        """find_lines of each of patterns, as a list of lists."""
+        cdef vector[string] ps
+        cdef vector[cpp_list[string]] lines
+        cdef size_t i
+        for pattern in patterns:
+            ps.push_back(as_string(pattern))
+        lines.resize(ps.size())
+        with nogil:
+            for i in range(ps.size()):
+                lines[i] = self.thisptr.find_lines(ps[i])
+        return [lines[i] for i in range(lines.size())]
+    def findn_pattern(self, pattern, case_insensitive=False):
+        cdef Pattern * p = new Pattern(as_string(pattern), case_insensitive)
+        cdef size_t n
+        try:
+            with nogil:
+                n = self.thisptr.findn(p[0])
+            return n
+        finally:
+            del p
+    def find_lines_pattern(self, pattern, case_insensitive=False):
+        cdef Pattern * p = new Pattern(as_string(pattern), case_insensitive)
+        cdef cpp_list[string] lines
+        try:
+            with nogil:
+                lines = self.thisptr.find_lines(p[0])
+            return lines
+        finally:
+            del p
+    def find_lines_slice(self, pattern, size_t offset, size_t limit):
+        cdef string p = as_string(pattern)
+        cdef cpp_list[string] lines
+        with nogil:
+            lines = self.thisptr.find_lines_slice(p, offset, limit)
+        return lines
     def new_from_serialized_file(self, filename):
+        cdef string f = as_string(filename)
         del self.thisptr
-        self.thisptr = new_from_serialized_file(filename)
+        self.thisptr = NULL
+        with nogil:
+            self.thisptr = new_from_serialized_file(f)
     def serialize_to_file(self, filename):
-        self.thisptr.serialize_to_file(filename)
+        cdef string f = as_string(filename)
+        with nogil:
+            self.thisptr.serialize_to_file(f)
     def size(self):
         return self.thisptr.size()
+
+cdef class PyDocumentCollection:
+    cdef DocumentCollection * thisptr
+    def __cinit__(self, documents):
+        cdef vector[string] docs
+        for document in documents:
+            docs.push_back(as_string(document))
+        with nogil:
+            self.thisptr = new DocumentCollection(docs)
+    def __dealloc__(self):
+        del self.thisptr
+    def n_documents(self):
+        return self.thisptr.n_documents()
+    def locate(self, pattern):
+        cdef string p = as_string(pattern)
+        cdef vector[pair[size_t, size_t]] matches
+        with nogil:
+            matches = self.thisptr.locate(p)
+        return matches
+    def list_documents(self, pattern):
+        cdef string p = as_string(pattern)
+        cdef vector[pair[size_t, size_t]] documents
+        with nogil:
+            documents = self.thisptr.list_documents(p)
+        return documents
+    def document_frequency(self, pattern):
+        cdef string p = as_string(pattern)
+        cdef size_t n
+        with nogil:
+            n = self.thisptr.document_frequency(p)
+        return n
+    def new_from_serialized_file(self, filename):
+        cdef string f = as_string(filename)
+        del self.thisptr
+        self.thisptr = NULL
+        with nogil:
+            self.thisptr = new_document_collection_from_serialized_file(f)
+    def serialize_to_file(self, filename):
+        cdef string f = as_string(filename)
+        with nogil:
+            self.thisptr.serialize_to_file(f)
@@ -1,7 +1,9 @@
 #include <stdexcept>
+#include <algorithm>
 
 #include "BitVector.h"
 #include "serializing.h"
+#include "instrumentation.h"
 
 BitVector::BitVector(const std::vector<bool> & data)
 {
@@ -10,8 +12,8 @@ BitVector::BitVector(const std::vector<bool> & data)
     q = data.size() / superblock_sz_bits;
     r = data.size() % superblock_sz_bits;
 
-    superblock_ranks = std::unique_ptr<uint32_t[]>(new uint32_t[q]);
-    this->data = std::unique_ptr<block_t[]>(new block_t[1 + data.size() / size_of_data_t_bits]);
+    superblock_ranks = allocate_storage<uint32_t>(q);
+    this->data = allocate_storage<block_t>(1 + data.size() / size_of_data_t_bits);
 
     size_t rk = 0;
     size_t i = 0;
@@ -39,6 +41,7 @@ BitVector::BitVector(const std::vector<bool> & data)
 size_t BitVector::rank(const size_t i) const
 {
     if(i >= size()) throw std::out_of_range("BitVector rank out of range");
+    FM_INDEX_COUNT(rank_calls, 1);
 
     /* We could get an on-average 2x speedup by scanning back from the
        next biggest superblock when we're nearer the end of the superblock
@@ -54,6 +57,12 @@ size_t BitVector::rank(const size_t i) const
     return rk + __builtin_popcountl(data[i2] >> (size_of_data_t_bits - rr - 1));
 }
 
+size_t BitVector::n_superblock_ranks(void) const
+{
+    // The rank after the last superblock is only set if a partial superblock follows it.
+    return r == 0 && q > 0 ? q - 1 : q;
+}
+
 size_t BitVector::rank0(const size_t i) const
 {
     return i+1 - rank(i);
@@ -67,12 +76,62 @@ size_t BitVector::rank1(const size_t i) const
 bool BitVector::select(const size_t i) const
 {
     if(i >= size()) throw std::out_of_range("BitVector select out of range");
+    FM_INDEX_COUNT(select_calls, 1);
 
     size_t qq = i / size_of_data_t_bits;
     size_t rr = i % size_of_data_t_bits;
     return ((data[qq] >> (size_of_data_t_bits - rr - 1)) & 1) == 1;
 }
 
+size_t BitVector::select1(const size_t k) const
+{
+    if(k >= rank1(size() - 1)) throw std::out_of_range("BitVector select1 out of range");
+    FM_INDEX_COUNT(select_calls, 1);
+
+    // Binary search for the superblock containing the bit then scan its blocks.
+    size_t qq = std::upper_bound(superblock_ranks.get(), superblock_ranks.get() + n_superblock_ranks(), k) - superblock_ranks.get();
+    size_t rk = qq > 0 ? superblock_ranks[qq-1] : 0;
+    size_t j = qq * (superblock_sz_bits / size_of_data_t_bits);
+    while(rk + __builtin_popcountl(data[j]) <= k) rk += __builtin_popcountl(data[j++]);
+    size_t rr = 0;
+    for(block_t x = data[j]; ; rr++)
+        if(((x >> (size_of_data_t_bits - rr - 1)) & 1) == 1 && rk++ == k) break;
+    return j * size_of_data_t_bits + rr;
+}
+
+size_t BitVector::select0(const size_t k) const
+{
+    if(k >= rank0(size() - 1)) throw std::out_of_range("BitVector select0 out of range");
+    FM_INDEX_COUNT(select_calls, 1);
+
+    // As select1, counting unset bits: superblock qq-1 ends after qq * superblock_sz_bits - superblock_ranks[qq-1] of them.
+    size_t lo = 0, hi = n_superblock_ranks();
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if((mid + 1) * superblock_sz_bits - superblock_ranks[mid] <= k) lo = mid + 1;
+        else hi = mid;
+    }
+    size_t qq = lo;
+    size_t rk = qq > 0 ? qq * superblock_sz_bits - superblock_ranks[qq-1] : 0;
+    size_t j = qq * (superblock_sz_bits / size_of_data_t_bits);
+    while(rk + __builtin_popcountl(~data[j]) <= k) rk += __builtin_popcountl(~data[j++]);
+    size_t rr = 0;
+    for(block_t x = data[j]; ; rr++)
+        if(((x >> (size_of_data_t_bits - rr - 1)) & 1) == 0 && rk++ == k) break;
+    return j * size_of_data_t_bits + rr;
+}
+
+size_t BitVector::bytes_of_bits(void) const
+{
+    return sizeof(block_t) * (1 + size() / size_of_data_t_bits);
+}
+
+size_t BitVector::bytes_of_rank_directory(void) const
+{
+    return sizeof(uint32_t) * q;
+}
+
 size_t BitVector::size(void) const
 {
     return r + q * superblock_sz_bits;
@@ -88,10 +147,10 @@ BitVector::BitVector(std::istreambuf_iterator<char> serial_data)
 
     deserialize_from_chars(serial_data, q);
     deserialize_from_chars(serial_data, r);
-    data = std::unique_ptr<block_t[]>(new block_t[1 + size() / size_of_data_t_bits]);
+    data = allocate_storage<block_t>(1 + size() / size_of_data_t_bits);
     for(size_t i = 0; i <= size() / size_of_data_t_bits; i++)
         deserialize_from_chars(serial_data, data[i]);
-    superblock_ranks = std::unique_ptr<uint32_t[]>(new uint32_t[q]);
+    superblock_ranks = allocate_storage<uint32_t>(q);
     for(size_t i = 0; i < q; i++)
         deserialize_from_chars(serial_data, superblock_ranks[i]);
 }
@@ -3,18 +3,22 @@
 
 #include <vector>
 
+#include "StorageAllocator.h"
+
 class BitVector
 {
 private:
     typedef uint64_t block_t; // NB: Type must match __builtin_popcount or __builtin_popcountl etc in rank method.
     static const size_t superblock_sz_bits = 512; // Must be multiple of size_of_data_t_bits.
     static const size_t size_of_data_t_bits = 8 * sizeof(block_t);
-    std::unique_ptr<block_t[]> data; // Should be slightly faster than std::bitset<...> *data. (Also not sure size overhead of std::bitset<...> is 0.)
-    std::unique_ptr<uint32_t[]> superblock_ranks; // 32 bits might not be enough but unlikely on "real" data. Overflow throws exception anyway.
+    storage_array<block_t> data; // Should be slightly faster than std::bitset<...> *data. (Also not sure size overhead of std::bitset<...> is 0.)
+    storage_array<uint32_t> superblock_ranks; // 32 bits might not be enough but unlikely on "real" data. Overflow throws exception anyway.
     size_t q, r;
 
     size_t rank(const size_t i) const;
 
+    size_t n_superblock_ranks(void) const; // Number of valid entries of superblock_ranks.
+
 public:
     BitVector(const std::vector<bool> & data);
 
@@ -26,8 +30,16 @@ public:
 
     bool select(const size_t i) const;
 
+    size_t select1(const size_t k) const; // Position of the k-th (counting from 0) set bit.
+
+    size_t select0(const size_t k) const; // Position of the k-th (counting from 0) unset bit.
+
     size_t size(void) const;
 
+    size_t bytes_of_bits(void) const;
+
+    size_t bytes_of_rank_directory(void) const; // Superblock ranks.
+
     void serialize(std::ostreambuf_iterator<char> serial_data) const;
 };
 
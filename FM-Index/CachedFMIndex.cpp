@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include "CachedFMIndex.h"
+
+CachedFMIndex::frequency_sketch::frequency_sketch(const size_t width)
+    : counters(depth * width),
+      width_mask(width - 1),
+      n_additions(0),
+      reset_period(10 * width)
+{
+    if(width == 0 || (width & (width - 1)) != 0) throw std::invalid_argument("Sketch width must be a power of two");
+}
+
+size_t CachedFMIndex::frequency_sketch::index(const size_t hash, const size_t row) const
+{
+    // Remix the hash per row: the shard of a query is chosen by the low bits of the same hash.
+    unsigned long long h = (static_cast<unsigned long long>(hash) + row) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+    return row * (width_mask + 1) + static_cast<size_t>(h & width_mask);
+}
+
+void CachedFMIndex::frequency_sketch::add(const size_t hash)
+{
+    for(size_t row = 0; row < depth; row++)
+    {
+        unsigned char & counter = counters[index(hash, row)];
+        if(counter < 15) counter++;
+    }
+    if(++n_additions == reset_period)
+    {
+        // Age all counts so that the sketch follows the recent traffic.
+        for(auto & counter : counters) counter /= 2;
+        n_additions /= 2;
+    }
+}
+
+unsigned char CachedFMIndex::frequency_sketch::estimate(const size_t hash) const
+{
+    unsigned char freq = 15;
+    for(size_t row = 0; row < depth; row++)
+        freq = std::min(freq, counters[index(hash, row)]);
+    return freq;
+}
+
+CachedFMIndex::CachedFMIndex(const std::shared_ptr<const FMIndex> & fmi,
+                             const size_t max_bytes,
+                             const size_t n_shards)
+    : fmi(fmi),
+      shard_max_bytes(n_shards == 0 ? 0 : max_bytes / n_shards),
+      hits(0),
+      misses(0),
+      admissions(0),
+      rejections(0),
+      evictions(0)
+{
+    if(!fmi) throw std::invalid_argument("Cannot cache null FMIndex");
+    if(n_shards == 0) throw std::invalid_argument("CachedFMIndex needs at least one shard");
+
+    // Size the sketches for roughly as many queries as a shard can hold small results for.
+    size_t sketch_width = 64;
+    while(sketch_width < shard_max_bytes / 128) sketch_width *= 2;
+    for(size_t i = 0; i < n_shards; i++)
+        shards.push_back(std::unique_ptr<shard>(new shard(sketch_width)));
+}
+
+const FMIndex & CachedFMIndex::index(void) const
+{
+    return *fmi;
+}
+
+bool CachedFMIndex::lookup(const std::string & key,
+                           const size_t hash,
+                           entry & result) const
+{
+    shard & s = *shards[hash % shards.size()];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.sketch.add(hash);
+    auto it = s.entries.find(key);
+    if(it == s.entries.end())
+    {
+        misses++;
+        return false;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    result.interval = it->second->interval;
+    result.lines = it->second->lines;
+    hits++;
+    return true;
+}
+
+void CachedFMIndex::insert(entry && e, const size_t hash) const
+{
+    shard & s = *shards[hash % shards.size()];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if(s.entries.count(e.key) > 0) return; // Another thread got here first.
+    if(e.bytes > shard_max_bytes)
+    {
+        rejections++;
+        return;
+    }
+
+    /* Find the least-recently-used entries which would have to go to make room
+       and only admit the new entry if it is more popular than all of them. */
+    const unsigned char freq = s.sketch.estimate(hash);
+    size_t freed = 0, n_victims = 0;
+    for(auto it = s.lru.rbegin(); s.bytes - freed + e.bytes > shard_max_bytes; ++it, n_victims++)
+    {
+        if(s.sketch.estimate(it->hash) >= freq)
+        {
+            rejections++;
+            return;
+        }
+        freed += it->bytes;
+    }
+    for(; n_victims > 0; n_victims--)
+    {
+        s.bytes -= s.lru.back().bytes;
+        s.entries.erase(s.lru.back().key);
+        s.lru.pop_back();
+        evictions++;
+    }
+
+    s.bytes += e.bytes;
+    s.lru.push_front(std::move(e));
+    s.entries[s.lru.front().key] = s.lru.begin();
+    admissions++;
+}
+
+std::pair<size_t, size_t> CachedFMIndex::find_interval(const std::string & pattern) const
+{
+    if(pattern.empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    entry e;
+    e.key = 'I' + pattern;
+    e.hash = std::hash<std::string>()(e.key);
+    if(lookup(e.key, e.hash, e)) return e.interval;
+
+    e.interval = fmi->find_interval(pattern);
+    std::pair<size_t, size_t> interval = e.interval;
+    e.bytes = sizeof(entry) + 2 * e.key.size(); // The key is stored twice: in the entry and the map.
+    insert(std::move(e), e.hash);
+    return interval;
+}
+
+size_t CachedFMIndex::findn(const std::string & pattern) const
+{
+    std::pair<size_t, size_t> interval = find_interval(pattern);
+    return interval.second <= interval.first ? 0 : interval.second - interval.first;
+}
+
+std::list<std::string> CachedFMIndex::find_lines(const std::string & pattern,
+                                                 const char new_line_char,
+                                                 const size_t max_context) const
+{
+    if(pattern.empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    entry e;
+    e.key = 'L' + std::string(1, new_line_char) +
+            std::string(reinterpret_cast<const char *>(&max_context), sizeof(max_context)) + pattern;
+    e.hash = std::hash<std::string>()(e.key);
+    if(lookup(e.key, e.hash, e)) return *e.lines;
+
+    std::shared_ptr<const std::list<std::string>> lines =
+        std::make_shared<const std::list<std::string>>(fmi->find_lines(pattern, new_line_char, max_context));
+    e.lines = lines;
+    e.interval = std::make_pair(1, 0);
+    e.bytes = sizeof(entry) + 2 * e.key.size() + sizeof(std::list<std::string>);
+    for(auto & line : *lines) e.bytes += sizeof(std::string) + 2 * sizeof(void *) + line.size();
+    insert(std::move(e), e.hash);
+    return *lines;
+}
+
+CachedFMIndex::statistics CachedFMIndex::stats(void) const
+{
+    statistics st;
+    st.hits = hits;
+    st.misses = misses;
+    st.admissions = admissions;
+    st.rejections = rejections;
+    st.evictions = evictions;
+    st.n_entries = st.bytes = 0;
+    for(auto & s : shards)
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        st.n_entries += s->entries.size();
+        st.bytes += s->bytes;
+    }
+    return st;
+}
+
+void CachedFMIndex::clear(void)
+{
+    for(auto & s : shards)
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->entries.clear();
+        s->lru.clear();
+        s->bytes = 0;
+    }
+}
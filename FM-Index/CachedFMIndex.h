@@ -0,0 +1,105 @@
+#ifndef __FM_Index__CachedFMIndex__
+#define __FM_Index__CachedFMIndex__
+
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+
+#include "FMIndex.h"
+
+/* Caches the results of queries against an FMIndex: the suffix array interval
+   of each pattern and, for find_lines, the lines themselves. Repeat queries
+   then cost one hash lookup.
+
+   The cache is split into shards by hash of the query, each with its own lock,
+   LRU list and byte budget (max_bytes / n_shards). Admission follows TinyLFU
+   (Einziger, Friedman & Manes): each shard keeps a count-min sketch of how
+   often queries are seen, with counters halved periodically so it follows
+   changes in traffic. A new result only displaces the least-recently-used ones if it has
+   been seen more often than each of them, so one-off queries do not flush the
+   cache of popular ones.
+
+   All methods may be called concurrently. */
+class CachedFMIndex
+{
+public:
+    struct statistics
+    {
+        size_t hits, misses;
+        size_t admissions, rejections, evictions;
+        size_t n_entries, bytes;
+    };
+
+private:
+    struct entry
+    {
+        std::string key;
+        std::pair<size_t, size_t> interval;
+        std::shared_ptr<const std::list<std::string>> lines; // Only set for find_lines queries.
+        size_t hash, bytes;
+    };
+
+    class frequency_sketch
+    {
+    private:
+        std::vector<unsigned char> counters; // depth rows of width counters, each saturating at 15.
+        size_t width_mask, n_additions, reset_period;
+        static const size_t depth = 4;
+
+        size_t index(const size_t hash, const size_t row) const;
+
+    public:
+        explicit frequency_sketch(const size_t width);
+
+        void add(const size_t hash);
+
+        unsigned char estimate(const size_t hash) const;
+    };
+
+    struct shard
+    {
+        std::mutex mutex;
+        std::list<entry> lru; // Most recently used first.
+        std::unordered_map<std::string, std::list<entry>::iterator> entries;
+        frequency_sketch sketch;
+        size_t bytes;
+
+        explicit shard(const size_t sketch_width) : sketch(sketch_width), bytes(0) { }
+    };
+
+    std::shared_ptr<const FMIndex> fmi;
+    const size_t shard_max_bytes;
+    std::vector<std::unique_ptr<shard>> shards;
+    mutable std::atomic<size_t> hits, misses, admissions, rejections, evictions;
+
+    bool lookup(const std::string & key,
+                const size_t hash,
+                entry & result) const;
+
+    void insert(entry && e, const size_t hash) const;
+
+public:
+    CachedFMIndex(const std::shared_ptr<const FMIndex> & fmi,
+                  const size_t max_bytes = 64 << 20,
+                  const size_t n_shards = 16);
+
+    const FMIndex & index(void) const;
+
+    std::pair<size_t, size_t> find_interval(const std::string & pattern) const;
+
+    size_t findn(const std::string & pattern) const;
+
+    std::list<std::string> find_lines(const std::string & pattern,
+                                      const char new_line_char = '\n',
+                                      const size_t max_context = 100) const;
+
+    statistics stats(void) const;
+
+    void clear(void); // Drops all entries; the statistics and sketches are kept.
+};
+
+#endif /* defined(__FM_Index__CachedFMIndex__) */
@@ -0,0 +1,119 @@
+#include <stdexcept>
+#include <fstream>
+#include <cerrno>
+#include <system_error>
+
+#include "DocumentCollection.h"
+#include "serializing.h"
+
+DocumentCollection::DocumentCollection(const std::vector<std::string> & documents,
+                                       const char separator,
+                                       const size_t SA_sample_rate)
+    : separator(separator)
+{
+    if(documents.empty()) throw std::length_error("Cannot construct DocumentCollection with no documents");
+
+    std::string s;
+    std::vector<bool> doc_starts_v;
+    for(auto & document : documents)
+    {
+        if(document.find(separator) != std::string::npos)
+            throw std::invalid_argument("Document contains the separator, so matches in it would be put in the wrong document");
+        doc_starts_v.push_back(true);
+        doc_starts_v.resize(doc_starts_v.size() + document.size());
+        s += document;
+        s.push_back(separator);
+    }
+    fmi = std::unique_ptr<FMIndex>(new FMIndex(s, SA_sample_rate));
+    s.clear();
+    s.shrink_to_fit();
+    doc_starts = std::unique_ptr<BitVector>(new BitVector(doc_starts_v));
+
+    // Overwrite suffix array with document array in place.
+    std::vector<size_t> D = fmi->suffix_array();
+    for(size_t i = 0; i < D.size(); i++)
+        D[i] = D[i] < doc_starts->size() ? doc_starts->rank1(D[i]) - 1 : documents.size() - 1; // Empty suffix goes with last document.
+    doc_array = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(D));
+}
+
+size_t DocumentCollection::n_documents(void) const
+{
+    return doc_starts->rank1(doc_starts->size() - 1);
+}
+
+const FMIndex & DocumentCollection::index(void) const
+{
+    return *fmi;
+}
+
+size_t DocumentCollection::document_start(const size_t doc_id) const
+{
+    return doc_starts->select1(doc_id);
+}
+
+void DocumentCollection::check_pattern(const std::string & pattern) const
+{
+    if(pattern.find(separator) != std::string::npos)
+        throw std::invalid_argument("Pattern contains the separator, so could match across documents");
+}
+
+std::pair<size_t, size_t> DocumentCollection::document_of(const size_t text_position) const
+{
+    size_t doc_id = doc_starts->rank1(text_position) - 1;
+    return std::make_pair(doc_id, text_position - document_start(doc_id));
+}
+
+std::vector<std::pair<size_t, size_t>> DocumentCollection::locate(const std::string & pattern) const
+{
+    check_pattern(pattern);
+    std::vector<std::pair<size_t, size_t>> matches;
+    for(size_t pos : fmi->locate(pattern)) matches.push_back(document_of(pos));
+    return matches;
+}
+
+std::vector<std::pair<size_t, size_t>> DocumentCollection::list_documents(const std::string & pattern) const
+{
+    check_pattern(pattern);
+    size_t lb, ub;
+    std::tie(lb, ub) = fmi->find_interval(pattern);
+    std::vector<std::pair<size_t, size_t>> docs;
+    if(lb < ub) doc_array->distinct(lb, ub, docs);
+    return docs;
+}
+
+size_t DocumentCollection::document_frequency(const std::string & pattern) const
+{
+    return list_documents(pattern).size();
+}
+
+DocumentCollection::DocumentCollection(std::istreambuf_iterator<char> serial_data)
+{
+    fmi = std::unique_ptr<FMIndex>(new FMIndex(serial_data));
+    separator = *serial_data;
+    ++serial_data;
+    doc_starts = std::unique_ptr<BitVector>(new BitVector(serial_data));
+    doc_array = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(serial_data));
+}
+
+void DocumentCollection::serialize(std::ostreambuf_iterator<char> serial_data) const
+{
+    fmi->serialize(serial_data);
+    *serial_data = separator;
+    ++serial_data;
+    doc_starts->serialize(serial_data);
+    doc_array->serialize(serial_data);
+}
+
+void DocumentCollection::serialize_to_file(const std::string & filename) const
+{
+    std::ofstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
+    serialize(std::ostreambuf_iterator<char>{f});
+}
+
+DocumentCollection * DocumentCollection::new_from_serialized_file(const std::string & filename)
+{
+    std::ifstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
+    return new DocumentCollection{std::istreambuf_iterator<char>{f}};
+}
@@ -0,0 +1,54 @@
+#ifndef __FM_Index__DocumentCollection__
+#define __FM_Index__DocumentCollection__
+
+#include <vector>
+#include <string>
+#include <iterator>
+
+#include "FMIndex.h"
+#include "WaveletMatrix.h"
+
+class DocumentCollection
+{
+private:
+    std::unique_ptr<FMIndex> fmi; // Index of the documents concatenated, each followed by separator.
+    std::unique_ptr<BitVector> doc_starts; // Bit i set iff a document starts at text position i.
+    std::unique_ptr<WaveletMatrix> doc_array; // Document containing the suffix of each suffix array row.
+    char separator;
+
+    void check_pattern(const std::string & pattern) const;
+
+public:
+    /* Neither documents nor patterns may contain the separator (std::invalid_argument),
+       so that no match crosses the boundary between two documents. */
+    DocumentCollection(const std::vector<std::string> & documents,
+                       const char separator = '\0',
+                       const size_t SA_sample_rate = 32);
+
+    DocumentCollection(std::istreambuf_iterator<char> serial_data);
+
+    size_t n_documents(void) const;
+
+    const FMIndex & index(void) const;
+
+    size_t document_start(const size_t doc_id) const;
+
+    std::pair<size_t, size_t> document_of(const size_t text_position) const; // (doc_id, offset within document)
+
+    std::vector<std::pair<size_t, size_t>> locate(const std::string & pattern) const; // (doc_id, offset) of each match.
+
+    /* The distinct documents containing the pattern, as (doc_id, number of matches)
+       in increasing order of doc_id. The time taken is proportional to the number of
+       documents listed (times log n_documents) not the number of matches. */
+    std::vector<std::pair<size_t, size_t>> list_documents(const std::string & pattern) const;
+
+    size_t document_frequency(const std::string & pattern) const;
+
+    void serialize(std::ostreambuf_iterator<char> serial_data) const;
+
+    void serialize_to_file(const std::string & filename) const;
+
+    static DocumentCollection * new_from_serialized_file(const std::string & filename);
+};
+
+#endif /* defined(__FM_Index__DocumentCollection__) */
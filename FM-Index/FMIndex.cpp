@@ -1,11 +1,185 @@
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iterator>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "FMIndex.h"
 #include "openbwt.h"
 #include "serializing.h"
 #include "misc.h"
+#include "instrumentation.h"
+#include "StorageAllocator.h"
+
+namespace
+{
+    struct query_parallelism
+    {
+        size_t max_threads, min_matches;
+    };
+
+    query_parallelism & thread_query_parallelism(void)
+    {
+        static thread_local query_parallelism parallelism = {1, 100000};
+        return parallelism;
+    }
+
+    /* Serialized indexes start with the magic bytes and the version of their
+       layout, which is incremented whenever fields are added or changed. */
+    const char serial_magic[8] = {'F', 'M', '-', 'I', 'n', 'd', 'e', 'x'};
+    const size_t serial_version = 1;
+
+    /* Rank queries on a BWT held as plain characters, for merging: the count
+       of each character before every 256th, then a scan of the rest. Much
+       faster than a WaveletTree for the one-off queries of merge_order, and
+       about 1 byte per character per 32 distinct characters. */
+    class rank_directory
+    {
+    private:
+        static const size_t step = 256;
+        const char * BWT;
+        size_t n, sigma;
+        size_t codes[256];
+        std::vector<size_t> counts; // Of code x before position b * step at b * sigma + x.
+
+        // Occurrences of c in [begin, end), a word at a time.
+        static size_t count(const char * begin, const char * end, const char c)
+        {
+            const uint64_t ones = ~uint64_t(0) / 255, low7 = ones * 0x7f, pattern = ones * static_cast<unsigned char>(c);
+            size_t rk = 0;
+            for(; end - begin >= 8; begin += 8)
+            {
+                uint64_t w;
+                std::memcpy(&w, begin, 8);
+                w ^= pattern; // Zero bytes where c is.
+                rk += __builtin_popcountll(~(((w & low7) + low7) | w | low7));
+            }
+            for(; begin < end; begin++) rk += *begin == c;
+            return rk;
+        }
+
+    public:
+        rank_directory(const char * BWT, const size_t n)
+            : BWT(BWT),
+              n(n),
+              sigma(0)
+        {
+            bool seen[256] = {false};
+            for(size_t i = 0; i < n; i++) seen[static_cast<unsigned char>(BWT[i])] = true;
+            for(int c = 0; c < 256; c++) codes[c] = seen[c] ? sigma++ : 0;
+            counts.assign((n / step + 1) * sigma, 0);
+            std::vector<size_t> count(sigma, 0);
+            for(size_t i = 0; i < n; i++)
+            {
+                if(i % step == 0) std::copy(count.begin(), count.end(), counts.begin() + (i / step) * sigma);
+                count[codes[static_cast<unsigned char>(BWT[i])]]++;
+            }
+            if(n % step == 0) std::copy(count.begin(), count.end(), counts.begin() + (n / step) * sigma);
+            for(int c = 0; c < 256; c++)
+                if(!seen[c]) codes[c] = sigma; // Not in the BWT.
+        }
+
+        // Occurrences of c in the first len characters.
+        size_t rank(const size_t len, const char c) const
+        {
+            const size_t code = codes[static_cast<unsigned char>(c)];
+            if(code == sigma) return 0;
+            // Count from the nearer of the positions with counts.
+            const size_t b = len / step;
+            if(len % step > step / 2 && b < n / step)
+                return counts[(b + 1) * sigma + code] - count(BWT + len, BWT + (b + 1) * step, c);
+            return counts[b * sigma + code] + count(BWT + b * step, BWT + len, c);
+        }
+
+        // Sets C[c] to the number of characters less than c, for each c.
+        void cumulative_counts(size_t * C) const
+        {
+            size_t total = 0;
+            for(int c = 0; c < 256; c++)
+            {
+                C[c] = total;
+                if(codes[c] != sigma) total += rank(n, static_cast<char>(c));
+            }
+        }
+    };
+
+    // Bits in files, eight to a byte, for external_BWT.
+    class bit_writer
+    {
+        std::filebuf & out;
+        unsigned char byte;
+        size_t n;
+
+    public:
+        bit_writer(std::filebuf & out) : out(out), byte(0), n(0) {}
+
+        void push_back(const bool bit)
+        {
+            byte |= static_cast<unsigned char>(bit) << (n++ % 8);
+            if(n % 8 == 0)
+            {
+                out.sputc(static_cast<char>(byte));
+                byte = 0;
+            }
+        }
+
+        // Writes out a partial last byte; only call at the end.
+        void flush(void)
+        {
+            if(n % 8 != 0) out.sputc(static_cast<char>(byte));
+        }
+    };
+
+    class bit_reader
+    {
+        std::filebuf & in;
+        unsigned char byte;
+        size_t n;
+
+    public:
+        bit_reader(std::filebuf & in) : in(in), byte(0), n(0) {}
+
+        bool next(void)
+        {
+            if(n++ % 8 == 0)
+            {
+                const int c = in.sbumpc();
+                if(c == std::char_traits<char>::eof()) throw std::runtime_error("Unexpected end of bit file");
+                byte = static_cast<unsigned char>(c);
+            }
+            return (byte >> ((n - 1) % 8)) & 1;
+        }
+    };
+
+    // Bits [first, last) of a file written by bit_writer.
+    std::vector<bool> read_bits(const std::string & filename, const size_t first, const size_t last)
+    {
+        std::vector<bool> bits;
+        if(first == last) return bits;
+        std::filebuf in;
+        if(!in.open(filename, std::ios::in | std::ios::binary)) throw std::runtime_error("Cannot open " + filename);
+        in.pubseekpos(first / 8);
+        bit_reader reader(in);
+        for(size_t i = first - first % 8; i < last; i++)
+        {
+            const bool bit = reader.next();
+            if(i >= first) bits.push_back(bit);
+        }
+        return bits;
+    }
+}
 
 FMIndex::const_iterator::const_iterator(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
                                         const size_t end_idx,
@@ -36,6 +210,7 @@ bool FMIndex::const_iterator::operator!=(const FMIndex::const_iterator & it)
 FMIndex::const_iterator & FMIndex::const_iterator::operator++(void)
 {
     if(at_end()) throw std::overflow_error("Attempt to increment ended const_iterator");
+    FM_INDEX_COUNT(LF_steps, 1);
     i = C.find(c)->second + BWT_or_BWTr->rank(BWT_idx_from_row_idx(i, end_idx), c);
     if(!at_end()) c = BWT_or_BWTr->select(BWT_idx_from_row_idx(i, end_idx));
     return *this;
@@ -65,69 +240,152 @@ size_t FMIndex::BWT_idx_from_row_idx(const size_t i, const size_t end_idx)
     return (i > end_idx ? i-1 : i);
 }
 
-template <typename ForwardIterator>
-std::pair<size_t, size_t> FMIndex::backward_search(ForwardIterator i_pattern,
-                                                   ForwardIterator i_pattern_end,
-                                                   const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
-                                                   const size_t end_idx) const
-{
-    std::pair<size_t, size_t> no_matches(1, 0);
-
-    std::map<char, size_t>::const_iterator C_it = C.find(*i_pattern);
-    if(C_it == C.end()) return no_matches;
-    /* lb and ub define the half-open interval (lb, ub] of row indexes into the
-       hypothetical matrix for which the rows are prefixed by the pattern. */
-    size_t lb = C_it->second;
-    size_t ub = (++C_it == C.end() ? BWT_or_BWTr->size() : C_it->second);
-    for(++i_pattern; i_pattern != i_pattern_end; ++i_pattern)
-    {
-        C_it = C.find(*i_pattern);
-        if(C_it == C.end()) return no_matches;
-        lb = C_it->second + BWT_or_BWTr->rank(BWT_idx_from_row_idx(lb == end_idx ? lb-1 : lb, end_idx), *i_pattern); // NB end_idx > 0 always so cannot have lb == 0 if lb == end_idx
-        ub = C_it->second + BWT_or_BWTr->rank(BWT_idx_from_row_idx(ub == end_idx ? ub-1 : ub, end_idx), *i_pattern); // As above
-        if(ub <= lb) return no_matches;
-    }
-    return std::make_tuple(lb + 1, ub + 1); // Return as more-conventional half-open interval [lb, ub)
-}
-
-void FMIndex::msd_sort(size_t * fr_perm,
-                       const size_t len,
-                       const_iterator ** text_iters,
-                       const size_t depth_left) const
-{
-    // Hybrid of most-significant-digit radix sort and std::sort.
-    // TODO: Replace std::sort with American Flag Sort.
-    std::sort(fr_perm, fr_perm + len,
-              [text_iters](const size_t i, const size_t j) -> bool
-              {
-                  if(text_iters[j]->at_end()) return false;
-                  if(text_iters[i]->at_end()) return true;
-                  return static_cast<unsigned char>(**text_iters[i]) <
-                         static_cast<unsigned char>(**text_iters[j]);
-              });
-    int c = -1;
-    if(!text_iters[fr_perm[0]]->at_end())
-    {
-        c = static_cast<unsigned char>(**text_iters[fr_perm[0]]);
-        ++(*(text_iters[fr_perm[0]]));
-    }
-    size_t j = 0;
-    for(size_t i = 1; i < len; i++)
-    {
-        int cc = -1;
-        if(!text_iters[fr_perm[i]]->at_end())
-        {
-            cc = static_cast<unsigned char>(**text_iters[fr_perm[i]]);
-            ++(*(text_iters[fr_perm[i]]));
-        }
-        if(cc != c)
+void FMIndex::set_thread_query_parallelism(const size_t max_threads, const size_t min_matches)
+{
+    thread_query_parallelism() = query_parallelism{std::max<size_t>(max_threads, 1), std::max<size_t>(min_matches, 1)};
+}
+
+size_t FMIndex::query_parts(const size_t n_matches)
+{
+    const query_parallelism & parallelism = thread_query_parallelism();
+    return std::max<size_t>(std::min(parallelism.max_threads, n_matches / parallelism.min_matches), 1);
+}
+
+void FMIndex::for_each_part(const size_t n, const std::function<void(size_t, size_t, size_t)> & f)
+{
+    /* Parts are of equal size, so take about equal time as the matches are
+       in suffix array order, unrelated to where they are in the text. The
+       work done on other threads is counted in the calling thread's counters. */
+    const size_t n_parts = query_parts(n), part_size = (n + n_parts - 1) / n_parts;
+    std::vector<std::future<query_counters>> threads;
+    for(size_t part = 1; part < n_parts; part++)
+        threads.push_back(std::async(std::launch::async, [&f, n, part, part_size]()
+        {
+            reset_thread_query_counters();
+            f(part, part * part_size, std::min(n, (part + 1) * part_size));
+            return thread_query_counters();
+        }));
+    f(0, 0, std::min(n, part_size));
+    for(auto & thread : threads)
+    {
+        query_counters counters = thread.get();
+        FM_INDEX_COUNT(rank_calls, counters.rank_calls);
+        FM_INDEX_COUNT(select_calls, counters.select_calls);
+        FM_INDEX_COUNT(wavelet_levels, counters.wavelet_levels);
+        FM_INDEX_COUNT(LF_steps, counters.LF_steps);
+        FM_INDEX_COUNT(bytes_produced, counters.bytes_produced);
+    }
+}
+
+size_t FMIndex::rank_before_row(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                                const size_t end_idx,
+                                const size_t i,
+                                const char c)
+{
+    // Number of occurrences of c in rows [0, i). (Row end_idx holds no character.)
+    size_t len = i > end_idx ? i-1 : i;
+    return len == 0 ? 0 : BWT_or_BWTr->rank(len-1, c);
+}
+
+size_t FMIndex::rank_less_before_row(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                                     const size_t end_idx,
+                                     const size_t i,
+                                     const char c)
+{
+    size_t len = i > end_idx ? i-1 : i;
+    return len == 0 ? 0 : BWT_or_BWTr->rank_less(len-1, c);
+}
+
+size_t FMIndex::LF(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                   const size_t end_idx,
+                   const std::map<char, size_t> & C,
+                   const size_t i,
+                   char & c)
+{
+    // Row of the suffix one character earlier in the text than that of row i, which is preceded by c.
+    FM_INDEX_COUNT(LF_steps, 1);
+    size_t rk;
+    std::tie(c, rk) = BWT_or_BWTr->select_with_rank(BWT_idx_from_row_idx(i, end_idx));
+    return C.find(c)->second + rk;
+}
+
+void FMIndex::backward_step(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                            const size_t end_idx,
+                            std::map<char, size_t>::const_iterator C_it,
+                            size_t & lb,
+                            size_t & ub)
+{
+    // Narrow the interval (lb, ub] (as in backward_search) to the rows preceded by C_it->first.
+    lb = C_it->second + BWT_or_BWTr->rank(BWT_idx_from_row_idx(lb == end_idx ? lb-1 : lb, end_idx), C_it->first); // NB end_idx > 0 always so cannot have lb == 0 if lb == end_idx
+    ub = C_it->second + BWT_or_BWTr->rank(BWT_idx_from_row_idx(ub == end_idx ? ub-1 : ub, end_idx), C_it->first); // As above
+}
+
+size_t FMIndex::BWTr_row_from_BWT_row(size_t i,
+                                      size_t lb,
+                                      size_t ub,
+                                      size_t lbr,
+                                      const size_t max_context) const
+{
+    /* Rows [lb, ub) of BWT_as_wt are prefixed by some pattern and the rows of BWTr_as_wt
+       prefixed by the reversed pattern start at lbr. We extend the pattern to the left
+       with the text preceding row i, narrowing both intervals in step (cf. bidirectional
+       search in docs/2BWT.pdf), until row i is the only row left. The row remaining in
+       BWTr_as_wt then belongs to the same occurrence as row i. This costs one LF step per
+       character of context needed to tell the occurrence apart from the others, so the
+       cost for one match does not depend on the number of matches. */
+    for(size_t depth = 0; ub - lb > 1 && depth < max_context; depth++)
+    {
+        if(i == BWT_end_idx) return lbr; // Match at start of text sorts first in BWTr_as_wt.
+        if(lb <= BWT_end_idx && BWT_end_idx < ub) lbr++; // Ditto for the other match.
+        char c;
+        i = LF(BWT_as_wt, BWT_end_idx, C, i, c);
+        lbr += rank_less_before_row(BWT_as_wt, BWT_end_idx, ub, c) - rank_less_before_row(BWT_as_wt, BWT_end_idx, lb, c);
+        size_t C_c = C.find(c)->second;
+        lb = 1 + C_c + rank_before_row(BWT_as_wt, BWT_end_idx, lb, c);
+        ub = 1 + C_c + rank_before_row(BWT_as_wt, BWT_end_idx, ub, c);
+    }
+    return lbr + (i - lb); // Matches identical for max_context characters are paired in row order (as in find).
+}
+
+void FMIndex::pair_rows(std::vector<row_pair>::iterator begin,
+                        std::vector<row_pair>::iterator end,
+                        size_t lb,
+                        const size_t ub,
+                        size_t lbr,
+                        const size_t depth_left) const
+{
+    /* BWTr_row_from_BWT_row for all the rows [lb, ub) at once: [begin, end)
+       holds the row each match has reached. The intervals are narrowed once
+       for all the rows preceded by the same character, rather than once for
+       each row, and each row costs one LF step per character of context. */
+    if(ub - lb > 1 && depth_left > 0)
+    {
+        std::vector<row_pair>::iterator first = begin;
+        for(std::vector<row_pair>::iterator it = begin; it != end; ++it)
+            if(it->row == BWT_end_idx)
+            {
+                it->row_r = lbr++; // Match at start of text sorts first in BWTr_as_wt.
+                std::iter_swap(it, first++);
+                break;
+            }
+        for(std::vector<row_pair>::iterator it = first; it != end; ++it) it->row = LF(BWT_as_wt, BWT_end_idx, C, it->row, it->c);
+        std::sort(first, end, [](const row_pair & x, const row_pair & y) { return x.row < y.row; });
+        while(first != end)
         {
-            if(i - j > 1 && depth_left > 0) msd_sort(fr_perm + j, i - j, text_iters, depth_left - 1);
-            j = i;
-            c = cc;
+            const char c = first->c;
+            std::vector<row_pair>::iterator last = first;
+            while(last != end && last->c == c) ++last;
+            const size_t C_c = C.find(c)->second;
+            pair_rows(first, last,
+                      1 + C_c + rank_before_row(BWT_as_wt, BWT_end_idx, lb, c),
+                      1 + C_c + rank_before_row(BWT_as_wt, BWT_end_idx, ub, c),
+                      lbr + rank_less_before_row(BWT_as_wt, BWT_end_idx, ub, c) - rank_less_before_row(BWT_as_wt, BWT_end_idx, lb, c),
+                      depth_left - 1);
+            first = last;
         }
+        return;
     }
-    if(len - j > 1 && depth_left > 0) msd_sort(fr_perm + j, len - j, text_iters, depth_left - 1);
+    for(std::vector<row_pair>::iterator it = begin; it != end; ++it) it->row_r = lbr + (it->row - lb);
 }
 
 void FMIndex::populate_C(void)
@@ -137,22 +395,405 @@ void FMIndex::populate_C(void)
         C[*c] = BWT_as_wt->cum_freq(*c);
 }
 
-FMIndex::FMIndex(const std::string & s)
+void FMIndex::populate_kmer_codes(void)
 {
-    if(s.empty()) throw std::length_error("Cannot construct zero-length FMIndex");
+    kmer_codes.assign(256, C.size());
+    size_t code = 0;
+    for(auto & c_C : C) kmer_codes[static_cast<unsigned char>(c_C.first)] = code++;
+}
 
-    // Build BWT_as_wt:
-    std::string s_BWT;
-    s_BWT.resize(s.size());
-    BWT_end_idx = BWT((const unsigned char *) s.c_str(), (unsigned char *) &s_BWT[0], (int) s.size()); // C-style casts for C-function BWT.
-    BWT_as_wt = std::unique_ptr<WaveletTree>(new WaveletTree(s_BWT, false));
+void FMIndex::fill_kmer_intervals(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                                  const size_t end_idx,
+                                  const size_t depth,
+                                  const size_t key,
+                                  const size_t lb,
+                                  const size_t ub,
+                                  std::vector<std::pair<size_t, size_t>> & intervals) const
+{
+    /* Depth-first over the k-mers, sharing the backward search steps of
+       common prefixes. Empty intervals are left as (0, 0). */
+    if(depth == kmer_length)
+    {
+        intervals[key] = std::make_pair(lb, ub);
+        return;
+    }
+    size_t code = 0;
+    for(std::map<char, size_t>::const_iterator C_it = C.begin(); C_it != C.end(); ++C_it, code++)
+    {
+        size_t lb_c = lb, ub_c = ub;
+        if(depth == 0)
+        {
+            lb_c = C_it->second;
+            ub_c = (std::next(C_it) == C.end() ? BWT_or_BWTr->size() : std::next(C_it)->second);
+        }
+        else backward_step(BWT_or_BWTr, end_idx, C_it, lb_c, ub_c);
+        if(lb_c < ub_c) fill_kmer_intervals(BWT_or_BWTr, end_idx, depth + 1, key * C.size() + code, lb_c, ub_c, intervals);
+    }
+}
+
+void FMIndex::index_kmers(const size_t max_bytes, const size_t max_k)
+{
+    const size_t entry_bytes = 2 * sizeof(std::pair<size_t, size_t>); // One per direction.
+    size_t k = 0, n_kmers = 1;
+    while(k < max_k && k < size() && n_kmers <= max_bytes / entry_bytes / C.size())
+    {
+        n_kmers *= C.size();
+        k++;
+    }
+    kmer_length = k;
+    kmer_intervals.assign(k > 0 ? n_kmers : 0, std::make_pair(0, 0));
+    kmer_intervals_r.assign(k > 0 ? n_kmers : 0, std::make_pair(0, 0));
+    if(k == 0) return;
+    populate_kmer_codes();
+    fill_kmer_intervals(BWT_as_wt, BWT_end_idx, 0, 0, 0, 0, kmer_intervals);
+    fill_kmer_intervals(BWTr_as_wt, BWTr_end_idx, 0, 0, 0, 0, kmer_intervals_r);
+}
+
+size_t FMIndex::kmer_table_length(void) const
+{
+    return kmer_length;
+}
+
+void FMIndex::sample_SA(void)
+{
+    /* Walk the whole text backwards from the empty suffix (row 0) so
+       that we visit every row and know its suffix array value. */
+    std::vector<bool> sampled(size() + 1);
+    std::vector<std::pair<size_t, size_t>> samples; // (row, SA value)
+    size_t row = 0;
+    for(size_t pos = size(); ; pos--)
+    {
+        if(pos % SA_sample_rate == 0)
+        {
+            sampled[row] = true;
+            samples.push_back(std::make_pair(row, pos));
+        }
+        if(pos == 0) break;
+        char c;
+        row = LF(BWT_as_wt, BWT_end_idx, C, row, c);
+    }
+    std::sort(samples.begin(), samples.end());
+    SA_sampled_rows = std::unique_ptr<BitVector>(new BitVector(sampled));
+    SA_samples.reserve(samples.size());
+    for(auto & sample : samples) SA_samples.push_back(sample.second);
+}
+
+void FMIndex::build(const char * s, const size_t n, const bool parallel, std::string * text)
+{
+    /* Both BWTs are computed in place in one buffer, so apart from the input
+       the peak memory use is that of BWT: the buffer and its suffix array.
+       In parallel they each have their own, so the peak is twice that. If
+       text holds s (so not in parallel, as s is read for BWTr_as_wt), its
+       buffer is that of BWT_as_wt, and it is left empty. */
+    if(n == 0) throw std::length_error("Cannot construct zero-length FMIndex");
+    if(n > static_cast<size_t>(std::numeric_limits<int>::max())) throw std::length_error("Text too long for BWT");
 
     // Build BWTr_as_wt:
-    std::string s_rev(s.rbegin(), s.rend()); // Uugh, waste of time+space. Ideally should teach BWT to optionally sort right-left.
-    BWTr_end_idx = BWT((const unsigned char *) s_rev.c_str(), (unsigned char *) &s_BWT[0], (int) s.size()); // C-style casts for C-function BWT.
-    BWTr_as_wt = std::unique_ptr<WaveletTree>(new WaveletTree(s_BWT));
+    std::shared_ptr<StorageAllocator> allocator = StorageAllocator::current();
+    auto build_BWTr = [this, s, n, allocator]()
+    {
+        StorageAllocator::thread_scope scope(allocator);
+        std::string s_BWTr(n, '\0');
+        std::reverse_copy(s, s + n, s_BWTr.begin());
+        int idx = BWT((const unsigned char *) s_BWTr.c_str(), (unsigned char *) &s_BWTr[0], (int) n); // C-style casts for C-function BWT.
+        if(idx < 0) throw std::bad_alloc();
+        BWTr_end_idx = idx;
+        BWTr_as_wt = std::unique_ptr<WaveletTree>(new WaveletTree(s_BWTr));
+    };
+    std::future<void> BWTr_built;
+    if(parallel) BWTr_built = std::async(std::launch::async, build_BWTr);
+    else build_BWTr();
+
+    // Build BWT_as_wt:
+    std::string s_BWT;
+    if(text != nullptr && !parallel) s_BWT.swap(*text);
+    else s_BWT.assign(s, n);
+    int idx = BWT((const unsigned char *) s_BWT.c_str(), (unsigned char *) &s_BWT[0], (int) n); // C-style casts for C-function BWT.
+    if(idx < 0) throw std::bad_alloc();
+    BWT_end_idx = idx;
+    BWT_as_wt = std::unique_ptr<WaveletTree>(new WaveletTree(s_BWT));
+    if(parallel) BWTr_built.get();
 
     populate_C();
+    if(SA_sample_rate > 0) sample_SA();
+}
+
+FMIndex::FMIndex(const std::string & s, const size_t SA_sample_rate)
+    : SA_sample_rate(SA_sample_rate),
+      kmer_length(0)
+{
+    build(s.c_str(), s.size());
+}
+
+FMIndex::FMIndex(std::string && s, const size_t SA_sample_rate)
+    : SA_sample_rate(SA_sample_rate),
+      kmer_length(0)
+{
+    build(s.c_str(), s.size(), false, &s);
+}
+
+FMIndex * FMIndex::new_from_buffer(const char * s, const size_t n, const size_t SA_sample_rate, const bool parallel)
+{
+    std::unique_ptr<FMIndex> fmi(new FMIndex());
+    fmi->SA_sample_rate = SA_sample_rate;
+    fmi->build(s, n, parallel);
+    return fmi.release();
+}
+
+const char * FMIndex::map_file(const std::string & filename, size_t & n)
+{
+    // Map the file rather than read it so that the text need not fit in memory alongside the BWT buffers.
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "Cannot stat " + filename);
+    }
+    n = st.st_size;
+    if(n == 0)
+    {
+        close(fd);
+        throw std::length_error("Cannot construct zero-length FMIndex");
+    }
+    void * s = mmap(nullptr, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if(s == MAP_FAILED) throw std::system_error(err, std::generic_category(), "Cannot map " + filename);
+    return static_cast<const char *>(s);
+}
+
+FMIndex * FMIndex::new_from_file(const std::string & filename, const size_t SA_sample_rate, const bool parallel)
+{
+    size_t n;
+    const char * s = map_file(filename, n);
+    try
+    {
+        FMIndex * fmi = new_from_buffer(s, n, SA_sample_rate, parallel);
+        munmap(const_cast<char *>(s), n);
+        return fmi;
+    }
+    catch(...)
+    {
+        munmap(const_cast<char *>(s), n);
+        throw;
+    }
+}
+
+std::unique_ptr<WaveletTree> FMIndex::external_BWT(const char * s,
+                                                   const size_t n,
+                                                   const bool reversed,
+                                                   const size_t block_size,
+                                                   const std::string & scratch_prefix,
+                                                   size_t & end_idx)
+{
+    /* The BWT of s (or of s reversed) built a block at a time, from the end
+       of the text backwards, as in bwte (Ferragina, Gagie and Manzini,
+       "Lightweight data indexing and compression in external memory"). The BWT
+       of the tail done so far is kept on disk with gt, whether each of its
+       suffixes comes after the whole tail, and both are only read and
+       rewritten in order. In memory is the block only: its suffixes are sorted
+       in the context of the tail (their order in the block, but for the short
+       suffixes placed as in merge_order), and reading the tail backwards we
+       step LF over them to count the suffixes of the tail between each two of
+       the block's. The WaveletTree is built once, from the finished BWT. */
+    auto text = [s, n, reversed](const size_t i) { return reversed ? s[n-1-i] : s[i]; };
+    const scratch_file BWT_file(scratch_prefix + ".bwt"), merged_file(scratch_prefix + ".merged"),
+                       gt_file(scratch_prefix + ".gt"), merged_gt_file(scratch_prefix + ".gt.merged");
+    std::ofstream(BWT_file.filename, std::ios::binary);
+    std::ofstream(gt_file.filename, std::ios::binary);
+    end_idx = 0; // The tail is empty, so is its only row.
+    for(size_t begin = n; begin > 0; )
+    {
+        const size_t end = begin, m = std::min(block_size, end), n_tail = n - end;
+        begin = end - m;
+        std::string block(m, '\0');
+        for(size_t i = 0; i < m; i++) block[i] = text(begin + i);
+        int idx = BWT((const unsigned char *) block.c_str(), (unsigned char *) &block[0], (int) m); // C-style casts for C-function BWT.
+        if(idx < 0) throw std::bad_alloc();
+        const size_t block_end_idx = idx;
+
+        /* gt for the suffixes starting in the block: compare them with the tail
+           by the Z-function of its first m characters, and where one matches
+           all the way to the tail by the tail's own gt. */
+        std::vector<bool> gt(m + 1, false);
+        {
+            const size_t n_prefix = std::min(m, n_tail), gt_first = n_tail - std::min(m + 1, n_tail);
+            const std::vector<bool> tail_gt = read_bits(gt_file.filename, gt_first, n_tail); // By position from the end.
+            std::string prefix(n_prefix, '\0');
+            for(size_t i = 0; i < n_prefix; i++) prefix[i] = text(end + i);
+            std::vector<uint32_t> z(n_prefix, 0); // As the block is.
+            for(size_t j = 1, z_begin = 0, z_end = 0; j < n_prefix; j++)
+            {
+                size_t len = j < z_end ? std::min<size_t>(z[j - z_begin], z_end - j) : 0;
+                while(j + len < n_prefix && prefix[j + len] == prefix[len]) len++;
+                if(j + len > z_end)
+                {
+                    z_begin = j;
+                    z_end = j + len;
+                }
+                z[j] = len;
+            }
+            for(size_t k = 0, z_begin = 0, z_end = 0; k < m; k++)
+            {
+                size_t len = k < z_end ? std::min<size_t>(z[k - z_begin], z_end - k) : 0;
+                while(len < n_prefix && k + len < m && text(begin + k + len) == prefix[len]) len++;
+                if(k + len > z_end)
+                {
+                    z_begin = k;
+                    z_end = k + len;
+                }
+                // If the rest of the block matches, it comes after the tail if the tail comes after its suffix there.
+                if(k + len == m) gt[k] = m - k == n_tail || !tail_gt[n_tail - 1 - (m - k) - gt_first];
+                else if(len == n_prefix) gt[k] = true; // The tail is a proper prefix.
+                else gt[k] = static_cast<unsigned char>(text(begin + k + len)) > static_cast<unsigned char>(prefix[len]);
+            }
+        }
+
+        // The block's BWT in the order of its suffixes in the context of the tail.
+        std::string sorted_BWT;
+        size_t C_block[256], sorted_end_idx = 0; // The rank of the suffix at begin, so without a character.
+        {
+            rank_directory block_ranks(block.data(), m);
+            block_ranks.cumulative_counts(C_block);
+            std::string reversed_block(m, '\0');
+            for(size_t i = 0; i < m; i++) reversed_block[i] = text(end - 1 - i);
+            std::vector<std::pair<size_t, size_t>> shorts;
+            place_shorts(C_block,
+                         [&block_ranks, block_end_idx](const size_t i, const char c) { return block_ranks.rank(i > block_end_idx ? i-1 : i, c); },
+                         reversed_block, gt, shorts);
+            std::vector<size_t> short_rows;
+            for(auto & x : shorts) short_rows.push_back(x.second);
+            std::sort(short_rows.begin(), short_rows.end());
+            std::vector<size_t>::const_iterator next_short_row = short_rows.begin();
+            std::vector<std::pair<size_t, size_t>>::const_iterator next_short = shorts.begin();
+            sorted_BWT.reserve(m - 1);
+            for(size_t rank = 0, next_row = 1; rank < m; rank++)
+            {
+                size_t row;
+                if(next_short != shorts.end() && next_short->first == rank) row = (next_short++)->second;
+                else
+                {
+                    for(; next_short_row != short_rows.end() && *next_short_row == next_row; ++next_short_row) next_row++;
+                    row = next_row++;
+                }
+                if(row == block_end_idx) sorted_end_idx = rank;
+                else sorted_BWT.push_back(block[BWT_idx_from_row_idx(row, block_end_idx)]);
+            }
+        }
+        block = std::string();
+
+        /* Step LF over the block's suffixes from the end of the text: the
+           suffix at i comes after rank of them, those before the one at i+1
+           and preceded by text[i], and if text[i] ends the block the tail too
+           if the suffix at i+1 comes after it. Suffixes of the tail fill
+           gaps, and every suffix gets its gt for the text from begin (but for
+           the first block, which needs none). */
+        std::vector<uint32_t> gaps(m + 1, 0);
+        std::map<size_t, size_t> gap_overflows; // Counts the wrap-arounds of gaps.
+        {
+            rank_directory sorted_ranks(sorted_BWT.data(), sorted_BWT.size());
+            const char last = text(end - 1);
+            std::filebuf gt_in, gt_out;
+            if(!gt_in.open(gt_file.filename, std::ios::in | std::ios::binary))
+                throw std::runtime_error("Cannot open " + gt_file.filename);
+            if(!gt_out.open(merged_gt_file.filename, std::ios::out | std::ios::binary))
+                throw std::runtime_error("Cannot create " + merged_gt_file.filename);
+            bit_reader tail_gt(gt_in);
+            bit_writer merged_gt(gt_out);
+            size_t rank = 0;
+            bool next_gt = false; // Of the empty suffix.
+            gaps[0]++;
+            for(size_t i = n; i > (begin > 0 ? begin : end); i--)
+            {
+                const char c = text(i-1);
+                rank = C_block[static_cast<unsigned char>(c)] +
+                       sorted_ranks.rank(rank > sorted_end_idx ? rank-1 : rank, c) +
+                       (c == last && next_gt);
+                merged_gt.push_back(rank > sorted_end_idx);
+                if(i > end)
+                {
+                    if(++gaps[rank] == 0) gap_overflows[rank]++;
+                    next_gt = tail_gt.next();
+                }
+                else next_gt = gt[i-1-begin];
+            }
+            merged_gt.flush();
+            if(!gt_out.close()) throw std::runtime_error("Cannot write " + merged_gt_file.filename);
+        }
+        gt = std::vector<bool>();
+
+        // Interleave the tail's BWT with the block's by gaps.
+        {
+            std::filebuf in, out;
+            if(!in.open(BWT_file.filename, std::ios::in | std::ios::binary))
+                throw std::runtime_error("Cannot open " + BWT_file.filename);
+            if(!out.open(merged_file.filename, std::ios::out | std::ios::binary))
+                throw std::runtime_error("Cannot create " + merged_file.filename);
+            const char last = text(end - 1);
+            size_t n_written = 0, tail_row = 0, merged_end_idx = 0;
+            for(size_t rank = 0; rank <= m; rank++)
+            {
+                std::map<size_t, size_t>::const_iterator overflow = gap_overflows.find(rank);
+                const size_t gap = gaps[rank] + (overflow == gap_overflows.end() ? 0 : overflow->second << 32);
+                for(size_t g = 0; g < gap; g++, tail_row++, n_written++)
+                {
+                    const int c = tail_row == end_idx ? std::char_traits<char>::to_int_type(last) : in.sbumpc();
+                    if(c == std::char_traits<char>::eof()) throw std::runtime_error("Unexpected end of " + BWT_file.filename);
+                    out.sputc(static_cast<char>(c));
+                }
+                if(rank == m) break;
+                if(rank == sorted_end_idx) merged_end_idx = n_written; // Every earlier row has a character.
+                else
+                {
+                    out.sputc(sorted_BWT[rank > sorted_end_idx ? rank-1 : rank]);
+                    n_written++;
+                }
+            }
+            if(!out.close()) throw std::runtime_error("Cannot write " + merged_file.filename);
+            end_idx = merged_end_idx;
+        }
+        if(std::rename(merged_file.filename.c_str(), BWT_file.filename.c_str()) != 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot rename " + merged_file.filename);
+        if(std::rename(merged_gt_file.filename.c_str(), gt_file.filename.c_str()) != 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot rename " + merged_gt_file.filename);
+    }
+    return std::unique_ptr<WaveletTree>(WaveletTree::new_from_file(BWT_file.filename, 4 * block_size));
+}
+
+FMIndex * FMIndex::new_from_file_external(const std::string & filename,
+                                          const std::string & scratch_dir,
+                                          const size_t memory_budget,
+                                          const size_t SA_sample_rate)
+{
+    size_t n;
+    const char * s = map_file(filename, n);
+    /* Working memory is about 6 bytes per character of a block (openbwt's 5,
+       or its gaps and BWT) and its rank directory, up to 8 more; the
+       WaveletTree is built from the BWT in pieces of up to a third of the
+       budget. The index itself comes on top. */
+    const size_t block_size = std::min(std::max(memory_budget / 12, static_cast<size_t>(1)),
+                                       static_cast<size_t>(std::numeric_limits<int>::max()));
+    const std::string scratch_prefix = scratch_dir + "/fmindex-" + std::to_string(getpid()) + "-" +
+                                       std::to_string(reinterpret_cast<std::uintptr_t>(s));
+    try
+    {
+        std::unique_ptr<FMIndex> fmi(new FMIndex());
+        fmi->SA_sample_rate = SA_sample_rate;
+        fmi->BWT_as_wt = external_BWT(s, n, false, block_size, scratch_prefix, fmi->BWT_end_idx);
+        fmi->BWTr_as_wt = external_BWT(s, n, true, block_size, scratch_prefix, fmi->BWTr_end_idx);
+        munmap(const_cast<char *>(s), n);
+        fmi->populate_C();
+        if(SA_sample_rate > 0) fmi->sample_SA();
+        return fmi.release();
+    }
+    catch(...)
+    {
+        munmap(const_cast<char *>(s), n);
+        throw;
+    }
 }
 
 size_t FMIndex::findn(const std::string & pattern) const
@@ -164,9 +805,496 @@ size_t FMIndex::findn(const std::string & pattern) const
     return ub <= lb ? 0 : ub - lb;
 }
 
+size_t FMIndex::findn(const char * pattern, const size_t length) const
+{
+    std::pair<size_t, size_t> interval = find_interval(pattern, length);
+    return interval.second <= interval.first ? 0 : interval.second - interval.first;
+}
+
+void FMIndex::findn_batch(const char * const * patterns,
+                          const size_t * lengths,
+                          const size_t n_patterns,
+                          size_t * counts,
+                          size_t * lbs) const
+{
+    for(size_t i = 0; i < n_patterns; i++)
+    {
+        std::pair<size_t, size_t> interval = find_interval(patterns[i], lengths[i]);
+        counts[i] = interval.second <= interval.first ? 0 : interval.second - interval.first;
+        if(lbs != nullptr) lbs[i] = interval.first;
+    }
+}
+
+std::vector<size_t> FMIndex::count_many(const std::vector<std::string> & patterns) const
+{
+    for(auto & pattern : patterns)
+        if(pattern.empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    /* A node of the trie of the reversed patterns is the patterns order[begin, end)
+       sharing their last depth characters, which prefix rows (lb, ub]. Above the
+       depth of the k-mer table no steps are taken (known is false) but the key of
+       the k-mer so far is kept, so the table gives the interval at its depth. */
+    struct node
+    {
+        size_t begin, end, depth, lb, ub, key;
+        bool known;
+    };
+    std::vector<size_t> counts(patterns.size(), 0), order(patterns.size());
+    for(size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::vector<node> stack;
+    if(!order.empty()) stack.push_back(node{0, order.size(), 0, 0, 0, 0, false});
+    while(!stack.empty())
+    {
+        node n = stack.back();
+        stack.pop_back();
+        const size_t depth = n.depth;
+        auto next_char = [&patterns, depth](const size_t i) { return patterns[i][patterns[i].size() - 1 - depth]; };
+
+        // Patterns which end here, and a lone pattern which can be finished without sorting.
+        size_t begin = std::partition(order.begin() + n.begin, order.begin() + n.end,
+                                      [&patterns, depth](const size_t i) { return patterns[i].size() == depth; }) - order.begin();
+        for(size_t j = n.begin; j < begin; j++)
+            counts[order[j]] = n.known ? n.ub - n.lb : findn(patterns[order[j]]);
+        if(n.end - begin == 1)
+        {
+            const std::string & pattern = patterns[order[begin]];
+            if(!n.known)
+            {
+                counts[order[begin]] = findn(pattern);
+                continue;
+            }
+            size_t lb = n.lb, ub = n.ub;
+            for(size_t d = depth; d < pattern.size() && lb < ub; d++)
+            {
+                std::map<char, size_t>::const_iterator C_it = C.find(pattern[pattern.size() - 1 - d]);
+                if(C_it == C.end()) ub = lb;
+                else backward_step(BWT_as_wt, BWT_end_idx, C_it, lb, ub);
+            }
+            counts[order[begin]] = ub <= lb ? 0 : ub - lb;
+            continue;
+        }
+
+        // Children, by the preceding character; those whose suffix does not occur are left at zero.
+        std::sort(order.begin() + begin, order.begin() + n.end,
+                  [&next_char](const size_t i, const size_t j) { return next_char(i) < next_char(j); });
+        for(size_t j = begin; j < n.end; )
+        {
+            const char c = next_char(order[j]);
+            size_t k = j + 1;
+            while(k < n.end && next_char(order[k]) == c) k++;
+            node child{j, k, depth + 1, 0, 0, 0, true};
+            std::map<char, size_t>::const_iterator C_it = C.find(c);
+            j = k;
+            if(C_it == C.end()) continue;
+            if(depth < kmer_length) child.key = n.key * C.size() + kmer_codes[static_cast<unsigned char>(c)];
+            if(depth + 1 < kmer_length) child.known = false;
+            else if(depth + 1 == kmer_length) std::tie(child.lb, child.ub) = kmer_intervals[child.key];
+            else if(depth == 0)
+            {
+                child.lb = C_it->second;
+                child.ub = (std::next(C_it) == C.end() ? BWT_as_wt->size() : std::next(C_it)->second);
+            }
+            else
+            {
+                child.lb = n.lb;
+                child.ub = n.ub;
+                backward_step(BWT_as_wt, BWT_end_idx, C_it, child.lb, child.ub);
+            }
+            if(!child.known || child.lb < child.ub) stack.push_back(child);
+        }
+    }
+    return counts;
+}
+
+void FMIndex::left_extensions(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                              const size_t end_idx,
+                              const size_t lb,
+                              const size_t ub,
+                              std::vector<std::tuple<char, size_t, size_t>> & extensions) const
+{
+    /* For each character c preceding a row in [lb, ub), appends c and the
+       rows [lb', ub') prefixed by c followed by the prefix of the rows [lb, ub). */
+    size_t i = extensions.size();
+    BWT_or_BWTr->distinct(lb > end_idx ? lb-1 : lb, ub > end_idx ? ub-1 : ub, extensions);
+    for(; i < extensions.size(); i++)
+    {
+        size_t C_c = C.find(std::get<0>(extensions[i]))->second;
+        std::get<1>(extensions[i]) += 1 + C_c;
+        std::get<2>(extensions[i]) += 1 + C_c;
+    }
+}
+
+void FMIndex::search_pattern(const std::vector<Pattern::Item> & items,
+                             const size_t n_items,
+                             const size_t n_repeats,
+                             const size_t lb,
+                             const size_t ub,
+                             std::string & match,
+                             std::map<std::string, size_t> & matches) const
+{
+    /* Backward search branching over the characters allowed by the pattern, where
+       rows [lb, ub) are prefixed by match (stored reversed) which matches the last
+       n_repeats repeats of items[n_items-1] followed by all later items. */
+    if(n_items == 0)
+    {
+        if(!match.empty()) matches[std::string(match.rbegin(), match.rend())] = ub - lb;
+        return;
+    }
+    const Pattern::Item & item = items[n_items-1];
+    if(n_repeats >= item.min_repeats) search_pattern(items, n_items-1, 0, lb, ub, match, matches);
+    if(n_repeats == item.max_repeats) return;
+
+    std::vector<std::tuple<char, size_t, size_t>> extensions;
+    if(item.chars.count() <= 8) // Few enough to try one by one.
+    {
+        for(auto & C_c : C)
+            if(item.chars[static_cast<unsigned char>(C_c.first)])
+                extensions.push_back(std::make_tuple(C_c.first,
+                                                     1 + C_c.second + rank_before_row(BWT_as_wt, BWT_end_idx, lb, C_c.first),
+                                                     1 + C_c.second + rank_before_row(BWT_as_wt, BWT_end_idx, ub, C_c.first)));
+    }
+    else left_extensions(BWT_as_wt, BWT_end_idx, lb, ub, extensions);
+    for(auto & extension : extensions)
+    {
+        if(!item.chars[static_cast<unsigned char>(std::get<0>(extension))] ||
+           std::get<2>(extension) <= std::get<1>(extension)) continue;
+        match.push_back(std::get<0>(extension));
+        search_pattern(items, n_items, n_repeats+1, std::get<1>(extension), std::get<2>(extension), match, matches);
+        match.pop_back();
+    }
+}
+
+void FMIndex::extend_bidirectional(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                                   const size_t end_idx,
+                                   size_t & lb,
+                                   size_t & lb_other,
+                                   size_t & n,
+                                   const char c) const
+{
+    /* Rows [lb, lb+n) of BWT_or_BWTr are prefixed by some string and rows
+       [lb_other, lb_other+n) of the other BWT by its reverse. Updates both
+       to the rows for the string preceded by c (in the direction of
+       BWT_or_BWTr). Rows of the other BWT are ordered by the character
+       which precedes in BWT_or_BWTr, and the end of the text comes first. */
+    std::map<char, size_t>::const_iterator C_it = C.find(c);
+    if(C_it == C.end())
+    {
+        n = 0;
+        return;
+    }
+    size_t ub = lb + n;
+    size_t r_lb = rank_before_row(BWT_or_BWTr, end_idx, lb, c), r_ub = rank_before_row(BWT_or_BWTr, end_idx, ub, c);
+    lb_other += (lb <= end_idx && end_idx < ub ? 1 : 0) +
+                rank_less_before_row(BWT_or_BWTr, end_idx, ub, c) - rank_less_before_row(BWT_or_BWTr, end_idx, lb, c);
+    lb = 1 + C_it->second + r_lb;
+    n = r_ub - r_lb;
+}
+
+size_t FMIndex::smems_from(const std::string & query,
+                           const size_t x,
+                           const size_t min_occ,
+                           std::vector<SMEM> & smems) const
+{
+    /* Appends the SMEMs containing query[x] and returns the end of the longest
+       match starting at x (cf. bwt_smem1 in BWA). First extend forwards from x,
+       keeping the intervals at which the number of matches drops. */
+    bi_interval ik = {0, 0, size() + 1, x};
+    extend_bidirectional(BWT_as_wt, BWT_end_idx, ik.lb, ik.lbr, ik.n, query[x]);
+    ik.end = x + 1;
+    if(ik.n < min_occ) return x + 1;
+    std::vector<bi_interval> prev, curr;
+    size_t i;
+    for(i = x + 1; i < query.size(); i++)
+    {
+        bi_interval ok = ik;
+        extend_bidirectional(BWTr_as_wt, BWTr_end_idx, ok.lbr, ok.lb, ok.n, query[i]);
+        if(ok.n != ik.n) curr.push_back(ik);
+        if(ok.n < min_occ) break;
+        ik = ok;
+        ik.end = i + 1;
+    }
+    if(i == query.size()) curr.push_back(ik);
+    std::reverse(curr.begin(), curr.end()); // Longest first.
+    size_t ret = curr[0].end;
+    prev.swap(curr);
+
+    // Now extend each backwards; a match is super-maximal if no longer one can be extended as far.
+    size_t n_smems_before = smems.size();
+    for(size_t j = x + 1; j-- > 0; )
+    {
+        curr.clear();
+        for(auto & p : prev)
+        {
+            bi_interval ok = p;
+            if(j > 0) extend_bidirectional(BWT_as_wt, BWT_end_idx, ok.lb, ok.lbr, ok.n, query[j-1]);
+            if(j == 0 || ok.n < min_occ)
+            {
+                if(curr.empty() && (smems.size() == n_smems_before || j < smems.back().begin))
+                {
+                    SMEM smem = {j, p.end, p.lb, p.lb + p.n};
+                    smems.push_back(smem);
+                }
+            }
+            else if(curr.empty() || ok.n != curr.back().n) curr.push_back(ok);
+        }
+        if(curr.empty()) break;
+        prev.swap(curr);
+    }
+    std::reverse(smems.begin() + n_smems_before, smems.end()); // Sorted by start.
+    return ret;
+}
+
+std::vector<FMIndex::SMEM> FMIndex::smems(const std::string & query,
+                                          const size_t min_len,
+                                          const size_t min_occ) const
+{
+    std::vector<SMEM> all, smems;
+    for(size_t x = 0; x < query.size(); ) x = smems_from(query, x, std::max(min_occ, static_cast<size_t>(1)), all);
+    for(auto & smem : all)
+        if(smem.end - smem.begin >= min_len) smems.push_back(smem);
+    return smems;
+}
+
+std::vector<std::pair<std::string, size_t>> FMIndex::top_completions(const std::string & prefix,
+                                                                     const size_t k,
+                                                                     const char delimiter,
+                                                                     const size_t max_length) const
+{
+    if(prefix.empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    /* Candidates are continuations of the prefix, with the rows [lb, ub) of
+       BWTr_as_wt prefixed by their reverse, whose preceding characters follow
+       them in the text (WaveletTree::distinct gives them all at once). Those
+       followed by the delimiter or the end of the text are complete. No extension
+       occurs more often than what it extends, so when the most frequent candidate
+       left is complete, no other can become a more frequent completion. */
+    struct candidate
+    {
+        std::string text;
+        size_t lb, ub; // Just the count, ub - lb, if complete.
+        bool complete;
+    };
+    auto less_frequent = [](const candidate & a, const candidate & b)
+    {
+        return a.ub - a.lb != b.ub - b.lb ? a.ub - a.lb < b.ub - b.lb : a.text > b.text;
+    };
+    std::priority_queue<candidate, std::vector<candidate>, decltype(less_frequent)> queue(less_frequent);
+    std::vector<std::pair<std::string, size_t>> completions;
+
+    size_t lb, ub;
+    std::tie(lb, ub) = backward_search(prefix.begin(), prefix.end(), BWTr_as_wt, BWTr_end_idx);
+    if(lb < ub && k > 0) queue.push(candidate{prefix, lb, ub, max_length == 0});
+    std::vector<std::tuple<char, size_t, size_t>> extensions;
+    while(!queue.empty() && completions.size() < k)
+    {
+        candidate c = queue.top();
+        queue.pop();
+        if(c.complete)
+        {
+            completions.push_back(std::make_pair(std::move(c.text), c.ub - c.lb));
+            continue;
+        }
+        size_t n_ending = (c.lb <= BWTr_end_idx && BWTr_end_idx < c.ub ? 1 : 0); // At the end of the text.
+        extensions.clear();
+        left_extensions(BWTr_as_wt, BWTr_end_idx, c.lb, c.ub, extensions);
+        for(auto & extension : extensions)
+        {
+            if(std::get<0>(extension) == delimiter) n_ending += std::get<2>(extension) - std::get<1>(extension);
+            else queue.push(candidate{c.text + std::get<0>(extension), std::get<1>(extension), std::get<2>(extension),
+                                      c.text.size() + 1 - prefix.size() == max_length});
+        }
+        if(n_ending > 0) queue.push(candidate{std::move(c.text), 0, n_ending, true});
+    }
+    return completions;
+}
+
+bool FMIndex::right_maximal(const size_t lbr, const size_t n) const
+{
+    // Whether the rows [lbr, lbr+n) of BWTr_as_wt, i.e., what follows their string in the text, differ.
+    if(lbr <= BWTr_end_idx && BWTr_end_idx < lbr + n) return n > 1; // The end of the text and something else.
+    char c = BWTr_as_wt->select(BWT_idx_from_row_idx(lbr, BWTr_end_idx));
+    return rank_before_row(BWTr_as_wt, BWTr_end_idx, lbr + n, c) - rank_before_row(BWTr_as_wt, BWTr_end_idx, lbr, c) != n;
+}
+
+void FMIndex::repeats_ending_with(const char c,
+                                 const size_t min_occ,
+                                 const std::function<bool(const repeat &)> & visit) const
+{
+    /* Depth-first from c, where a node is the bi-interval of a repeat and the
+       character to extend it by on the left; only right-maximal repeats are
+       extended further, so the work is proportional to the number visited. */
+    struct node
+    {
+        size_t lb, lbr, n, length;
+        char c;
+    };
+    std::vector<node> stack{node{0, 0, size() + 1, 0, c}};
+    std::string reversed; // The current repeat, last character first.
+    std::vector<std::tuple<char, size_t, size_t>> extensions;
+    while(!stack.empty())
+    {
+        node x = stack.back();
+        stack.pop_back();
+        extend_bidirectional(BWT_as_wt, BWT_end_idx, x.lb, x.lbr, x.n, x.c);
+        if(x.n < min_occ || !right_maximal(x.lbr, x.n)) continue;
+        reversed.resize(x.length);
+        reversed.push_back(x.c);
+        if(!visit(repeat{std::string(reversed.rbegin(), reversed.rend()), x.lb, x.lb + x.n})) continue;
+
+        extensions.clear();
+        BWT_as_wt->distinct(x.lb > BWT_end_idx ? x.lb-1 : x.lb, x.lb + x.n > BWT_end_idx ? x.lb + x.n - 1 : x.lb + x.n, extensions);
+        for(auto & extension : extensions)
+            if(std::get<2>(extension) - std::get<1>(extension) >= min_occ)
+                stack.push_back(node{x.lb, x.lbr, x.n, x.length + 1, std::get<0>(extension)});
+    }
+}
+
+void FMIndex::visit_repeats(const std::function<bool(const repeat &)> & visit,
+                            const size_t min_occ,
+                            const bool parallel) const
+{
+    std::vector<char> alphabet;
+    for(auto & C_c : C) alphabet.push_back(C_c.first);
+    size_t n_threads = parallel ? std::min<size_t>(std::max<size_t>(std::thread::hardware_concurrency(), 1), alphabet.size()) : 1;
+    if(n_threads <= 1)
+    {
+        for(char c : alphabet) repeats_ending_with(c, std::max<size_t>(min_occ, 2), visit);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::future<void>> threads;
+    for(size_t t = 0; t < n_threads; t++)
+        threads.push_back(std::async(std::launch::async, [&]()
+        {
+            for(size_t i; (i = next++) < alphabet.size(); ) repeats_ending_with(alphabet[i], std::max<size_t>(min_occ, 2), visit);
+        }));
+    for(auto & thread : threads) thread.get(); // Rethrows exceptions from visit.
+}
+
+std::vector<FMIndex::repeat> FMIndex::right_maximal_repeats(const size_t min_len,
+                                                           const size_t min_occ,
+                                                           const bool parallel) const
+{
+    std::vector<repeat> repeats;
+    std::mutex repeats_mutex;
+    visit_repeats([&](const repeat & r)
+    {
+        if(r.substring.size() >= min_len)
+        {
+            std::lock_guard<std::mutex> lock(repeats_mutex);
+            repeats.push_back(r);
+        }
+        return true;
+    }, min_occ, parallel);
+    std::sort(repeats.begin(), repeats.end(),
+              [](const repeat & a, const repeat & b) { return a.substring < b.substring; });
+    return repeats;
+}
+
+std::vector<FMIndex::repeat> FMIndex::frequent_substrings(const size_t n,
+                                                         const size_t min_len,
+                                                         const bool parallel) const
+{
+    /* Keep the n most frequent found so far in a heap, least frequent on top. Once
+       it is full, a repeat less frequent than that cannot be extended to a more
+       frequent one, so the traversal stops there. */
+    auto more_frequent = [](const repeat & a, const repeat & b)
+    {
+        return a.ub - a.lb != b.ub - b.lb ? a.ub - a.lb > b.ub - b.lb : a.substring < b.substring;
+    };
+    std::vector<repeat> heap;
+    if(n == 0) return heap;
+    std::mutex heap_mutex;
+    std::atomic<size_t> min_occ(2);
+    visit_repeats([&](const repeat & r)
+    {
+        if(r.ub - r.lb < min_occ) return false;
+        if(r.substring.size() >= min_len)
+        {
+            std::lock_guard<std::mutex> lock(heap_mutex);
+            heap.push_back(r);
+            std::push_heap(heap.begin(), heap.end(), more_frequent);
+            if(heap.size() > n)
+            {
+                std::pop_heap(heap.begin(), heap.end(), more_frequent);
+                heap.pop_back();
+            }
+            if(heap.size() == n) min_occ = heap.front().ub - heap.front().lb;
+        }
+        return true;
+    }, 2, parallel);
+    std::sort_heap(heap.begin(), heap.end(), more_frequent);
+    return heap;
+}
+
+size_t FMIndex::find_distinct(std::map<std::string, size_t> & matches,
+                              const Pattern & pattern) const
+{
+    if(pattern.get_items().empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    std::map<std::string, size_t> found; // Different ways of matching can give the same string so collect first.
+    std::string match;
+    search_pattern(pattern.get_items(), pattern.get_items().size(), 0, 0, size() + 1, match, found);
+    size_t n = 0;
+    for(auto & m : found)
+    {
+        matches[m.first] = m.second;
+        n += m.second;
+    }
+    return n;
+}
+
+size_t FMIndex::findn(const Pattern & pattern) const
+{
+    std::map<std::string, size_t> matches;
+    return find_distinct(matches, pattern);
+}
+
 size_t FMIndex::find(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
                      const std::string & pattern,
                      const size_t max_context) const
+{
+    return find(matches, pattern.begin(), pattern.end(), max_context);
+}
+
+size_t FMIndex::pair_matches(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
+                             const size_t lb,
+                             const size_t ub,
+                             const size_t lbr,
+                             const size_t max_context) const
+{
+    // Appends the matches of rows [lb, ub) of BWT_as_wt, whose rows in BWTr_as_wt start at lbr.
+    size_t n_matches = ub - lb;
+    if(query_parts(n_matches) > 1)
+    {
+        // Pair each row of the parts on its own, as find_slice; pair_rows gives the same pairs.
+        std::vector<size_t> rows_r(n_matches);
+        for_each_part(n_matches, [&](size_t, size_t begin, size_t end)
+        {
+            for(size_t i = begin; i < end; i++) rows_r[i] = BWTr_row_from_BWT_row(lb + i, lb, ub, lbr, max_context);
+        });
+        for(size_t i = 0; i < n_matches; i++)
+            matches.push_back(std::make_pair(const_iterator(BWTr_as_wt, BWTr_end_idx, C, rows_r[i]),
+                                             const_reverse_iterator(BWT_as_wt, BWT_end_idx, C, lb + i)));
+        return n_matches;
+    }
+
+    std::vector<row_pair> rows(n_matches);
+    for(size_t i = 0; i < n_matches; i++) rows[i] = row_pair{lb + i, i, 0, '\0'};
+    pair_rows(rows.begin(), rows.end(), lb, ub, lbr, max_context);
+    std::sort(rows.begin(), rows.end(), [](const row_pair & x, const row_pair & y) { return x.match < y.match; });
+    for(size_t i = 0; i < n_matches; i++)
+        matches.push_back(std::make_pair(const_iterator(BWTr_as_wt, BWTr_end_idx, C, rows[i].row_r),
+                                         const_reverse_iterator(BWT_as_wt, BWT_end_idx, C, lb + i)));
+    return n_matches;
+}
+
+size_t FMIndex::find_slice(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
+                           const std::string & pattern,
+                           const size_t offset,
+                           const size_t limit,
+                           const size_t max_context) const
 {
     if(pattern.empty()) throw std::length_error("Cannot search for zero-length pattern");
 
@@ -176,27 +1304,50 @@ size_t FMIndex::find(std::list<std::pair<const_iterator, const_reverse_iterator>
     std::tie(lbr, ubr) = backward_search(pattern.begin(), pattern.end(), BWTr_as_wt, BWTr_end_idx);
     assert(ub-lb == ubr-lbr);
 
-    // Slightly painful last step: find permutation that matches up indices into BWT_as_wt and BWTr_as_wt.
-    size_t n_matches = ub - lb;
-    size_t * fr_perm = new size_t[n_matches];
-    const_iterator ** text_iters;
-    text_iters = new const_iterator*[n_matches];
-    for(size_t i = 0; i < n_matches; i++)
+    size_t slice_lb = lb + std::min(offset, ub - lb);
+    size_t slice_ub = ub - slice_lb > limit ? slice_lb + limit : ub;
+    for(size_t i = slice_lb; i < slice_ub; i++)
+        matches.push_back(std::make_pair(const_iterator(BWTr_as_wt, BWTr_end_idx, C, BWTr_row_from_BWT_row(i, lb, ub, lbr, max_context)),
+                                         const_reverse_iterator(BWT_as_wt, BWT_end_idx, C, i)));
+
+    return ub - lb;
+}
+
+std::string FMIndex::line_from_match(const std::pair<const_iterator, const_reverse_iterator> & match,
+                                     const std::string & pattern,
+                                     const char new_line_char,
+                                     const size_t max_context) const
+{
+    std::ostringstream context_before_ss;
+    try
     {
-        text_iters[i] = new const_iterator(BWTr_as_wt, BWTr_end_idx, C, lbr + i);
-        fr_perm[i] = i;
+        copy_n_until(match.second,
+                     max_context,
+                     std::ostream_iterator<char>(context_before_ss),
+                     [new_line_char](char c) -> bool
+                     {
+                         return c == new_line_char;
+                     });
     }
-    msd_sort(fr_perm, n_matches, text_iters, max_context);
-    for(size_t i = 0; i < n_matches; i++)
+    catch(std::overflow_error & e) { };
+    std::ostringstream context_after_ss;
+    try
     {
-        matches.push_back(std::make_tuple(const_iterator(BWTr_as_wt, BWTr_end_idx, C, lbr + fr_perm[i]),
-                                          const_reverse_iterator(BWT_as_wt, BWT_end_idx, C, lb + i)));
-        delete text_iters[i];
+        copy_n_until(match.first,
+                     max_context,
+                     std::ostream_iterator<char>(context_after_ss),
+                     [new_line_char](char c) -> bool
+                     {
+                         return c == new_line_char;
+                     });
     }
-    delete [] text_iters;
-    delete [] fr_perm;
-
-    return n_matches;
+    catch(std::overflow_error & e) { };
+    std::string context_before_s = context_before_ss.str();
+    std::string line = std::string(context_before_s.rbegin(), context_before_s.rend()) +
+                       pattern +
+                       context_after_ss.str();
+    FM_INDEX_COUNT(bytes_produced, line.size());
+    return line;
 }
 
 std::list<std::string> FMIndex::find_lines(const std::string & pattern,
@@ -206,40 +1357,282 @@ std::list<std::string> FMIndex::find_lines(const std::string & pattern,
     std::list<std::pair<const_iterator, const_reverse_iterator>> matches;
     find(matches, pattern, max_context);
 
+    // The lines of each part of the matches, joined in order.
+    std::vector<const std::pair<const_iterator, const_reverse_iterator> *> match_ptrs;
+    for(auto & match : matches) match_ptrs.push_back(&match);
+    std::vector<std::list<std::string>> parts(query_parts(matches.size()));
+    for_each_part(matches.size(), [&](size_t part, size_t begin, size_t end)
+    {
+        for(size_t i = begin; i < end; i++)
+            parts[part].push_back(line_from_match(*match_ptrs[i], pattern, new_line_char, max_context));
+    });
+
+    std::list<std::string> l;
+    for(auto & part : parts) l.splice(l.end(), part);
+
+    return l;
+}
+
+std::list<std::string> FMIndex::find_lines(const Pattern & pattern,
+                                           const char new_line_char,
+                                           const size_t max_context) const
+{
+    std::map<std::string, size_t> matches;
+    find_distinct(matches, pattern);
+
+    std::list<std::string> l;
+    for(auto & match : matches)
+        l.splice(l.end(), find_lines(match.first, new_line_char, max_context));
+
+    return l;
+}
+
+std::list<std::string> FMIndex::find_lines_slice(const std::string & pattern,
+                                                 const size_t offset,
+                                                 const size_t limit,
+                                                 const char new_line_char,
+                                                 const size_t max_context) const
+{
+    std::list<std::pair<const_iterator, const_reverse_iterator>> matches;
+    find_slice(matches, pattern, offset, limit, max_context);
+
     std::list<std::string> l;
     for(auto & match : matches)
+        l.push_back(line_from_match(match, pattern, new_line_char, max_context));
+
+    return l;
+}
+
+std::pair<size_t, size_t> FMIndex::find_interval(const std::string & pattern) const
+{
+    if(pattern.empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    return backward_search(pattern.rbegin(), pattern.rend(), BWT_as_wt, BWT_end_idx);
+}
+
+std::pair<size_t, size_t> FMIndex::find_interval(const char * pattern, const size_t length) const
+{
+    if(length == 0) throw std::length_error("Cannot search for zero-length pattern");
+
+    return backward_search(std::reverse_iterator<const char *>(pattern + length),
+                           std::reverse_iterator<const char *>(pattern),
+                           BWT_as_wt, BWT_end_idx);
+}
+
+size_t FMIndex::locate(size_t row) const
+{
+    if(SA_by_row) return SA_by_row->select(row); // Checks the range.
+    if(SA_sample_rate == 0) throw std::logic_error("FMIndex has no suffix array samples");
+    if(row > size()) throw std::out_of_range("FMIndex locate out of range");
+
+    // Step back through the text until we reach a sampled row. (Row BWT_end_idx is always sampled.)
+    size_t steps = 0;
+    char c;
+    for(; !SA_sampled_rows->select(row); steps++) row = LF(BWT_as_wt, BWT_end_idx, C, row, c);
+    return SA_samples[SA_sampled_rows->rank1(row) - 1] + steps;
+}
+
+std::vector<size_t> FMIndex::locate(const std::string & pattern) const
+{
+    return locate(pattern.begin(), pattern.end());
+}
+
+std::vector<size_t> FMIndex::locate_rows(const size_t lb, const size_t ub) const
+{
+    std::vector<size_t> positions(ub > lb ? ub - lb : 0);
+    for_each_part(positions.size(), [&](size_t, size_t begin, size_t end)
+    {
+        for(size_t i = begin; i < end; i++) positions[i] = locate(lb + i);
+    });
+    return positions;
+}
+
+void FMIndex::index_positions(void)
+{
+    SA_by_row = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(suffix_array()));
+}
+
+bool FMIndex::has_position_index(void) const
+{
+    return static_cast<bool>(SA_by_row);
+}
+
+size_t FMIndex::count_in_range(const std::string & pattern, const size_t begin, const size_t end) const
+{
+    size_t lb, ub;
+    std::tie(lb, ub) = find_interval(pattern);
+    size_t begin_ub = end >= pattern.size() ? end - pattern.size() + 1 : 0; // Matches must start in [begin, begin_ub).
+    if(ub <= lb || begin_ub <= begin) return 0;
+    if(SA_by_row) return SA_by_row->count_range(lb, ub, begin, begin_ub);
+
+    size_t n = 0;
+    for(size_t row = lb; row < ub; row++)
+    {
+        size_t pos = locate(row);
+        if(pos >= begin && pos < begin_ub) n++;
+    }
+    return n;
+}
+
+std::vector<size_t> FMIndex::locate_in_range(const std::string & pattern, const size_t begin, const size_t end) const
+{
+    size_t lb, ub;
+    std::tie(lb, ub) = find_interval(pattern);
+    size_t begin_ub = end >= pattern.size() ? end - pattern.size() + 1 : 0;
+    std::vector<size_t> positions;
+    if(ub <= lb || begin_ub <= begin) return positions;
+    if(SA_by_row)
+    {
+        SA_by_row->report_range(lb, ub, begin, begin_ub, positions);
+        return positions;
+    }
+
+    for(size_t row = lb; row < ub; row++)
+    {
+        size_t pos = locate(row);
+        if(pos >= begin && pos < begin_ub) positions.push_back(pos);
+    }
+    std::sort(positions.begin(), positions.end());
+    return positions;
+}
+
+std::vector<size_t> FMIndex::suffix_array(void) const
+{
+    std::vector<size_t> SA(size() + 1);
+    size_t row = 0;
+    for(size_t pos = size(); pos > 0; pos--)
+    {
+        SA[row] = pos;
+        char c;
+        row = LF(BWT_as_wt, BWT_end_idx, C, row, c);
+    }
+    SA[row] = 0; // NB row == BWT_end_idx
+    return SA;
+}
+
+template <typename Row>
+void FMIndex::inverse_BWT(char * out, const size_t n_threads) const
+{
+    const size_t n = size();
+    const size_t n_blocks = std::max<size_t>(std::min(n_threads, n / 4096), 1), block = (n + n_blocks - 1) / n_blocks;
+    auto in_parallel = [n_blocks](const std::function<void(size_t)> & f)
+    {
+        std::vector<std::future<void>> threads;
+        for(size_t b = 1; b < n_blocks; b++) threads.push_back(std::async(std::launch::async, f, b));
+        f(0);
+        for(auto & thread : threads) thread.get();
+    };
+
+    /* The character and LF of each row, indexed as the BWT (i.e., skipping row
+       BWT_end_idx) and together so that a step of the walk takes one cache miss.
+       Filled in blocks, one per thread: each counts the characters of its block,
+       then ranks them from the counts of the blocks before. */
+    struct step
+    {
+        Row LF;
+        char c;
+    };
+    std::vector<step> steps(n);
     {
-        std::ostringstream context_before_ss;
-        try
+        const std::string BWT_str = BWT_as_wt->extract();
+        std::vector<std::vector<size_t>> ranks(n_blocks, std::vector<size_t>(256));
+        in_parallel([&](size_t b)
         {
-            copy_n_until(match.second,
-                         max_context,
-                         std::ostream_iterator<char>(context_before_ss),
-                         [new_line_char](char c) -> bool
-                         {
-                             return c == new_line_char;
-                         });
-        }
-        catch(std::overflow_error & e) { };
-        std::ostringstream context_after_ss;
-        try
-        {
-            copy_n_until(match.first,
-                         max_context,
-                         std::ostream_iterator<char>(context_after_ss),
-                         [new_line_char](char c) -> bool
-                         {
-                             return c == new_line_char;
-                         });
+            for(size_t i = b * block; i < std::min(n, (b + 1) * block); i++) ranks[b][static_cast<unsigned char>(BWT_str[i])]++;
+        });
+        for(auto & c_C : C)
+        {
+            size_t rank = c_C.second;
+            for(size_t b = 0; b < n_blocks; b++)
+            {
+                size_t count = ranks[b][static_cast<unsigned char>(c_C.first)];
+                ranks[b][static_cast<unsigned char>(c_C.first)] = rank;
+                rank += count;
+            }
         }
-        catch(std::overflow_error & e) { };
-        std::string context_before_s = context_before_ss.str();
-        l.push_back(std::string(context_before_s.rbegin(), context_before_s.rend()) +
-                    pattern +
-                    context_after_ss.str());
+        in_parallel([&](size_t b)
+        {
+            std::vector<size_t> & rank = ranks[b];
+            for(size_t i = b * block; i < std::min(n, (b + 1) * block); i++)
+            {
+                steps[i].c = BWT_str[i];
+                steps[i].LF = static_cast<Row>(++rank[static_cast<unsigned char>(BWT_str[i])]);
+            }
+        });
     }
 
-    return l;
+    /* Segments of the text end at sampled positions (or the end of the text, whose
+       row is 0), from whose rows LF walks back to the end of the segment before.
+       There are several per thread, which decodes a group of them at once, a step
+       of each in turn, so that their cache misses overlap rather than each waiting
+       for the one before. */
+    const size_t group = 16;
+    std::vector<std::pair<size_t, size_t>> ends{std::make_pair(n, 0)}; // (end, row of end)
+    if(SA_sample_rate > 0)
+    {
+        const size_t segment = std::max<size_t>(n / (n_blocks * group) / SA_sample_rate, 1) * SA_sample_rate;
+        for(size_t i = 0; i < SA_samples.size(); i++)
+            if(SA_samples[i] > 0 && SA_samples[i] < n && SA_samples[i] % segment == 0)
+                ends.push_back(std::make_pair(SA_samples[i], SA_sampled_rows->select1(i)));
+    }
+    std::sort(ends.begin(), ends.end());
+
+    std::atomic<size_t> next_group(0);
+    in_parallel([&](size_t)
+    {
+        std::vector<size_t> begin(group), pos(group), row(group);
+        for(size_t g; (g = group * next_group++) < ends.size(); )
+        {
+            const size_t n_walks = std::min(group, ends.size() - g);
+            for(size_t w = 0; w < n_walks; w++)
+            {
+                begin[w] = g + w == 0 ? 0 : ends[g + w - 1].first;
+                std::tie(pos[w], row[w]) = ends[g + w];
+            }
+            for(bool walking = true; walking; )
+            {
+                walking = false;
+                for(size_t w = 0; w < n_walks; w++)
+                {
+                    if(pos[w] == begin[w]) continue;
+                    const step & s = steps[row[w] > BWT_end_idx ? row[w] - 1 : row[w]]; // Never BWT_end_idx, the row of position 0.
+                    out[--pos[w]] = s.c;
+                    row[w] = s.LF;
+                    walking = true;
+                }
+            }
+        }
+    });
+}
+
+void FMIndex::reconstruct(std::string & out, const size_t n_threads) const
+{
+    size_t threads = n_threads > 0 ? n_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    out.resize(size());
+    if(size() < std::numeric_limits<uint32_t>::max()) inverse_BWT<uint32_t>(&out[0], threads);
+    else inverse_BWT<size_t>(&out[0], threads);
+}
+
+size_t FMIndex::space_usage::total(void) const
+{
+    size_t n = C + SA_samples + kmer_table + position_index;
+    for(const WaveletTree::space_usage * wt : {&BWT, &BWTr})
+        n += wt->bits + wt->rank_directories + wt->alphabets + wt->nodes;
+    return n;
+}
+
+FMIndex::space_usage FMIndex::space_breakdown(void) const
+{
+    space_usage space;
+    space.BWT = BWT_as_wt->space_breakdown();
+    space.BWTr = BWTr_as_wt->space_breakdown();
+    space.C = C.size() * (sizeof(std::pair<const char, size_t>) + 4 * sizeof(void *)); // Rough size of a map node.
+    space.SA_samples = SA_samples.capacity() * sizeof(size_t);
+    if(SA_sampled_rows) space.SA_samples += SA_sampled_rows->bytes_of_bits() + SA_sampled_rows->bytes_of_rank_directory();
+    space.kmer_table = (kmer_intervals.capacity() + kmer_intervals_r.capacity()) * sizeof(std::pair<size_t, size_t>) +
+                       kmer_codes.capacity() * sizeof(size_t);
+    space.position_index = SA_by_row ? SA_by_row->bytes() : 0;
+    return space;
 }
 
 size_t FMIndex::size(void) const
@@ -253,33 +1646,372 @@ FMIndex::const_iterator FMIndex::begin(void) const
     return const_iterator(BWTr_as_wt, BWTr_end_idx, C, 0);
 }
 
+FMIndex::FMIndex(void)
+    : SA_sample_rate(0),
+      kmer_length(0)
+{
+}
+
+template <typename RightRank>
+void FMIndex::merge_order(const std::unique_ptr<WaveletTree> & left,
+                          const std::string & left_BWT,
+                          const size_t left_end_idx,
+                          const std::map<char, size_t> & left_C,
+                          const size_t * C_right,
+                          const size_t right_end_idx,
+                          RightRank right_rank,
+                          std::vector<size_t> & r_by_row,
+                          std::vector<std::pair<size_t, size_t>> & shorts)
+{
+    /* Where the rows of the BWT of the text of left followed by the text of
+       right come from (see interleave_BWTs). Suffixes starting in the right
+       text keep their relative order. Reading the left text backwards (by
+       stepping LF in left) we step LF in right (right_rank(i, c) counts c in
+       its rows [0, i), C_right[c] its characters less than c) at the same time
+       to find how many rows of right precede each suffix starting in the left
+       text: r_by_row, by row of left.
+
+       Suffixes starting in the left text keep their order in left except where
+       one is a prefix of another in left, which only happens for the "short"
+       suffixes matching more than one row of left; these are a tail of the
+       text (see place_shorts). When a short suffix is a prefix of a longer one
+       the order is that of the right text and the rest of the longer one, i.e.
+       whether the latter's row came after right's own (gt below). shorts gets
+       the (rank among suffixes starting in the left text, row of left) of the
+       short suffixes, by rank; the other rows fill the remaining ranks in row
+       order. Takes about 10 bytes per character of left. */
+    const size_t n_left = left_BWT.size();
+    if(n_left >= size_t(1) << 56) throw std::length_error("Text too long to merge");
+    r_by_row.assign(n_left + 1, 0);
+    /* Until the walk leaves a row it holds the row's LF, from the BWT as in
+       inverse_BWT, and above that its character, so a step takes one cache miss. */
+    size_t next[256] = {0};
+    for(auto & c_C : left_C) next[static_cast<unsigned char>(c_C.first)] = c_C.second;
+    for(size_t row = 0; row <= n_left; row++)
+        if(row != left_end_idx)
+        {
+            const unsigned char c = left_BWT[BWT_idx_from_row_idx(row, left_end_idx)];
+            r_by_row[row] = ++next[c] | static_cast<size_t>(c) << 56;
+        }
+
+    std::vector<bool> gt(n_left + 1, false); // Whether the merged suffix at i comes after the right text.
+    std::string reversed_text(n_left, '\0');
+    size_t row = 0, r = right_end_idx;
+    for(size_t i = n_left; i > 0; i--)
+    {
+        const size_t step = r_by_row[row];
+        const char c = static_cast<char>(step >> 56);
+        r_by_row[row] = r;
+        row = step & ((size_t(1) << 56) - 1);
+        r = 1 + C_right[static_cast<unsigned char>(c)] + right_rank(r, c);
+        reversed_text[n_left - i] = c;
+        gt[i-1] = r > right_end_idx;
+    }
+    r_by_row[row] = r;
+
+    size_t C_left[256] = {0};
+    for(auto & c_C : left_C) C_left[static_cast<unsigned char>(c_C.first)] = c_C.second;
+    place_shorts(C_left,
+                 [&left, left_end_idx](const size_t i, const char c) { return rank_before_row(left, left_end_idx, i, c); },
+                 reversed_text, gt, shorts);
+}
+
+template <typename LeftRank>
+void FMIndex::place_shorts(const size_t * C_left,
+                           LeftRank left_rank,
+                           const std::string & reversed_text,
+                           const std::vector<bool> & gt,
+                           std::vector<std::pair<size_t, size_t>> & shorts)
+{
+    /* The short suffixes of the left text (see merge_order), found by backward
+       search in left (left_rank(i, c) counts c in its rows [0, i), C_left[c]
+       its characters less than c), and where they go given gt. */
+    struct short_suffix
+    {
+        size_t i, row, n; // Suffix at i of left, matching rows [row, row+n) of left.
+    };
+    const size_t n_left = reversed_text.size();
+    std::vector<short_suffix> found;
+    for(size_t i = n_left, lb = 0, n = n_left + 1; i > 0 && n > 1; i--)
+    {
+        // The suffix itself comes first of the rows it matches.
+        const char c = reversed_text[n_left - i];
+        n = left_rank(lb + n, c) - left_rank(lb, c);
+        lb = 1 + C_left[static_cast<unsigned char>(c)] + left_rank(lb, c);
+        if(n > 1) found.push_back(short_suffix{i-1, lb, n});
+    }
+    shorts.clear();
+    if(found.empty()) return;
+
+    /* A short suffix of length L also matches where the text before k ends
+       with it, for each k (but the end of the text) with lcs[k] >= L, lcs[k]
+       being the longest common suffix of the text before k and the whole text,
+       i.e. the Z-function of the reversed text. Those with the merged suffix
+       at k before the right text come before the short suffix. As the short
+       suffixes are at most max_len long we only need that much of the Z-function. */
+    const size_t max_len = n_left - found.back().i;
+    std::vector<size_t> z(max_len, 0), n_before(max_len + 2, 0);
+    for(size_t j = 1, z_begin = 0, z_end = 0; j < n_left; j++)
+    {
+        size_t len = j < z_end ? std::min(z[j - z_begin], z_end - j) : 0;
+        while(len < max_len && j + len < n_left && reversed_text[j + len] == reversed_text[len]) len++;
+        if(j + len > z_end)
+        {
+            z_begin = j;
+            z_end = j + len;
+        }
+        if(j < max_len) z[j] = len;
+        if(!gt[n_left - j]) n_before[len]++;
+    }
+    for(size_t len = max_len; len > 0; len--) n_before[len-1] += n_before[len]; // Now for lcs >= len.
+    z = std::vector<size_t>();
+
+    std::sort(found.begin(), found.end(), [&gt, n_left](const short_suffix & x, const short_suffix & y) -> bool
+    {
+        if(x.i < y.i && y.row <= x.row && x.row < y.row + y.n) return !gt[x.i + n_left - y.i];
+        if(y.i < x.i && x.row <= y.row && y.row < x.row + x.n) return gt[y.i + n_left - x.i];
+        return x.row < y.row;
+    });
+    std::vector<size_t> rows;
+    for(auto & x : found) rows.push_back(x.row);
+    std::sort(rows.begin(), rows.end());
+    std::vector<size_t> placed(rows.size() + 1, 0); // Fenwick tree of the short suffixes placed so far, by row.
+    for(size_t rank = 0; rank < found.size(); rank++)
+    {
+        const short_suffix & x = found[rank];
+        const size_t first = std::lower_bound(rows.begin(), rows.end(), x.row) - rows.begin();
+        const size_t last = std::lower_bound(rows.begin(), rows.end(), x.row + x.n) - rows.begin();
+        size_t placed_within = 0; // Short suffixes in x's rows, after x in left but placed before it.
+        for(size_t j = last; j > 0; j -= j & -j) placed_within += placed[j];
+        for(size_t j = first + 1; j > 0; j -= j & -j) placed_within -= placed[j];
+        // Other rows before x's, other rows among x's which come before it, short suffixes before it.
+        shorts.push_back(std::make_pair((x.row - 1 - first) + (n_before[n_left - x.i] - placed_within) + rank, x.row));
+        for(size_t j = first + 1; j < placed.size(); j += j & -j) placed[j]++;
+    }
+}
+
+template <typename RightReader, typename MergedWriter>
+size_t FMIndex::interleave_BWTs(const std::string & left_BWT,
+                                const size_t left_end_idx,
+                                const std::vector<size_t> & r_by_row,
+                                const std::vector<std::pair<size_t, size_t>> & shorts,
+                                const size_t n_right,
+                                const size_t right_end_idx,
+                                RightReader next_right,
+                                MergedWriter write)
+{
+    /* Writes the merged BWT given the output of merge_order, reading the BWT
+       of right in order (next_right), and returns its end_idx. Row 0 of left
+       is the empty suffix, so left_BWT[0] is the last character of the left
+       text, which precedes the right text. */
+    const size_t n_left = left_BWT.size();
+    std::vector<size_t> short_rows;
+    for(auto & x : shorts) short_rows.push_back(x.second);
+    std::sort(short_rows.begin(), short_rows.end());
+    std::vector<size_t>::const_iterator next_short_row = short_rows.begin();
+    std::vector<std::pair<size_t, size_t>>::const_iterator next_short = shorts.begin();
+    size_t end_idx = 0, n_written = 0, j = 0, next_row = 1; // j is the next row of right to copy.
+    for(size_t rank = 0; rank < n_left; rank++)
+    {
+        size_t row;
+        if(next_short != shorts.end() && next_short->first == rank) row = (next_short++)->second;
+        else
+        {
+            for(; next_short_row != short_rows.end() && *next_short_row == next_row; ++next_short_row) next_row++;
+            row = next_row++;
+        }
+        for(; j < r_by_row[row]; j++, n_written++)
+            write(j == right_end_idx ? left_BWT[0] : next_right());
+        if(row == left_end_idx) end_idx = n_written; // Every earlier row has a character.
+        else
+        {
+            write(left_BWT[BWT_idx_from_row_idx(row, left_end_idx)]);
+            n_written++;
+        }
+    }
+    for(; j <= n_right; j++)
+        write(j == right_end_idx ? left_BWT[0] : next_right());
+    return end_idx;
+}
+
+size_t FMIndex::merge_in_front(const std::unique_ptr<WaveletTree> & left,
+                               const size_t left_end_idx,
+                               const std::map<char, size_t> & left_C,
+                               std::string & BWT,
+                               const size_t end_idx)
+{
+    // Replaces BWT (with end_idx) by the BWT of the text of left followed by its text and returns the new end_idx.
+    std::string left_BWT = left->extract();
+    std::vector<size_t> r_by_row;
+    std::vector<std::pair<size_t, size_t>> shorts;
+    {
+        rank_directory right_ranks(BWT.data(), BWT.size());
+        size_t C_right[256];
+        right_ranks.cumulative_counts(C_right);
+        merge_order(left, left_BWT, left_end_idx, left_C, C_right, end_idx,
+                    [&right_ranks, end_idx](const size_t i, const char c) { return right_ranks.rank(i > end_idx ? i-1 : i, c); },
+                    r_by_row, shorts);
+    }
+
+    std::string merged;
+    merged.reserve(left_BWT.size() + BWT.size());
+    std::string::const_iterator right_it = BWT.begin();
+    const size_t merged_end_idx = interleave_BWTs(left_BWT, left_end_idx, r_by_row, shorts, BWT.size(), end_idx,
+                                                  [&right_it]() { return *right_it++; },
+                                                  [&merged](const char c) { merged.push_back(c); });
+    BWT.swap(merged);
+    return merged_end_idx;
+}
+
+size_t FMIndex::merge_BWTs(const std::vector<const FMIndex *> & fmis, const bool reversed, std::string & BWT)
+{
+    /* Sets BWT to the BWT of the texts of fmis in turn (or of the reverse) and
+       returns its end_idx. Each text is merged in front of those after it (in
+       the reverse, before it) as a plain string, so merge_order walks each text
+       but the last once and the WaveletTree is built once, by the caller. */
+    size_t end_idx;
+    if(!reversed)
+    {
+        BWT = fmis.back()->BWT_as_wt->extract();
+        end_idx = fmis.back()->BWT_end_idx;
+        for(size_t i = fmis.size() - 1; i > 0; i--)
+            end_idx = merge_in_front(fmis[i-1]->BWT_as_wt, fmis[i-1]->BWT_end_idx, fmis[i-1]->C, BWT, end_idx);
+    }
+    else
+    {
+        BWT = fmis.front()->BWTr_as_wt->extract();
+        end_idx = fmis.front()->BWTr_end_idx;
+        for(size_t i = 1; i < fmis.size(); i++)
+            end_idx = merge_in_front(fmis[i]->BWTr_as_wt, fmis[i]->BWTr_end_idx, fmis[i]->C, BWT, end_idx);
+    }
+    return end_idx;
+}
+
+FMIndex * FMIndex::merge(const FMIndex & a, const FMIndex & b)
+{
+    return merge(std::vector<const FMIndex *>{&a, &b});
+}
+
+FMIndex * FMIndex::merge(const std::vector<const FMIndex *> & fmis)
+{
+    if(fmis.size() < 2) throw std::invalid_argument("Need at least two indexes to merge");
+    std::unique_ptr<FMIndex> fmi(new FMIndex());
+    // The two directions are independent so build them in parallel.
+    std::shared_ptr<StorageAllocator> allocator = StorageAllocator::current();
+    std::future<std::unique_ptr<WaveletTree>> BWTr_as_wt = std::async(std::launch::async,
+        [&fmis, &fmi, allocator]() -> std::unique_ptr<WaveletTree>
+        {
+            StorageAllocator::thread_scope scope(allocator);
+            std::string s_BWTr;
+            fmi->BWTr_end_idx = merge_BWTs(fmis, true, s_BWTr);
+            return std::unique_ptr<WaveletTree>(new WaveletTree(s_BWTr));
+        });
+    std::string s_BWT;
+    fmi->BWT_end_idx = merge_BWTs(fmis, false, s_BWT);
+    fmi->BWT_as_wt = std::unique_ptr<WaveletTree>(new WaveletTree(s_BWT));
+    fmi->BWTr_as_wt = BWTr_as_wt.get();
+
+    fmi->populate_C();
+    fmi->SA_sample_rate = fmis[0]->SA_sample_rate;
+    if(fmi->SA_sample_rate > 0) fmi->sample_SA();
+    return fmi.release();
+}
+
 void FMIndex::serialize_to_file(const std::string & filename) const
 {
     /* Intended for use in python (via Cython wrapper). Important as
        will save copying *large* amounts of data from C++ to python */
     std::ofstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
     serialize(std::ostreambuf_iterator<char>{f});
 }
 
 FMIndex * FMIndex::new_from_serialized_file(const std::string & filename)
 {
     std::ifstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
     return new FMIndex{std::istreambuf_iterator<char>{f}};
 }
 
 FMIndex::FMIndex(std::istreambuf_iterator<char> serial_data)
 {
+    /* Indexes serialized before there was a header start with the alphabet
+       size of BWT_as_wt instead, so fail the magic check. They are not read:
+       their layout changed without a version, so rebuild them. */
+    char magic[sizeof(serial_magic)];
+    deserialize_from_chars(serial_data, magic);
+    if(!std::equal(magic, magic + sizeof(magic), serial_magic))
+        throw std::runtime_error("Not a serialized FMIndex, or one from before format versions: rebuild it");
+    size_t version;
+    deserialize_from_chars(serial_data, version);
+    if(version != serial_version)
+        throw std::runtime_error("Serialized FMIndex has format version " + std::to_string(version) +
+                                 " but only version " + std::to_string(serial_version) + " can be read");
+
     BWT_as_wt = std::unique_ptr<WaveletTree>(new WaveletTree(serial_data));
     deserialize_from_chars(serial_data, BWT_end_idx);
     BWTr_as_wt = std::unique_ptr<WaveletTree>(new WaveletTree(serial_data));
     deserialize_from_chars(serial_data, BWTr_end_idx);
     populate_C();
+    deserialize_from_chars(serial_data, SA_sample_rate);
+    if(SA_sample_rate > 0)
+    {
+        SA_sampled_rows = std::unique_ptr<BitVector>(new BitVector(serial_data));
+        size_t n_samples;
+        deserialize_from_chars(serial_data, n_samples);
+        SA_samples.resize(n_samples);
+        for(size_t i = 0; i < n_samples; i++)
+            deserialize_from_chars(serial_data, SA_samples[i]);
+    }
+    deserialize_from_chars(serial_data, kmer_length);
+    if(kmer_length > 0)
+    {
+        populate_kmer_codes();
+        size_t n_kmers;
+        deserialize_from_chars(serial_data, n_kmers);
+        kmer_intervals.resize(n_kmers);
+        kmer_intervals_r.resize(n_kmers);
+        for(size_t i = 0; i < n_kmers; i++)
+        {
+            deserialize_from_chars(serial_data, kmer_intervals[i].first);
+            deserialize_from_chars(serial_data, kmer_intervals[i].second);
+            deserialize_from_chars(serial_data, kmer_intervals_r[i].first);
+            deserialize_from_chars(serial_data, kmer_intervals_r[i].second);
+        }
+    }
+    size_t has_positions;
+    deserialize_from_chars(serial_data, has_positions);
+    if(has_positions) SA_by_row = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(serial_data));
 }
 
 void FMIndex::serialize(std::ostreambuf_iterator<char> serial_data) const
 {
+    serialize_as_chars(serial_data, serial_magic);
+    serialize_as_chars(serial_data, serial_version);
     BWT_as_wt->serialize(serial_data);
     serialize_as_chars(serial_data, BWT_end_idx);
     BWTr_as_wt->serialize(serial_data);
     serialize_as_chars(serial_data, BWTr_end_idx);
+    serialize_as_chars(serial_data, SA_sample_rate);
+    if(SA_sample_rate > 0)
+    {
+        SA_sampled_rows->serialize(serial_data);
+        serialize_as_chars(serial_data, SA_samples.size());
+        for(size_t i = 0; i < SA_samples.size(); i++)
+            serialize_as_chars(serial_data, SA_samples[i]);
+    }
+    serialize_as_chars(serial_data, kmer_length);
+    if(kmer_length > 0)
+    {
+        serialize_as_chars(serial_data, kmer_intervals.size());
+        for(size_t i = 0; i < kmer_intervals.size(); i++)
+        {
+            serialize_as_chars(serial_data, kmer_intervals[i].first);
+            serialize_as_chars(serial_data, kmer_intervals[i].second);
+            serialize_as_chars(serial_data, kmer_intervals_r[i].first);
+            serialize_as_chars(serial_data, kmer_intervals_r[i].second);
+        }
+    }
+    serialize_as_chars(serial_data, static_cast<size_t>(SA_by_row ? 1 : 0));
+    if(SA_by_row) SA_by_row->serialize(serial_data);
 }
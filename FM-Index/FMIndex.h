@@ -3,9 +3,15 @@
 
 #include <map>
 #include <list>
+#include <string>
+#include <vector>
 #include <iterator>
+#include <functional>
+#include <stdexcept>
 
 #include "WaveletTree.h"
+#include "WaveletMatrix.h"
+#include "Pattern.h"
 
 class FMIndex
 {
@@ -51,50 +57,535 @@ public:
 
     typedef const_iterator const_reverse_iterator; // What is type-safe way of doing this?
 
+    struct space_usage // In bytes.
+    {
+        WaveletTree::space_usage BWT, BWTr;
+        size_t C, SA_samples, kmer_table, position_index;
+
+        size_t total(void) const;
+    };
+
+    struct SMEM
+    {
+        size_t begin, end; // The match is query[begin, end)...
+        size_t lb, ub; // ...which prefixes suffix array rows [lb, ub).
+    };
+
+    /* A right-maximal repeat: a string which occurs at least twice and is not
+       always followed by the same character (nor always by the end of the text),
+       i.e., an internal node of the suffix tree of the text. */
+    struct repeat
+    {
+        std::string substring; // Which prefixes suffix array rows [lb, ub).
+        size_t lb, ub;
+    };
+
 private:
+    struct bi_interval
+    {
+        size_t lb, lbr, n; // Rows [lb, lb+n) of BWT_as_wt and [lbr, lbr+n) of BWTr_as_wt.
+        size_t end; // End in query of the string whose rows these are.
+    };
+
     std::unique_ptr<WaveletTree> BWT_as_wt, BWTr_as_wt;
     size_t BWT_end_idx, BWTr_end_idx;
     std::map<char, size_t> C;
+    size_t SA_sample_rate; // Zero if no samples are kept.
+    std::unique_ptr<BitVector> SA_sampled_rows; // Bit i set iff SA value of row i is sampled.
+    std::vector<size_t> SA_samples; // Sampled SA values, in order of row.
+    size_t kmer_length; // Zero if no k-mer table is kept.
+    std::vector<size_t> kmer_codes; // Position in C of each byte, or C.size() if absent.
+    std::vector<std::pair<size_t, size_t>> kmer_intervals, kmer_intervals_r; // backward_search state after each k-mer.
+    std::unique_ptr<WaveletMatrix> SA_by_row; // The whole suffix array, if index_positions has been called.
 
     static size_t BWT_idx_from_row_idx(const size_t i, const size_t end_idx);
 
+    static size_t query_parts(const size_t n_matches);
+
+    // Calls f(part, begin, end) for each of the query_parts(n) parts [begin, end) of [0, n), each on its own thread.
+    static void for_each_part(const size_t n, const std::function<void(size_t, size_t, size_t)> & f);
+
+    static size_t rank_before_row(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                                  const size_t end_idx,
+                                  const size_t i,
+                                  const char c);
+
+    static size_t rank_less_before_row(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                                       const size_t end_idx,
+                                       const size_t i,
+                                       const char c);
+
+    static size_t LF(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                     const size_t end_idx,
+                     const std::map<char, size_t> & C,
+                     const size_t i,
+                     char & c);
+
+    static void backward_step(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                              const size_t end_idx,
+                              std::map<char, size_t>::const_iterator C_it,
+                              size_t & lb,
+                              size_t & ub);
+
     template <typename ForwardIterator>
     std::pair<size_t, size_t> backward_search(ForwardIterator i_pattern,
                                               ForwardIterator i_pattern_end,
                                               const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
                                               const size_t end_idx) const;
 
-    void msd_sort(size_t * fr_perm,
-                  const size_t len,
-                  const_iterator ** text_iters,
-                  const size_t depth_left) const;
+    struct row_pair
+    {
+        size_t row, match, row_r; // Row of BWT_as_wt reached from that of the match, and the match's row of BWTr_as_wt.
+        char c;
+    };
+
+    void pair_rows(std::vector<row_pair>::iterator begin,
+                   std::vector<row_pair>::iterator end,
+                   size_t lb,
+                   const size_t ub,
+                   size_t lbr,
+                   const size_t depth_left) const;
+
+    size_t pair_matches(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
+                        const size_t lb,
+                        const size_t ub,
+                        const size_t lbr,
+                        const size_t max_context) const;
+
+    std::vector<size_t> locate_rows(const size_t lb, const size_t ub) const;
+
+    size_t BWTr_row_from_BWT_row(size_t i,
+                                 size_t lb,
+                                 size_t ub,
+                                 size_t lbr,
+                                 const size_t max_context) const;
+
+    std::string line_from_match(const std::pair<const_iterator, const_reverse_iterator> & match,
+                                const std::string & pattern,
+                                const char new_line_char,
+                                const size_t max_context) const;
+
+    void left_extensions(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                         const size_t end_idx,
+                         const size_t lb,
+                         const size_t ub,
+                         std::vector<std::tuple<char, size_t, size_t>> & extensions) const;
+
+    void search_pattern(const std::vector<Pattern::Item> & items,
+                        const size_t n_items,
+                        const size_t n_repeats,
+                        const size_t lb,
+                        const size_t ub,
+                        std::string & match,
+                        std::map<std::string, size_t> & matches) const;
+
+    void extend_bidirectional(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                              const size_t end_idx,
+                              size_t & lb,
+                              size_t & lb_other,
+                              size_t & n,
+                              const char c) const;
+
+    size_t smems_from(const std::string & query,
+                      const size_t x,
+                      const size_t min_occ,
+                      std::vector<SMEM> & smems) const;
+
+    bool right_maximal(const size_t lbr, const size_t n) const;
+
+    void repeats_ending_with(const char c,
+                             const size_t min_occ,
+                             const std::function<bool(const repeat &)> & visit) const;
+
+    void fill_kmer_intervals(const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                             const size_t end_idx,
+                             const size_t depth,
+                             const size_t key,
+                             const size_t lb,
+                             const size_t ub,
+                             std::vector<std::pair<size_t, size_t>> & intervals) const;
+
+    void build(const char * s, const size_t n, const bool parallel = false, std::string * text = nullptr);
+
+    static const char * map_file(const std::string & filename, size_t & n);
+
+    static std::unique_ptr<WaveletTree> external_BWT(const char * s,
+                                                     const size_t n,
+                                                     const bool reversed,
+                                                     const size_t block_size,
+                                                     const std::string & scratch_prefix,
+                                                     size_t & end_idx);
+
+    template <typename Row>
+    void inverse_BWT(char * out, const size_t n_threads) const;
 
     void populate_C(void);
 
+    void populate_kmer_codes(void);
+
+    void sample_SA(void);
+
+    template <typename RightRank>
+    static void merge_order(const std::unique_ptr<WaveletTree> & left,
+                            const std::string & left_BWT,
+                            const size_t left_end_idx,
+                            const std::map<char, size_t> & left_C,
+                            const size_t * C_right,
+                            const size_t right_end_idx,
+                            RightRank right_rank,
+                            std::vector<size_t> & r_by_row,
+                            std::vector<std::pair<size_t, size_t>> & shorts);
+
+    template <typename LeftRank>
+    static void place_shorts(const size_t * C_left,
+                             LeftRank left_rank,
+                             const std::string & reversed_text,
+                             const std::vector<bool> & gt,
+                             std::vector<std::pair<size_t, size_t>> & shorts);
+
+    template <typename RightReader, typename MergedWriter>
+    static size_t interleave_BWTs(const std::string & left_BWT,
+                                  const size_t left_end_idx,
+                                  const std::vector<size_t> & r_by_row,
+                                  const std::vector<std::pair<size_t, size_t>> & shorts,
+                                  const size_t n_right,
+                                  const size_t right_end_idx,
+                                  RightReader next_right,
+                                  MergedWriter write);
+
+    static size_t merge_in_front(const std::unique_ptr<WaveletTree> & left,
+                                 const size_t left_end_idx,
+                                 const std::map<char, size_t> & left_C,
+                                 std::string & BWT,
+                                 const size_t end_idx);
+
+    static size_t merge_BWTs(const std::vector<const FMIndex *> & fmis, const bool reversed, std::string & BWT);
+
+    FMIndex(void);
+
 public:
-    FMIndex(const std::string & s);
+    FMIndex(const std::string & s, const size_t SA_sample_rate = 32);
+
+    // As above, but the BWT is computed in s's buffer rather than a copy; s is left empty.
+    FMIndex(std::string && s, const size_t SA_sample_rate = 32);
 
     FMIndex(std::istreambuf_iterator<char> serial_data);
 
+    /* Index of the n bytes at s, read in place. If parallel, the two BWTs are
+       built at once, which takes about twice the memory. */
+    static FMIndex * new_from_buffer(const char * s,
+                                     const size_t n,
+                                     const size_t SA_sample_rate = 32,
+                                     const bool parallel = false);
+
+    // Index of the contents of a file, which is memory mapped rather than read.
+    static FMIndex * new_from_file(const std::string & filename,
+                                   const size_t SA_sample_rate = 32,
+                                   const bool parallel = false);
+
+    /* As new_from_file, but the suffix sorting is done in blocks which fit in
+       memory_budget bytes, with the BWTs built so far kept in scratch_dir.
+       Memory use is the index plus about memory_budget; the text is never
+       sorted as a whole, so its suffix array is never held in memory. Each
+       block is merged into the BWT on disk in one sequential pass, reading the
+       text after it, so the cost grows with the number of blocks. The result
+       is identical to that of new_from_file. */
+    static FMIndex * new_from_file_external(const std::string & filename,
+                                            const std::string & scratch_dir,
+                                            const size_t memory_budget,
+                                            const size_t SA_sample_rate = 32);
+
+    /* Precompute the search intervals of every string of length k over the
+       alphabet of the text, in both directions, so that searches for patterns
+       of length at least k start k steps in. k is the largest value up to max_k
+       for which the table fits in max_bytes (no table if none does). The table
+       is serialized with the index but not carried over by merge. */
+    void index_kmers(const size_t max_bytes, const size_t max_k = 12);
+
+    size_t kmer_table_length(void) const; // The k of index_kmers; zero if there is no table.
+
+    /* Keep the whole suffix array, in a wavelet matrix of about (n + 1) log2(n + 1)
+       bits, so that count_in_range and locate_in_range take O(log n) steps after
+       the search, however many matches there are outside the range, and locate
+       takes O(log n) per match. Serialized with the index but not carried over
+       by merge. */
+    void index_positions(void);
+
+    bool has_position_index(void) const;
+
+    /* The number of matches of the pattern lying within text[begin, end), e.g.
+       within one time window of a log. Without the position index the matches
+       are located and filtered. */
+    size_t count_in_range(const std::string & pattern, const size_t begin, const size_t end) const;
+
+    // The positions of those matches, in increasing order.
+    std::vector<size_t> locate_in_range(const std::string & pattern, const size_t begin, const size_t end) const;
+
     size_t findn(const std::string & pattern) const;
 
+    size_t findn(const char * pattern, const size_t length) const; // No copy of the pattern is made.
+
+    /* Lets find, find_lines and locate split the matches of a query made on the
+       calling thread into parts of at least min_matches, handled on up to
+       max_threads threads (including the calling one), e.g. for interactive use
+       of a big machine. The results are the same, in the same order. By default
+       queries run on the calling thread alone, as is best when many threads make
+       queries at once (e.g., QueryServer). */
+    static void set_thread_query_parallelism(const size_t max_threads, const size_t min_matches = 100000);
+
+    /* findn for n_patterns patterns at once, for callers (e.g. the Python wrapper)
+       for which each call is expensive. Sets counts[i] to the number of matches
+       of patterns[i] (of length lengths[i]) and, if lbs is not null, lbs[i] to
+       the start of its suffix array interval (see find_interval). */
+    void findn_batch(const char * const * patterns,
+                     const size_t * lengths,
+                     const size_t n_patterns,
+                     size_t * counts,
+                     size_t * lbs = nullptr) const;
+
+    /* The number of matches of each pattern, for many patterns sharing suffixes
+       (e.g., words with common endings): the patterns are searched depth-first
+       over the trie of their reverses, so each shared suffix is searched once
+       and no step is taken below a suffix which does not occur. */
+    std::vector<size_t> count_many(const std::vector<std::string> & patterns) const;
+
     size_t find(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
                 const std::string & pattern,
                 const size_t max_context = 100) const;
 
+    size_t findn(const Pattern & pattern) const;
+
+    // Adds each distinct string matching the pattern with its number of occurrences; returns the total.
+    size_t find_distinct(std::map<std::string, size_t> & matches,
+                         const Pattern & pattern) const;
+
     std::list<std::string> find_lines(const std::string & pattern,
                                       const char new_line_char = '\n',
                                       const size_t max_context = 100) const;
 
+    /* The super-maximal exact matches of the query: the matches of substrings
+       of the query which cannot be extended either way and are not contained in
+       another such match. Only counts substrings occurring at least min_occ
+       times and only reports matches of length at least min_len. Uses BWA's
+       algorithm (docs/BWA.pdf) so takes O(query length) LF steps in practice. */
+    std::vector<SMEM> smems(const std::string & query,
+                            const size_t min_len = 1,
+                            const size_t min_occ = 1) const;
+
+    std::list<std::string> find_lines(const Pattern & pattern,
+                                      const char new_line_char = '\n',
+                                      const size_t max_context = 100) const;
+
+    /* The k most frequent completions of the prefix, most frequent first, with
+       their numbers of occurrences: the prefix followed by the text up to the next
+       delimiter or the end of the text, or by at most max_length characters. Found
+       by best-first search over the continuations of the prefix, so the work is
+       proportional to the number of continuations at least as frequent as the
+       k-th, not to the number of occurrences. */
+    std::vector<std::pair<std::string, size_t>> top_completions(const std::string & prefix,
+                                                                const size_t k,
+                                                                const char delimiter = ' ',
+                                                                const size_t max_length = 100) const;
+
+    /* Calls visit with each right-maximal repeat occurring at least min_occ times,
+       walking the suffix tree through BWT intervals: from each repeat to those
+       which extend it by a character on the left (every suffix of a right-maximal
+       repeat is one too). So a repeat is visited before the longer ones ending with
+       it, which occur no more often, and these are skipped if visit returns false.
+       The order of the visits is unspecified; if parallel, the repeats ending with
+       each character are visited on one of several threads, so visit must be
+       thread safe. */
+    void visit_repeats(const std::function<bool(const repeat &)> & visit,
+                       const size_t min_occ = 2,
+                       const bool parallel = false) const;
+
+    // The right-maximal repeats at least min_len long occurring at least min_occ times, sorted.
+    std::vector<repeat> right_maximal_repeats(const size_t min_len = 1,
+                                              const size_t min_occ = 2,
+                                              const bool parallel = false) const;
+
+    /* The n most frequent strings at least min_len long, most frequent first, of
+       which there are at most n (fewer if there are fewer repeats). Of strings
+       occurring in the same places only the longest, a right-maximal repeat, is
+       counted: e.g., for log template mining or compression dictionaries. */
+    std::vector<repeat> frequent_substrings(const size_t n,
+                                            const size_t min_len = 1,
+                                            const bool parallel = false) const;
+
+    /* As find and find_lines but only produce the matches [offset, offset + limit)
+       of the full result, in the same order. The work done is proportional to the
+       size of the slice, not the number of matches. find_slice returns the total
+       number of matches. */
+    size_t find_slice(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
+                      const std::string & pattern,
+                      const size_t offset,
+                      const size_t limit,
+                      const size_t max_context = 100) const;
+
+    std::list<std::string> find_lines_slice(const std::string & pattern,
+                                            const size_t offset,
+                                            const size_t limit,
+                                            const char new_line_char = '\n',
+                                            const size_t max_context = 100) const;
+
+    /* The rows [lb, ub) of the suffix array whose suffixes are prefixed by the
+       pattern (ub <= lb if there are none). The suffix array has size() + 1 rows
+       since row 0 is the empty suffix. */
+    std::pair<size_t, size_t> find_interval(const std::string & pattern) const;
+
+    std::pair<size_t, size_t> find_interval(const char * pattern, const size_t length) const;
+
+    size_t locate(size_t row) const; // Suffix array value, i.e., text position, of row.
+
+    std::vector<size_t> locate(const std::string & pattern) const; // Text positions of all matches.
+
+    /* As the queries of the same names, for the pattern [begin, end) of any
+       bidirectional iterators over chars (e.g., into a buffer, std::vector<char>
+       or part of a larger string), which is searched in place, not copied. Only
+       find_lines, whose lines contain it, makes a string of the pattern. */
+    template <typename BidirectionalIterator>
+    std::pair<size_t, size_t> find_interval(BidirectionalIterator begin, BidirectionalIterator end) const;
+
+    template <typename BidirectionalIterator>
+    size_t findn(BidirectionalIterator begin, BidirectionalIterator end) const;
+
+    template <typename BidirectionalIterator>
+    std::vector<size_t> locate(BidirectionalIterator begin, BidirectionalIterator end) const;
+
+    template <typename BidirectionalIterator>
+    size_t find(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
+                BidirectionalIterator begin,
+                BidirectionalIterator end,
+                const size_t max_context = 100) const;
+
+    template <typename BidirectionalIterator>
+    std::list<std::string> find_lines(BidirectionalIterator begin,
+                                      BidirectionalIterator end,
+                                      const char new_line_char = '\n',
+                                      const size_t max_context = 100) const;
+
+    std::vector<size_t> suffix_array(void) const; // The full suffix array, recovered by walking the text.
+
     size_t size(void) const;
 
+    space_usage space_breakdown(void) const;
+
     const_iterator begin(void) const;
 
+    /* Sets out to the text, rebuilt by inverting the BWT with LF in a plain array
+       (about 9 bytes per character while it runs, 17 beyond 4 GB): much faster
+       than walking begin(). The text is cut at sampled suffix array values into
+       segments decoded at once on n_threads threads (0 for one per hardware
+       thread); without samples it is decoded in one piece, several times slower. */
+    void reconstruct(std::string & out, const size_t n_threads = 0) const;
+
     void serialize(std::ostreambuf_iterator<char> serial_data) const;
 
     void serialize_to_file(const std::string & filename) const;
 
     static FMIndex * new_from_serialized_file(const std::string & filename);
+
+    /* Index of the text of a followed by the text of b, built from their BWTs
+       without suffix sorting the text again. Keeps a's suffix array sample rate. */
+    static FMIndex * merge(const FMIndex & a, const FMIndex & b);
+
+    /* Index of the texts of two or more indexes in turn, as above. Costs about
+       as much as merging two indexes of the same total size, much less than
+       merging them a pair at a time. */
+    static FMIndex * merge(const std::vector<const FMIndex *> & fmis);
 };
 
+template <typename ForwardIterator>
+std::pair<size_t, size_t> FMIndex::backward_search(ForwardIterator i_pattern,
+                                                   ForwardIterator i_pattern_end,
+                                                   const std::unique_ptr<WaveletTree> & BWT_or_BWTr,
+                                                   const size_t end_idx) const
+{
+    std::pair<size_t, size_t> no_matches(1, 0);
+
+    /* lb and ub define the half-open interval (lb, ub] of row indexes into the
+       hypothetical matrix for which the rows are prefixed by the pattern. */
+    size_t lb, ub;
+    std::map<char, size_t>::const_iterator C_it;
+
+    // Start from the k-mer table if the pattern is long enough.
+    ForwardIterator i_kmer_end = i_pattern;
+    size_t depth = 0, key = 0;
+    for(; depth < kmer_length && i_kmer_end != i_pattern_end; ++depth, ++i_kmer_end)
+    {
+        size_t code = kmer_codes[static_cast<unsigned char>(*i_kmer_end)];
+        if(code == C.size()) return no_matches;
+        key = key * C.size() + code;
+    }
+    if(depth > 0 && depth == kmer_length)
+    {
+        std::tie(lb, ub) = (&BWT_or_BWTr == &BWT_as_wt ? kmer_intervals : kmer_intervals_r)[key];
+        if(ub <= lb) return no_matches;
+        i_pattern = i_kmer_end;
+    }
+    else
+    {
+        C_it = C.find(*i_pattern);
+        if(C_it == C.end()) return no_matches;
+        lb = C_it->second;
+        ub = (++C_it == C.end() ? BWT_or_BWTr->size() : C_it->second);
+        ++i_pattern;
+    }
+
+    for(; i_pattern != i_pattern_end; ++i_pattern)
+    {
+        C_it = C.find(*i_pattern);
+        if(C_it == C.end()) return no_matches;
+        backward_step(BWT_or_BWTr, end_idx, C_it, lb, ub);
+        if(ub <= lb) return no_matches;
+    }
+    return std::make_tuple(lb + 1, ub + 1); // Return as more-conventional half-open interval [lb, ub)
+}
+
+template <typename BidirectionalIterator>
+std::pair<size_t, size_t> FMIndex::find_interval(BidirectionalIterator begin, BidirectionalIterator end) const
+{
+    if(begin == end) throw std::length_error("Cannot search for zero-length pattern");
+
+    return backward_search(std::reverse_iterator<BidirectionalIterator>(end),
+                           std::reverse_iterator<BidirectionalIterator>(begin),
+                           BWT_as_wt, BWT_end_idx);
+}
+
+template <typename BidirectionalIterator>
+size_t FMIndex::findn(BidirectionalIterator begin, BidirectionalIterator end) const
+{
+    std::pair<size_t, size_t> interval = find_interval(begin, end);
+    return interval.second <= interval.first ? 0 : interval.second - interval.first;
+}
+
+template <typename BidirectionalIterator>
+std::vector<size_t> FMIndex::locate(BidirectionalIterator begin, BidirectionalIterator end) const
+{
+    std::pair<size_t, size_t> interval = find_interval(begin, end);
+    return locate_rows(interval.first, interval.second);
+}
+
+template <typename BidirectionalIterator>
+size_t FMIndex::find(std::list<std::pair<const_iterator, const_reverse_iterator>> & matches,
+                     BidirectionalIterator begin,
+                     BidirectionalIterator end,
+                     const size_t max_context) const
+{
+    size_t lb, ub, lbr, ubr;
+    std::tie(lb, ub) = find_interval(begin, end);
+    if(ub <= lb) return 0;
+    std::tie(lbr, ubr) = backward_search(begin, end, BWTr_as_wt, BWTr_end_idx);
+    return pair_matches(matches, lb, ub, lbr, max_context);
+}
+
+template <typename BidirectionalIterator>
+std::list<std::string> FMIndex::find_lines(BidirectionalIterator begin,
+                                           BidirectionalIterator end,
+                                           const char new_line_char,
+                                           const size_t max_context) const
+{
+    return find_lines(std::string(begin, end), new_line_char, max_context);
+}
+
 #endif /* defined(__FM_Index__FMIndex__) */
@@ -0,0 +1,68 @@
+#include <stdexcept>
+#include <thread>
+
+#include "FMIndexHandle.h"
+
+FMIndexHandle::FMIndexHandle(const std::shared_ptr<const FMIndex> & fmi)
+    : current(fmi.get()),
+      epoch(0),
+      owner(fmi)
+{
+    if(!fmi) throw std::invalid_argument("FMIndexHandle needs an FMIndex");
+    for(auto & s : stripes) s.readers[0] = s.readers[1] = 0;
+}
+
+size_t FMIndexHandle::thread_stripe(void)
+{
+    static std::atomic<size_t> next_stripe(0);
+    thread_local size_t stripe = next_stripe++ % n_stripes;
+    return stripe;
+}
+
+FMIndexHandle::reader FMIndexHandle::read(void) const
+{
+    stripe & s = stripes[thread_stripe()];
+    for(;;)
+    {
+        // Count ourselves in the epoch's parity, then check the epoch did not advance meanwhile:
+        // if it did, a swap may already be waiting on the other parity, so try again.
+        size_t e = epoch.load();
+        std::atomic<size_t> * counter = &s.readers[e & 1];
+        counter->fetch_add(1);
+        if(epoch.load() == e) return reader(counter, current.load());
+        counter->fetch_sub(1);
+    }
+}
+
+void FMIndexHandle::swap(const std::shared_ptr<const FMIndex> & fmi)
+{
+    if(!fmi) throw std::invalid_argument("FMIndexHandle needs an FMIndex");
+    std::lock_guard<std::mutex> lock(swap_mutex);
+    current.store(fmi.get());
+    size_t e = epoch.fetch_add(1);
+
+    // Readers who might have the old index are counted in parity e & 1; new readers use the other.
+    for(size_t waits = 0; ; waits++)
+    {
+        size_t n = 0;
+        for(auto & s : stripes) n += s.readers[e & 1].load();
+        if(n == 0) break;
+        if(waits < 100) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    owner = fmi; // Frees the old index, unless it is shared, here rather than on a query thread.
+}
+
+std::future<void> FMIndexHandle::swap_from_serialized_file(const std::string & filename)
+{
+    return std::async(std::launch::async, [this, filename]()
+    {
+        std::shared_ptr<const FMIndex> fmi(FMIndex::new_from_serialized_file(filename));
+        swap(fmi);
+    });
+}
+
+size_t FMIndexHandle::generation(void) const
+{
+    return epoch.load();
+}
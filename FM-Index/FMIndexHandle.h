@@ -0,0 +1,91 @@
+#ifndef __FM_Index__FMIndexHandle__
+#define __FM_Index__FMIndexHandle__
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "FMIndex.h"
+
+/* Holds the current FMIndex for many query threads, and lets it be replaced
+   (e.g., by a rebuilt index loaded in the background) without stopping them.
+
+   Readers never lock or wait: read() returns a reader, through which the
+   index current at that moment is used until the reader is destroyed.
+   swap() publishes a new index at once, then waits until every reader of the
+   old one has finished before releasing it; only the swapping thread waits.
+
+   Reclamation is epoch based, as in sleepable RCU: readers count themselves in
+   one of two counters, chosen by the parity of the epoch, and a swap advances
+   the epoch and waits for the counters of the old parity to drain. The counters
+   are striped by thread so that readers on different cores do not contend. */
+class FMIndexHandle
+{
+private:
+    static const size_t n_stripes = 64;
+
+    struct stripe
+    {
+        std::atomic<size_t> readers[2]; // By epoch parity.
+        char padding[64 - 2 * sizeof(std::atomic<size_t>)]; // Keep stripes on separate cache lines.
+    };
+
+    std::atomic<const FMIndex *> current;
+    std::atomic<size_t> epoch;
+    mutable stripe stripes[n_stripes];
+    std::mutex swap_mutex; // Serializes swaps; never taken by readers.
+    std::shared_ptr<const FMIndex> owner; // Keeps current alive.
+
+    static size_t thread_stripe(void);
+
+public:
+    class reader
+    {
+    private:
+        friend class FMIndexHandle;
+
+        std::atomic<size_t> * counter;
+        const FMIndex * fmi;
+
+        reader(std::atomic<size_t> * counter, const FMIndex * fmi) : counter(counter), fmi(fmi) { }
+
+    public:
+        reader(reader && other) : counter(other.counter), fmi(other.fmi) { other.counter = nullptr; }
+
+        reader(const reader &) = delete;
+
+        reader & operator=(const reader &) = delete;
+
+        ~reader(void) { if(counter != nullptr) counter->fetch_sub(1, std::memory_order_release); }
+
+        const FMIndex & operator*(void) const { return *fmi; }
+
+        const FMIndex * operator->(void) const { return fmi; }
+
+        const FMIndex * get(void) const { return fmi; }
+    };
+
+    explicit FMIndexHandle(const std::shared_ptr<const FMIndex> & fmi);
+
+    FMIndexHandle(const FMIndexHandle &) = delete;
+
+    FMIndexHandle & operator=(const FMIndexHandle &) = delete;
+
+    reader read(void) const;
+
+    /* Makes fmi the current index and returns once no reader can still be
+       using the previous one, whose reference is then dropped. So it must not
+       be called by a thread holding a reader. */
+    void swap(const std::shared_ptr<const FMIndex> & fmi);
+
+    /* Loads a serialized index on a new thread and swaps it in. The future
+       becomes ready (or holds the exception if loading fails, in which case
+       nothing is swapped) once the previous index has been released. */
+    std::future<void> swap_from_serialized_file(const std::string & filename);
+
+    size_t generation(void) const; // Number of swaps so far.
+};
+
+#endif /* defined(__FM_Index__FMIndexHandle__) */
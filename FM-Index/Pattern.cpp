@@ -0,0 +1,80 @@
+#include <stdexcept>
+#include <cctype>
+
+#include "Pattern.h"
+
+size_t Pattern::parse_number(const std::string & pattern, size_t & i)
+{
+    if(i >= pattern.size() || !isdigit(static_cast<unsigned char>(pattern[i])))
+        throw std::invalid_argument("Expected number in pattern repeat count");
+    size_t n = 0;
+    for(; i < pattern.size() && isdigit(static_cast<unsigned char>(pattern[i])); i++) n = 10 * n + (pattern[i] - '0');
+    return n;
+}
+
+Pattern::Pattern(const std::string & pattern, const bool case_insensitive)
+{
+    for(size_t i = 0; i < pattern.size(); )
+    {
+        Item item;
+        item.min_repeats = item.max_repeats = 1;
+        if(pattern[i] == '?')
+        {
+            item.chars.set();
+            i++;
+        }
+        else if(pattern[i] == '[')
+        {
+            bool negate = ++i < pattern.size() && pattern[i] == '^';
+            if(negate) i++;
+            for(bool first = true; i < pattern.size() && (pattern[i] != ']' || first); first = false)
+            {
+                if(pattern[i] == '\\') i++;
+                if(i >= pattern.size()) break;
+                unsigned char lo = pattern[i++], hi = lo;
+                if(i + 1 < pattern.size() && pattern[i] == '-' && pattern[i+1] != ']')
+                {
+                    i++;
+                    if(pattern[i] == '\\') i++;
+                    if(i >= pattern.size()) break;
+                    hi = pattern[i++];
+                    if(hi < lo) throw std::invalid_argument("Bad character range in pattern");
+                }
+                for(unsigned int c = lo; c <= hi; c++) item.chars.set(c);
+            }
+            if(i >= pattern.size()) throw std::invalid_argument("Unterminated character class in pattern");
+            i++; // Skip ']'
+            if(negate) item.chars.flip();
+        }
+        else if(pattern[i] == '{' || pattern[i] == '}' || pattern[i] == ']')
+            throw std::invalid_argument("Unexpected " + std::string(1, pattern[i]) + " in pattern");
+        else
+        {
+            if(pattern[i] == '\\' && ++i >= pattern.size()) throw std::invalid_argument("Pattern ends with \\");
+            item.chars.set(static_cast<unsigned char>(pattern[i++]));
+        }
+
+        if(i < pattern.size() && pattern[i] == '{')
+        {
+            item.min_repeats = item.max_repeats = parse_number(pattern, ++i);
+            if(i < pattern.size() && pattern[i] == ',') item.max_repeats = parse_number(pattern, ++i);
+            if(i >= pattern.size() || pattern[i] != '}') throw std::invalid_argument("Unterminated repeat count in pattern");
+            if(item.max_repeats < item.min_repeats) throw std::invalid_argument("Bad repeat count in pattern");
+            i++;
+        }
+
+        if(case_insensitive)
+            for(unsigned int c = 0; c < 256; c++)
+                if(item.chars[c] && isalpha(c))
+                {
+                    item.chars.set(static_cast<unsigned char>(tolower(c)));
+                    item.chars.set(static_cast<unsigned char>(toupper(c)));
+                }
+        if(item.max_repeats > 0) items.push_back(item);
+    }
+}
+
+const std::vector<Pattern::Item> & Pattern::get_items(void) const
+{
+    return items;
+}
@@ -0,0 +1,38 @@
+#ifndef __FM_Index__Pattern__
+#define __FM_Index__Pattern__
+
+#include <bitset>
+#include <string>
+#include <vector>
+
+/* A pattern made of a sequence of character classes, each possibly repeated.
+   Syntax:
+       c        the character c
+       ?        any character
+       [...]    any of the characters listed, which may include ranges such as
+                a-z; [^...] is any character not listed
+       {n}      the preceding item exactly n times
+       {n,m}    the preceding item between n and m times
+       \c       the character c even if it is one of ?[]{}\
+   If case_insensitive, letters match either case. */
+class Pattern
+{
+public:
+    struct Item
+    {
+        std::bitset<256> chars;
+        size_t min_repeats, max_repeats;
+    };
+
+private:
+    std::vector<Item> items;
+
+    static size_t parse_number(const std::string & pattern, size_t & i);
+
+public:
+    explicit Pattern(const std::string & pattern, const bool case_insensitive = false);
+
+    const std::vector<Item> & get_items(void) const;
+};
+
+#endif /* defined(__FM_Index__Pattern__) */
@@ -0,0 +1,156 @@
+#include <stdexcept>
+#include <system_error>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "QueryClient.h"
+
+namespace qp = query_protocol;
+
+size_t QueryClient::response::count(void) const
+{
+    throw_if_error();
+    const char * p = body.data();
+    return qp::get<uint64_t>(p, body.data() + body.size());
+}
+
+std::vector<size_t> QueryClient::response::positions(void) const
+{
+    throw_if_error();
+    const char * p = body.data(), * end = p + body.size();
+    std::vector<size_t> result(qp::get<uint64_t>(p, end));
+    for(auto & position : result) position = qp::get<uint64_t>(p, end);
+    return result;
+}
+
+std::list<std::string> QueryClient::response::lines(void) const
+{
+    throw_if_error();
+    const char * p = body.data(), * end = p + body.size();
+    std::list<std::string> result;
+    for(uint32_t n = qp::get<uint32_t>(p, end); n > 0; n--)
+    {
+        uint32_t length = qp::get<uint32_t>(p, end);
+        if(static_cast<size_t>(end - p) < length) throw std::runtime_error("Truncated query protocol frame");
+        result.push_back(std::string(p, length));
+        p += length;
+    }
+    return result;
+}
+
+void QueryClient::response::throw_if_error(void) const
+{
+    if(!ok) throw std::runtime_error("Query failed: " + body);
+}
+
+QueryClient::QueryClient(const std::string & socket_path)
+    : next_id(0)
+{
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(address.sun_path)) throw std::invalid_argument("Socket path too long: " + socket_path);
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) throw std::system_error(errno, std::generic_category(), "Cannot create socket");
+    if(connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "Cannot connect to " + socket_path);
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+QueryClient::~QueryClient(void)
+{
+    close(fd);
+}
+
+uint32_t QueryClient::send(const uint8_t op, const std::string & pattern, const char new_line_char, const uint32_t max_context)
+{
+    const size_t frame_start = pending.size();
+    const uint32_t id = next_id++;
+    qp::start_frame(pending, id, op);
+    if(op == qp::find_lines)
+    {
+        qp::put<char>(pending, new_line_char);
+        qp::put<uint32_t>(pending, max_context);
+    }
+    pending += pattern;
+    qp::finish_frame(pending, frame_start);
+    if(pending.size() >= (64 << 10)) flush();
+    return id;
+}
+
+void QueryClient::flush(void)
+{
+    qp::write_fully(fd, pending.data(), pending.size());
+    pending.clear();
+}
+
+QueryClient::response QueryClient::receive(void)
+{
+    if(!pending.empty()) flush();
+    if(!qp::read_frame(fd, frame)) throw std::runtime_error("Query server closed the connection");
+    const char * p = frame.data(), * end = p + frame.size();
+    response r;
+    r.id = qp::get<uint32_t>(p, end);
+    r.ok = qp::get<uint8_t>(p, end) == qp::ok;
+    r.body.assign(p, end);
+    return r;
+}
+
+QueryClient::response QueryClient::call(const uint8_t op, const std::string & pattern, const char new_line_char, const uint32_t max_context)
+{
+    uint32_t id = send(op, pattern, new_line_char, max_context);
+    response r = receive();
+    if(r.id != id) throw std::logic_error("QueryClient blocking call made with pipelined requests outstanding");
+    return r;
+}
+
+uint32_t QueryClient::send_findn(const std::string & pattern)
+{
+    return send(qp::findn, pattern);
+}
+
+uint32_t QueryClient::send_locate(const std::string & pattern)
+{
+    return send(qp::locate, pattern);
+}
+
+uint32_t QueryClient::send_find_lines(const std::string & pattern,
+                                      const char new_line_char,
+                                      const uint32_t max_context)
+{
+    return send(qp::find_lines, pattern, new_line_char, max_context);
+}
+
+size_t QueryClient::findn(const std::string & pattern)
+{
+    return call(qp::findn, pattern).count();
+}
+
+std::vector<size_t> QueryClient::locate(const std::string & pattern)
+{
+    return call(qp::locate, pattern).positions();
+}
+
+std::list<std::string> QueryClient::find_lines(const std::string & pattern,
+                                               const char new_line_char,
+                                               const uint32_t max_context)
+{
+    return call(qp::find_lines, pattern, new_line_char, max_context).lines();
+}
+
+std::string QueryClient::stats(void)
+{
+    response r = call(qp::stats, "");
+    r.throw_if_error();
+    return r.body;
+}
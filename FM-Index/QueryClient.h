@@ -0,0 +1,82 @@
+#ifndef __FM_Index__QueryClient__
+#define __FM_Index__QueryClient__
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "query_protocol.h"
+
+/* A connection to a QueryServer. The send_ methods queue a request and return
+   its id without waiting, so that many requests can be in flight at once;
+   receive then returns the responses as they arrive (in any order). The
+   blocking methods (findn etc.) send one request and wait for its response,
+   so should not be mixed with outstanding pipelined requests.
+
+   Keep the number in flight bounded (a few thousand, say) by receiving as
+   you go: the server stops reading requests from a client which is not
+   reading its responses.
+
+   One QueryClient should only be used by one thread at a time. */
+class QueryClient
+{
+public:
+    struct response
+    {
+        uint32_t id;
+        bool ok;
+        std::string body; // As in query_protocol.h; the error message if not ok.
+
+        size_t count(void) const; // For findn.
+
+        std::vector<size_t> positions(void) const; // For locate.
+
+        std::list<std::string> lines(void) const; // For find_lines.
+
+        void throw_if_error(void) const;
+    };
+
+private:
+    int fd;
+    uint32_t next_id;
+    std::string pending; // Requests not yet sent.
+    std::string frame;
+
+    uint32_t send(const uint8_t op, const std::string & pattern, const char new_line_char = 0, const uint32_t max_context = 0);
+
+    response call(const uint8_t op, const std::string & pattern, const char new_line_char = 0, const uint32_t max_context = 0);
+
+public:
+    explicit QueryClient(const std::string & socket_path);
+
+    ~QueryClient(void);
+
+    QueryClient(const QueryClient &) = delete;
+
+    QueryClient & operator=(const QueryClient &) = delete;
+
+    uint32_t send_findn(const std::string & pattern);
+
+    uint32_t send_locate(const std::string & pattern);
+
+    uint32_t send_find_lines(const std::string & pattern,
+                             const char new_line_char = '\n',
+                             const uint32_t max_context = 100);
+
+    void flush(void); // Sends the queued requests; receive does this first anyway.
+
+    response receive(void); // Waits for the next response.
+
+    size_t findn(const std::string & pattern);
+
+    std::vector<size_t> locate(const std::string & pattern);
+
+    std::list<std::string> find_lines(const std::string & pattern,
+                                      const char new_line_char = '\n',
+                                      const uint32_t max_context = 100);
+
+    std::string stats(void); // The server's report.
+};
+
+#endif /* defined(__FM_Index__QueryClient__) */
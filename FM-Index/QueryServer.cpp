@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "QueryServer.h"
+
+namespace qp = query_protocol;
+
+size_t QueryServer::op_statistics::latency_percentile_us(const double p) const
+{
+    size_t target = static_cast<size_t>(p / 100 * requests + 0.5), seen = 0;
+    for(size_t b = 0; b < n_latency_buckets; b++)
+    {
+        seen += latency_us[b];
+        if(seen >= target && seen > 0) return size_t(1) << (b + 1);
+    }
+    return 0;
+}
+
+QueryServer::connection::~connection(void)
+{
+    close(fd);
+}
+
+QueryServer::op_counters::op_counters(void)
+    : requests(0), errors(0), total_latency_us(0)
+{
+    for(auto & bucket : latency_us) bucket = 0;
+}
+
+void QueryServer::op_counters::record(const size_t latency, const bool error)
+{
+    size_t b = 63 - __builtin_clzll(latency | 1);
+    latency_us[std::min(b, n_latency_buckets - 1)]++;
+    total_latency_us += latency;
+    requests++;
+    if(error) errors++;
+}
+
+QueryServer::op_statistics QueryServer::op_counters::snapshot(void) const
+{
+    op_statistics s;
+    s.requests = requests;
+    s.errors = errors;
+    s.total_latency_us = total_latency_us;
+    for(size_t b = 0; b < n_latency_buckets; b++) s.latency_us[b] = latency_us[b];
+    return s;
+}
+
+QueryServer::QueryServer(const std::shared_ptr<const FMIndex> & fmi,
+                         const std::string & socket_path,
+                         const size_t n_workers,
+                         const size_t max_batch)
+    : QueryServer(std::make_shared<FMIndexHandle>(fmi), socket_path, n_workers, max_batch)
+{
+}
+
+QueryServer::QueryServer(const std::shared_ptr<FMIndexHandle> & handle,
+                         const std::string & socket_path,
+                         const size_t n_workers,
+                         const size_t max_batch)
+    : handle(handle),
+      socket_path(socket_path),
+      max_batch(std::max<size_t>(max_batch, 1)),
+      max_queued(64 * std::max<size_t>(max_batch, 1)),
+      listen_fd(-1),
+      started(std::chrono::steady_clock::now()),
+      stopping(false),
+      n_readers(0),
+      n_connections(0),
+      n_batches(0),
+      n_batched_requests(0)
+{
+    if(!handle) throw std::invalid_argument("Cannot serve null FMIndexHandle");
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(address.sun_path)) throw std::invalid_argument("Socket path too long: " + socket_path);
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+
+    // Replace the socket of a previous server, but nothing else.
+    struct stat st;
+    if(lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0) throw std::system_error(errno, std::generic_category(), "Cannot create socket");
+    if(bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listen_fd, 128) != 0 || pipe(stop_pipe) != 0)
+    {
+        int err = errno;
+        close(listen_fd);
+        throw std::system_error(err, std::generic_category(), "Cannot listen on " + socket_path);
+    }
+
+    size_t n = n_workers > 0 ? n_workers : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for(size_t i = 0; i < n; i++) workers.push_back(std::thread(&QueryServer::work_loop, this));
+    acceptor = std::thread(&QueryServer::accept_loop, this);
+}
+
+QueryServer::~QueryServer(void)
+{
+    stop();
+}
+
+void QueryServer::stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_not_empty.notify_all();
+    queue_not_full.notify_all();
+    if(!acceptor.joinable()) return; // Already stopped.
+
+    if(write(stop_pipe[1], "x", 1) != 1) shutdown(listen_fd, SHUT_RDWR);
+    acceptor.join();
+    {
+        // Wake the connection threads from their reads.
+        std::unique_lock<std::mutex> lock(connections_mutex);
+        for(auto & weak_conn : connections)
+            if(std::shared_ptr<connection> conn = weak_conn.lock()) shutdown(conn->fd, SHUT_RDWR);
+        readers_done.wait(lock, [this]() { return n_readers == 0; });
+    }
+    for(auto & worker : workers) worker.join();
+    queue.clear();
+    close(listen_fd);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    unlink(socket_path.c_str());
+}
+
+void QueryServer::accept_loop(void)
+{
+    pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+    for(;;)
+    {
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            return;
+        }
+        if(fds[1].revents != 0) return;
+        if(fds[0].revents == 0) continue;
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if(fd < 0) continue;
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        std::shared_ptr<connection> conn = std::make_shared<connection>(fd);
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                             [](const std::weak_ptr<connection> & c) { return c.expired(); }),
+                              connections.end());
+            connections.push_back(conn);
+            n_readers++;
+        }
+        n_connections++;
+        std::thread(&QueryServer::read_loop, this, conn).detach();
+    }
+}
+
+void QueryServer::read_loop(std::shared_ptr<connection> conn)
+{
+    try
+    {
+        request r;
+        while(qp::read_frame(conn->fd, r.frame))
+        {
+            r.conn = conn;
+            r.received = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_not_full.wait(lock, [this]() { return queue.size() < max_queued || stopping; });
+            if(stopping) break;
+            queue.push_back(std::move(r));
+            lock.unlock();
+            queue_not_empty.notify_one();
+            r = request();
+        }
+    }
+    catch(const std::exception &)
+    {
+        // A malformed frame or a broken connection: drop the connection once its queued requests are answered.
+    }
+    conn.reset();
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    n_readers--;
+    readers_done.notify_all();
+}
+
+void QueryServer::work_loop(void)
+{
+    std::vector<request> batch;
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_not_empty.wait(lock, [this]() { return !queue.empty() || stopping; });
+            if(stopping) return;
+            size_t n = std::min(max_batch, queue.size());
+            std::move(queue.begin(), queue.begin() + n, std::back_inserter(batch));
+            queue.erase(queue.begin(), queue.begin() + n);
+        }
+        queue_not_full.notify_all();
+        n_batches++;
+        n_batched_requests += batch.size();
+        answer(batch);
+        batch.clear();
+    }
+}
+
+QueryServer::op_counters * QueryServer::counters(const uint8_t op)
+{
+    switch(op)
+    {
+        case qp::findn: return &findn_counters;
+        case qp::locate: return &locate_counters;
+        case qp::find_lines: return &find_lines_counters;
+        default: return nullptr;
+    }
+}
+
+void QueryServer::answer(std::vector<request> & batch)
+{
+    // Responses to each connection, in the order of their requests.
+    std::unordered_map<connection *, std::string> responses;
+    std::vector<bool> errors(batch.size());
+    {
+        // Only hold the index while answering, not while sending, so that a slow client cannot hold up a swap.
+        FMIndexHandle::reader fmi = handle->read();
+
+        // Count all the findn patterns of the batch in one go.
+        std::vector<const char *> patterns;
+        std::vector<size_t> lengths, counts;
+        for(auto & r : batch)
+            if(static_cast<uint8_t>(r.frame[4]) == qp::findn && r.frame.size() > 5)
+            {
+                patterns.push_back(r.frame.data() + 5);
+                lengths.push_back(r.frame.size() - 5);
+            }
+        counts.resize(patterns.size());
+        if(!patterns.empty()) fmi->findn_batch(patterns.data(), lengths.data(), patterns.size(), counts.data());
+
+        std::vector<size_t>::const_iterator count = counts.begin();
+        for(size_t i = 0; i < batch.size(); i++)
+        {
+            const request & r = batch[i];
+            std::string & out = responses[r.conn.get()];
+            const size_t frame_start = out.size();
+            uint32_t id;
+            std::memcpy(&id, r.frame.data(), sizeof(id));
+            if(static_cast<uint8_t>(r.frame[4]) == qp::findn && r.frame.size() > 5)
+            {
+                qp::start_frame(out, id, qp::ok);
+                qp::put<uint64_t>(out, *count++);
+                qp::finish_frame(out, frame_start);
+            }
+            else answer_one(*fmi, r, out);
+            errors[i] = static_cast<uint8_t>(out[frame_start + 8]) != qp::ok;
+        }
+    }
+
+    // Record before sending, so that a client sees its requests in the statistics once it has their responses.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < batch.size(); i++)
+        if(op_counters * c = counters(static_cast<uint8_t>(batch[i].frame[4])))
+            c->record(std::chrono::duration_cast<std::chrono::microseconds>(now - batch[i].received).count(), errors[i]);
+
+    for(auto & response : responses)
+    {
+        std::lock_guard<std::mutex> lock(response.first->write_mutex);
+        try
+        {
+            qp::write_fully(response.first->fd, response.second.data(), response.second.size());
+        }
+        catch(const std::exception &)
+        {
+            // The client has gone; its connection thread will notice.
+        }
+    }
+}
+
+void QueryServer::answer_one(const FMIndex & fmi, const request & r, std::string & out) const
+{
+    const size_t frame_start = out.size();
+    const char * p = r.frame.data(), * end = p + r.frame.size();
+    const uint32_t id = qp::get<uint32_t>(p, end);
+    try
+    {
+        const uint8_t op = qp::get<uint8_t>(p, end);
+        qp::start_frame(out, id, qp::ok);
+        if(op == qp::findn || op == qp::locate)
+        {
+            // findn only gets here with an empty pattern, which the index rejects.
+            const std::string pattern(p, end);
+            if(op == qp::findn) qp::put<uint64_t>(out, fmi.findn(pattern));
+            else
+            {
+                std::vector<size_t> positions = fmi.locate(pattern);
+                std::sort(positions.begin(), positions.end());
+                qp::put<uint64_t>(out, positions.size());
+                for(size_t position : positions) qp::put<uint64_t>(out, position);
+            }
+        }
+        else if(op == qp::find_lines)
+        {
+            const char new_line_char = qp::get<char>(p, end);
+            const uint32_t max_context = qp::get<uint32_t>(p, end);
+            std::list<std::string> lines = fmi.find_lines(std::string(p, end), new_line_char, max_context);
+            qp::put<uint32_t>(out, lines.size());
+            for(auto & line : lines)
+            {
+                qp::put<uint32_t>(out, line.size());
+                out += line;
+            }
+        }
+        else if(op == qp::stats) out += report();
+        else throw std::invalid_argument("Unknown query op");
+        if(out.size() - frame_start > qp::max_frame_size) throw std::length_error("Response too large");
+    }
+    catch(const std::exception & e)
+    {
+        out.resize(frame_start);
+        qp::start_frame(out, id, qp::error);
+        out += e.what();
+    }
+    qp::finish_frame(out, frame_start);
+}
+
+FMIndexHandle & QueryServer::index(void)
+{
+    return *handle;
+}
+
+QueryServer::statistics QueryServer::stats(void) const
+{
+    statistics s;
+    s.connections = n_connections;
+    s.batches = n_batches;
+    s.batched_requests = n_batched_requests;
+    s.findn = findn_counters.snapshot();
+    s.locate = locate_counters.snapshot();
+    s.find_lines = find_lines_counters.snapshot();
+    s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return s;
+}
+
+std::string QueryServer::report(void) const
+{
+    statistics s = stats();
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1)
+        << "uptime " << s.seconds << " s, " << s.connections << " connections, "
+        << s.batches << " batches (mean " << (s.batches == 0 ? 0.0 : double(s.batched_requests) / s.batches) << " requests)\n";
+    const std::pair<const char *, const op_statistics *> ops[] = {{"findn", &s.findn}, {"locate", &s.locate}, {"find_lines", &s.find_lines}};
+    for(auto & op : ops)
+    {
+        const op_statistics & o = *op.second;
+        out << op.first << ": " << o.requests << " requests (" << (s.seconds > 0 ? o.requests / s.seconds : 0.0) << "/s), "
+            << o.errors << " errors, latency p50 < " << o.latency_percentile_us(50)
+            << " us, p99 < " << o.latency_percentile_us(99)
+            << " us, mean " << (o.requests == 0 ? 0.0 : double(o.total_latency_us) / o.requests) << " us\n";
+    }
+    return out.str();
+}
@@ -0,0 +1,142 @@
+#ifndef __FM_Index__QueryServer__
+#define __FM_Index__QueryServer__
+
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FMIndex.h"
+#include "FMIndexHandle.h"
+#include "query_protocol.h"
+
+/* Serves findn, locate and find_lines queries against one FMIndex to many
+   clients over a Unix domain socket, using the protocol of query_protocol.h.
+
+   Each connection has a thread which reads its requests (clients may pipeline
+   as many as they like) onto one queue. Worker threads take up to max_batch
+   requests off the queue at a time, so that concurrent requests are coalesced:
+   all the findn requests of a batch are answered by one findn_batch call, and
+   all the responses of a batch to one connection are sent in one write.
+
+   The index is held by an FMIndexHandle, so may be replaced while serving:
+   each batch is answered from the index current when it started.
+
+   Latency (from reading a request to its response being ready to send) is recorded in
+   histograms per op, reported by stats() and by the stats request. */
+class QueryServer
+{
+public:
+    static const size_t n_latency_buckets = 32; // Bucket b counts latencies in [2^b, 2^(b+1)) microseconds (b = 0 from 0).
+
+    struct op_statistics
+    {
+        size_t requests, errors;
+        size_t latency_us[n_latency_buckets];
+        size_t total_latency_us;
+
+        size_t latency_percentile_us(const double p) const; // Upper end of the bucket containing the p-th percentile.
+    };
+
+    struct statistics
+    {
+        size_t connections, batches, batched_requests;
+        op_statistics findn, locate, find_lines;
+        double seconds; // Since the server started.
+    };
+
+private:
+    struct connection
+    {
+        int fd;
+        std::mutex write_mutex;
+
+        explicit connection(const int fd) : fd(fd) { }
+
+        ~connection(void);
+    };
+
+    struct request
+    {
+        std::shared_ptr<connection> conn;
+        std::string frame; // Without its size.
+        std::chrono::steady_clock::time_point received;
+    };
+
+    struct op_counters
+    {
+        std::atomic<size_t> requests, errors, total_latency_us;
+        std::atomic<size_t> latency_us[n_latency_buckets];
+
+        op_counters(void);
+
+        void record(const size_t latency, const bool error);
+
+        op_statistics snapshot(void) const;
+    };
+
+    std::shared_ptr<FMIndexHandle> handle;
+    const std::string socket_path;
+    const size_t max_batch, max_queued;
+    int listen_fd, stop_pipe[2];
+    std::chrono::steady_clock::time_point started;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_not_empty, queue_not_full;
+    std::deque<request> queue;
+    bool stopping;
+
+    std::mutex connections_mutex;
+    std::vector<std::weak_ptr<connection>> connections;
+    std::condition_variable readers_done;
+    size_t n_readers; // Connection threads, which are detached: stop waits for this to reach zero.
+    std::vector<std::thread> workers;
+    std::thread acceptor;
+
+    std::atomic<size_t> n_connections, n_batches, n_batched_requests;
+    op_counters findn_counters, locate_counters, find_lines_counters;
+
+    void accept_loop(void);
+
+    void read_loop(std::shared_ptr<connection> conn);
+
+    void work_loop(void);
+
+    void answer(std::vector<request> & batch);
+
+    void answer_one(const FMIndex & fmi, const request & r, std::string & out) const;
+
+    op_counters * counters(const uint8_t op);
+
+public:
+    QueryServer(const std::shared_ptr<const FMIndex> & fmi,
+                const std::string & socket_path,
+                const size_t n_workers = 0, // Zero means one per hardware thread.
+                const size_t max_batch = 256);
+
+    QueryServer(const std::shared_ptr<FMIndexHandle> & handle,
+                const std::string & socket_path,
+                const size_t n_workers = 0,
+                const size_t max_batch = 256);
+
+    ~QueryServer(void); // Stops the server.
+
+    QueryServer(const QueryServer &) = delete;
+
+    QueryServer & operator=(const QueryServer &) = delete;
+
+    FMIndexHandle & index(void); // For swapping in a new index.
+
+    void stop(void); // Closes the socket and all connections and waits for the threads.
+
+    statistics stats(void) const;
+
+    std::string report(void) const; // Throughput and latency percentiles, a few lines of text.
+};
+
+#endif /* defined(__FM_Index__QueryServer__) */
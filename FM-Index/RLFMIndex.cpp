@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <cstdint>
+
+#include "RLFMIndex.h"
+#include "openbwt.h"
+#include "serializing.h"
+
+namespace
+{
+    const char serial_magic[8] = {'R', 'L', 'F', 'M', 'I', 'n', 'd', 'x'};
+    const size_t serial_version = 1;
+}
+
+RLFMIndex::RLFMIndex(const std::string & s)
+{
+    const size_t n = s.size();
+    if(n == 0) throw std::length_error("Cannot construct zero-length RLFMIndex");
+    if(n > static_cast<size_t>(std::numeric_limits<int>::max())) throw std::length_error("Text too long for BWT");
+
+    // Row i of the BWT is s_BWT[i] or, in row end_idx (the text itself), no character, as in FMIndex.
+    std::string s_BWT(s);
+    int idx = BWT((const unsigned char *) s_BWT.c_str(), (unsigned char *) &s_BWT[0], (int) n); // C-style casts for C-function BWT.
+    if(idx < 0) throw std::bad_alloc();
+    const size_t end_idx = idx;
+    auto code = [&s_BWT, end_idx](const size_t row) -> size_t
+    {
+        return row == end_idx ? 0 : 1 + static_cast<unsigned char>(s_BWT[row > end_idx ? row - 1 : row]);
+    };
+
+    C.assign(n_codes + 1, 0);
+    std::vector<size_t> run_heads, starts;
+    for(size_t row = 0; row <= n; row++)
+    {
+        size_t k = code(row);
+        C[k + 1]++;
+        if(row == 0 || k != run_heads.back())
+        {
+            run_heads.push_back(k);
+            starts.push_back(row);
+        }
+    }
+    const size_t r = run_heads.size();
+    runs_before.assign(n_codes + 1, 0);
+    for(size_t k : run_heads) runs_before[k + 1]++;
+    for(size_t k = 1; k <= n_codes; k++)
+    {
+        C[k] += C[k-1];
+        runs_before[k] += runs_before[k-1];
+    }
+
+    // LF maps the runs of each head, in order, to consecutive rows from C[head].
+    std::vector<size_t> mapped_index(r), mapped(r);
+    std::vector<size_t> next_index(runs_before), next_row(C);
+    for(size_t j = 0; j < r; j++)
+    {
+        size_t k = run_heads[j];
+        mapped_index[j] = next_index[k]++;
+        mapped[mapped_index[j]] = next_row[k];
+        next_row[k] += (j + 1 < r ? starts[j+1] : n + 1) - starts[j];
+    }
+
+    /* Walk the whole text backwards from the empty suffix (row 0), as FMIndex::sample_SA,
+       to find the suffix array values at the run boundaries, with LF over the plain BWT:
+       faster than over the runs, and only needed while building. */
+    std::vector<uint32_t> LF(n + 1);
+    std::vector<size_t> occ(C.begin(), C.end() - 1);
+    for(size_t row = 0; row <= n; row++) LF[row] = static_cast<uint32_t>(occ[code(row)]++);
+    std::vector<std::pair<size_t, size_t>> start_samples, end_samples; // (row, SA value)
+    size_t row = 0;
+    for(size_t pos = n; ; pos--)
+    {
+        if(row == 0 || code(row) != code(row - 1)) start_samples.push_back(std::make_pair(row, pos));
+        if(row == n || code(row) != code(row + 1)) end_samples.push_back(std::make_pair(row, pos));
+        if(pos == 0) break;
+        row = LF[row];
+    }
+    std::vector<uint32_t>().swap(LF);
+    std::sort(start_samples.begin(), start_samples.end());
+    std::sort(end_samples.begin(), end_samples.end());
+
+    SA_run_ends.resize(r);
+    std::vector<std::pair<size_t, size_t>> phi_samples; // (SA value of the first row of a run, that of the row before)
+    for(size_t j = 0; j < r; j++)
+    {
+        SA_run_ends[mapped_index[j]] = end_samples[j].second;
+        if(j > 0) phi_samples.push_back(std::make_pair(start_samples[j].second, end_samples[j-1].second));
+    }
+    std::sort(phi_samples.begin(), phi_samples.end());
+    std::vector<size_t> points;
+    for(auto & sample : phi_samples)
+    {
+        points.push_back(sample.first);
+        phi_values.push_back(sample.second);
+    }
+
+    heads = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(run_heads));
+    run_starts = std::unique_ptr<SparseBitVector>(new SparseBitVector(starts, n + 1));
+    mapped_run_starts = std::unique_ptr<SparseBitVector>(new SparseBitVector(mapped, n + 1));
+    phi_points = std::unique_ptr<SparseBitVector>(new SparseBitVector(points, n + 1));
+}
+
+size_t RLFMIndex::rank_before_row(const size_t i, const size_t k) const
+{
+    /* Number of rows of code k before row i: those of the runs of k before the run
+       of row i-1, which is where LF maps the first run of k after them, and those
+       of the run of row i-1 if it is one of k. */
+    if(i == 0) return 0;
+    size_t j = run_starts->rank1(i - 1) - 1;
+    size_t k_runs = runs_before[k] + (j == 0 ? 0 : heads->rank(j - 1, k));
+    size_t rk = (k_runs == runs_before[k + 1] ? C[k + 1] : mapped_run_starts->select1(k_runs)) - C[k];
+    if(heads->select(j) == k) rk += i - run_starts->select1(j);
+    return rk;
+}
+
+bool RLFMIndex::backward_search(const char * pattern,
+                                const size_t length,
+                                size_t & lb,
+                                size_t & ub,
+                                size_t * SA_last) const
+{
+    /* Rows [lb, ub) are prefixed by the part of the pattern searched so far and,
+       if SA_last is not null, *SA_last is the suffix array value of row ub-1. */
+    lb = 0;
+    ub = C.back();
+    if(SA_last != nullptr) *SA_last = SA_run_ends[runs_before[heads->select(n_runs() - 1) + 1] - 1];
+    for(size_t i = length; i > 0; i--)
+    {
+        size_t k = 1 + static_cast<unsigned char>(pattern[i-1]);
+        if(SA_last != nullptr)
+        {
+            // The new last row is LF of the last row of code k: ub-1 itself or the end of the run of k before it.
+            size_t j = run_starts->rank1(ub - 1) - 1;
+            if(heads->select(j) == k) (*SA_last)--;
+            else
+            {
+                size_t k_runs = j == 0 ? 0 : heads->rank(j - 1, k);
+                if(k_runs > 0) *SA_last = SA_run_ends[runs_before[k] + k_runs - 1] - 1;
+            }
+        }
+        lb = C[k] + rank_before_row(lb, k);
+        ub = C[k] + rank_before_row(ub, k);
+        if(ub <= lb) return false;
+    }
+    return true;
+}
+
+size_t RLFMIndex::phi(const size_t pos) const
+{
+    /* If the row of pos is not the first of its run, nor is that of pos-1 and
+       the rows before them are those of pos-1 and pos-2, and so on back to the
+       greatest sampled value (which is at most pos since 0 is one). */
+    size_t p = phi_points->rank1(pos) - 1;
+    return phi_values[p] + (pos - phi_points->select1(p));
+}
+
+size_t RLFMIndex::size(void) const
+{
+    return C.back() - 1;
+}
+
+size_t RLFMIndex::n_runs(void) const
+{
+    return heads->size();
+}
+
+std::pair<size_t, size_t> RLFMIndex::find_interval(const std::string & pattern) const
+{
+    if(pattern.empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    size_t lb, ub;
+    if(!backward_search(pattern.data(), pattern.size(), lb, ub, nullptr)) return std::make_pair(1, 0);
+    return std::make_pair(lb, ub);
+}
+
+size_t RLFMIndex::findn(const std::string & pattern) const
+{
+    std::pair<size_t, size_t> interval = find_interval(pattern);
+    return interval.second <= interval.first ? 0 : interval.second - interval.first;
+}
+
+std::vector<size_t> RLFMIndex::locate(const std::string & pattern) const
+{
+    if(pattern.empty()) throw std::length_error("Cannot search for zero-length pattern");
+
+    size_t lb, ub, pos;
+    std::vector<size_t> positions;
+    if(!backward_search(pattern.data(), pattern.size(), lb, ub, &pos)) return positions;
+    positions.resize(ub - lb);
+    for(size_t row = ub; row-- > lb; )
+    {
+        positions[row - lb] = pos;
+        if(row > lb) pos = phi(pos);
+    }
+    return positions;
+}
+
+RLFMIndex::RLFMIndex(std::istreambuf_iterator<char> serial_data)
+{
+    char magic[sizeof(serial_magic)];
+    deserialize_from_chars(serial_data, magic);
+    if(!std::equal(magic, magic + sizeof(magic), serial_magic))
+        throw std::runtime_error("Not a serialized RLFMIndex, or one from before format versions: rebuild it");
+    size_t version;
+    deserialize_from_chars(serial_data, version);
+    if(version != serial_version)
+        throw std::runtime_error("Serialized RLFMIndex has format version " + std::to_string(version) +
+                                 " but only version " + std::to_string(serial_version) + " can be read");
+
+    C.resize(n_codes + 1);
+    for(size_t k = 0; k <= n_codes; k++)
+        deserialize_from_chars(serial_data, C[k]);
+    runs_before.resize(n_codes + 1);
+    for(size_t k = 0; k <= n_codes; k++)
+        deserialize_from_chars(serial_data, runs_before[k]);
+    heads = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(serial_data));
+    run_starts = std::unique_ptr<SparseBitVector>(new SparseBitVector(serial_data));
+    mapped_run_starts = std::unique_ptr<SparseBitVector>(new SparseBitVector(serial_data));
+    SA_run_ends.resize(heads->size());
+    for(size_t j = 0; j < SA_run_ends.size(); j++)
+        deserialize_from_chars(serial_data, SA_run_ends[j]);
+    phi_points = std::unique_ptr<SparseBitVector>(new SparseBitVector(serial_data));
+    phi_values.resize(phi_points->ones());
+    for(size_t j = 0; j < phi_values.size(); j++)
+        deserialize_from_chars(serial_data, phi_values[j]);
+}
+
+void RLFMIndex::serialize(std::ostreambuf_iterator<char> serial_data) const
+{
+    serialize_as_chars(serial_data, serial_magic);
+    serialize_as_chars(serial_data, serial_version);
+    for(size_t k = 0; k <= n_codes; k++)
+        serialize_as_chars(serial_data, C[k]);
+    for(size_t k = 0; k <= n_codes; k++)
+        serialize_as_chars(serial_data, runs_before[k]);
+    heads->serialize(serial_data);
+    run_starts->serialize(serial_data);
+    mapped_run_starts->serialize(serial_data);
+    for(size_t j = 0; j < SA_run_ends.size(); j++)
+        serialize_as_chars(serial_data, SA_run_ends[j]);
+    phi_points->serialize(serial_data);
+    for(size_t j = 0; j < phi_values.size(); j++)
+        serialize_as_chars(serial_data, phi_values[j]);
+}
+
+void RLFMIndex::serialize_to_file(const std::string & filename) const
+{
+    std::ofstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
+    serialize(std::ostreambuf_iterator<char>{f});
+}
+
+RLFMIndex * RLFMIndex::new_from_serialized_file(const std::string & filename)
+{
+    std::ifstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
+    return new RLFMIndex{std::istreambuf_iterator<char>{f}};
+}
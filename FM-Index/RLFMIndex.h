@@ -0,0 +1,71 @@
+#ifndef __FM_Index__RLFMIndex__
+#define __FM_Index__RLFMIndex__
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <iterator>
+
+#include "SparseBitVector.h"
+#include "WaveletMatrix.h"
+
+/* An FM index of a highly repetitive text (e.g., many versions of the same
+   documents) in space proportional to the number r of runs of equal symbols
+   in its BWT rather than to its length: the r-index of Gagie, Navarro & Prezza.
+
+   The BWT is kept as its runs: their heads in a WaveletMatrix (0 for the row
+   of the text itself, 1 + c for byte c) and their boundaries, and where LF
+   maps them, in sparse bit vectors. The suffix array is only sampled at the
+   ends and starts of the runs: a search keeps the suffix array value of the
+   last row of its interval, from which those of the rows before follow by
+   phi (from the value of a row to that of the row before).
+
+   Only counting and locating are supported. */
+class RLFMIndex
+{
+private:
+    static const size_t n_codes = 257;
+
+    std::vector<size_t> C; // C[k] is the number of rows with code < k.
+    std::vector<size_t> runs_before; // runs_before[k] is the number of runs with head < k.
+    std::unique_ptr<WaveletMatrix> heads; // Code of each run, in order of row.
+    std::unique_ptr<SparseBitVector> run_starts; // First row of each run.
+    std::unique_ptr<SparseBitVector> mapped_run_starts; // LF of the first row of each run, in order of (head, row).
+    std::vector<size_t> SA_run_ends; // Suffix array value of the last row of each run, in the same order.
+    std::unique_ptr<SparseBitVector> phi_points; // Suffix array values of the first rows of the runs but the first.
+    std::vector<size_t> phi_values; // Suffix array value of the row before each, in the same order.
+
+    size_t rank_before_row(const size_t i, const size_t k) const;
+
+    bool backward_search(const char * pattern,
+                         const size_t length,
+                         size_t & lb,
+                         size_t & ub,
+                         size_t * SA_last) const;
+
+    size_t phi(const size_t pos) const;
+
+public:
+    RLFMIndex(const std::string & s);
+
+    RLFMIndex(std::istreambuf_iterator<char> serial_data);
+
+    size_t size(void) const;
+
+    size_t n_runs(void) const; // r
+
+    // Rows [lb, ub) of the suffix array prefixed by the pattern (ub <= lb if none), as FMIndex::find_interval.
+    std::pair<size_t, size_t> find_interval(const std::string & pattern) const;
+
+    size_t findn(const std::string & pattern) const;
+
+    std::vector<size_t> locate(const std::string & pattern) const; // Text positions of all matches, in order of row.
+
+    void serialize(std::ostreambuf_iterator<char> serial_data) const;
+
+    void serialize_to_file(const std::string & filename) const;
+
+    static RLFMIndex * new_from_serialized_file(const std::string & filename);
+};
+
+#endif /* defined(__FM_Index__RLFMIndex__) */
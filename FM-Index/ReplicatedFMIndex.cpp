@@ -0,0 +1,76 @@
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <exception>
+
+#include "ReplicatedFMIndex.h"
+
+ReplicatedFMIndex::ReplicatedFMIndex(const FMIndex & fmi,
+                                     const SystemStorageAllocator::huge_pages_t huge_pages)
+    : nodes(numa_nodes())
+{
+    std::ostringstream out;
+    fmi.serialize(std::ostreambuf_iterator<char>{out});
+    const std::string serial_data = out.str();
+
+    // One node at a time, so that only one copy is being built (and only one thread is faulting in pages) at once.
+    replicas.resize(nodes.size());
+    for(size_t i = 0; i < nodes.size(); i++)
+    {
+        allocators.push_back(std::make_shared<SystemStorageAllocator>(
+            SystemStorageAllocator::policy(huge_pages, SystemStorageAllocator::bind_to_node, nodes[i])));
+        std::exception_ptr error;
+        std::thread builder([&]()
+        {
+            try
+            {
+                bind_current_thread_to_numa_node(nodes[i]);
+                StorageAllocator::thread_scope scope(allocators[i]);
+                std::istringstream in(serial_data);
+                replicas[i] = std::make_shared<const FMIndex>(std::istreambuf_iterator<char>{in});
+            }
+            catch(...)
+            {
+                error = std::current_exception();
+            }
+        });
+        builder.join();
+        if(error) std::rethrow_exception(error);
+    }
+}
+
+size_t ReplicatedFMIndex::n_replicas(void) const
+{
+    return replicas.size();
+}
+
+int ReplicatedFMIndex::node(const size_t i) const
+{
+    return nodes.at(i);
+}
+
+const FMIndex & ReplicatedFMIndex::replica(const size_t i) const
+{
+    return *replicas.at(i);
+}
+
+const FMIndex & ReplicatedFMIndex::local(void) const
+{
+    int here = current_numa_node();
+    for(size_t i = 0; i < nodes.size(); i++)
+        if(nodes[i] == here) return *replicas[i];
+    return *replicas[0];
+}
+
+bool ReplicatedFMIndex::bind_thread(const int node)
+{
+    return bind_current_thread_to_numa_node(node);
+}
+
+std::string ReplicatedFMIndex::report(void) const
+{
+    std::ostringstream out;
+    for(size_t i = 0; i < nodes.size(); i++)
+        out << "node " << nodes[i] << ": " << allocators[i]->report() << "\n";
+    return out.str();
+}
@@ -0,0 +1,43 @@
+#ifndef __FM_Index__ReplicatedFMIndex__
+#define __FM_Index__ReplicatedFMIndex__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FMIndex.h"
+#include "StorageAllocator.h"
+
+/* One copy of an FMIndex per NUMA node, so that query threads read only
+   memory local to them. Each copy is deserialized on a thread bound to its
+   node, with its BitVectors bound there by a SystemStorageAllocator (and
+   everything else placed there by first touch).
+
+   Query threads should call bind_thread(node(i)) once and then use local(),
+   which returns the copy for the node the calling thread is running on. On a
+   machine with one node there is just one copy. */
+class ReplicatedFMIndex
+{
+private:
+    std::vector<int> nodes;
+    std::vector<std::shared_ptr<const FMIndex>> replicas;
+    std::vector<std::shared_ptr<SystemStorageAllocator>> allocators;
+
+public:
+    ReplicatedFMIndex(const FMIndex & fmi,
+                      const SystemStorageAllocator::huge_pages_t huge_pages = SystemStorageAllocator::no_huge_pages);
+
+    size_t n_replicas(void) const;
+
+    int node(const size_t i) const;
+
+    const FMIndex & replica(const size_t i) const;
+
+    const FMIndex & local(void) const; // The first copy if the calling thread's node has none.
+
+    static bool bind_thread(const int node); // As bind_current_thread_to_numa_node.
+
+    std::string report(void) const; // Allocation report of each copy, one per line.
+};
+
+#endif /* defined(__FM_Index__ReplicatedFMIndex__) */
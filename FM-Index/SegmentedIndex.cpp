@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+#include "SegmentedIndex.h"
+
+SegmentedIndex::SegmentedIndex(const char separator,
+                               const size_t fanout,
+                               const size_t min_segment_size,
+                               const size_t SA_sample_rate)
+    : segments(std::make_shared<const segment_list>()),
+      separator(separator),
+      fanout(fanout),
+      min_segment_size(min_segment_size),
+      SA_sample_rate(SA_sample_rate)
+{
+    if(fanout < 2) throw std::invalid_argument("SegmentedIndex fanout must be at least 2");
+}
+
+size_t SegmentedIndex::tier(const size_t segment_size) const
+{
+    size_t t = 0;
+    for(size_t tier_size = min_segment_size * fanout; segment_size >= tier_size; tier_size *= fanout) t++;
+    return t;
+}
+
+void SegmentedIndex::replace_segments(const segment_list & old_segments,
+                                      const std::shared_ptr<const FMIndex> & new_segment)
+{
+    /* Segments appended since old_segments were chosen are kept, and new_segment
+       takes the place of old_segments, which are consecutive, to keep the text
+       order. */
+    std::lock_guard<std::mutex> lock(update_mutex);
+    std::shared_ptr<const segment_list> current = std::atomic_load(&segments);
+    std::shared_ptr<segment_list> updated = std::make_shared<segment_list>();
+    bool inserted = false;
+    for(auto & segment : *current)
+    {
+        if(std::find(old_segments.begin(), old_segments.end(), segment) == old_segments.end())
+            updated->push_back(segment);
+        else if(!inserted)
+        {
+            updated->push_back(new_segment);
+            inserted = true;
+        }
+    }
+    if(!inserted) updated->push_back(new_segment);
+    std::atomic_store(&segments, std::shared_ptr<const segment_list>(updated));
+}
+
+void SegmentedIndex::append(const std::string & s)
+{
+    // Build outside the lock: this is the slow part.
+    std::shared_ptr<const FMIndex> segment = std::make_shared<const FMIndex>(s + separator, SA_sample_rate);
+    replace_segments(segment_list(), segment);
+}
+
+bool SegmentedIndex::compact(void)
+{
+    std::lock_guard<std::mutex> lock(compaction_mutex);
+    std::shared_ptr<const segment_list> current = snapshot();
+
+    /* Merge the first fanout segments of the first run of at least that many
+       consecutive segments of one tier, taking the lowest such tier. Only
+       neighbours are merged so that the segments stay in text order. */
+    const segment_list & all = *current;
+    size_t best_tier = 0, best_begin = all.size();
+    for(size_t begin = 0, end; begin < all.size(); begin = end)
+    {
+        const size_t t = tier(all[begin]->size());
+        for(end = begin + 1; end < all.size() && tier(all[end]->size()) == t; end++);
+        if(end - begin >= fanout && (best_begin == all.size() || t < best_tier))
+        {
+            best_tier = t;
+            best_begin = begin;
+        }
+    }
+    if(best_begin == all.size()) return false;
+    segment_list to_merge(all.begin() + best_begin, all.begin() + best_begin + fanout);
+
+    std::vector<const FMIndex *> fmis;
+    for(auto & segment : to_merge) fmis.push_back(segment.get());
+    replace_segments(to_merge, std::shared_ptr<const FMIndex>(FMIndex::merge(fmis)));
+    return true;
+}
+
+std::shared_ptr<const SegmentedIndex::segment_list> SegmentedIndex::snapshot(void) const
+{
+    return std::atomic_load(&segments);
+}
+
+size_t SegmentedIndex::n_segments(void) const
+{
+    return snapshot()->size();
+}
+
+size_t SegmentedIndex::size(void) const
+{
+    // Hold the snapshot: the list in a temporary would be freed by a concurrent compact.
+    std::shared_ptr<const segment_list> current = snapshot();
+    size_t n = 0;
+    for(auto & segment : *current) n += segment->size();
+    return n;
+}
+
+size_t SegmentedIndex::findn(const std::string & pattern) const
+{
+    std::shared_ptr<const segment_list> current = snapshot();
+    size_t n = 0;
+    for(auto & segment : *current) n += segment->findn(pattern);
+    return n;
+}
+
+size_t SegmentedIndex::find(std::list<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> & matches,
+                            const std::string & pattern,
+                            const size_t max_context) const
+{
+    std::shared_ptr<const segment_list> current = snapshot();
+    size_t n = 0;
+    for(auto & segment : *current) n += segment->find(matches, pattern, max_context);
+    return n;
+}
+
+std::list<std::string> SegmentedIndex::find_lines(const std::string & pattern,
+                                                  const char new_line_char,
+                                                  const size_t max_context) const
+{
+    std::shared_ptr<const segment_list> current = snapshot();
+    std::list<std::string> l;
+    for(auto & segment : *current) l.splice(l.end(), segment->find_lines(pattern, new_line_char, max_context));
+    return l;
+}
@@ -0,0 +1,72 @@
+#ifndef __FM_Index__SegmentedIndex__
+#define __FM_Index__SegmentedIndex__
+
+#include <vector>
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+
+#include "FMIndex.h"
+
+/* An index which can be appended to. Each append builds a small fresh FMIndex
+   segment and queries fan out across all segments. compact() merges runs of
+   neighbouring segments of similar size (size-tiered, as in log-structured
+   merge trees) so that the number of segments stays logarithmic in the total
+   size. Segments are merged with FMIndex::merge so their text is never sorted
+   again. Segments are kept in the order their text was appended, which is the
+   order of the results of find and find_lines. (An append much larger than
+   those before it cuts the run they are in, until later appends join them.)
+
+   Each appended string is indexed followed by separator, so a pattern which
+   does not contain separator finds the same matches however the segments
+   happen to be compacted.
+
+   append, compact and the queries may all be called concurrently. */
+class SegmentedIndex
+{
+public:
+    typedef std::vector<std::shared_ptr<const FMIndex>> segment_list;
+
+private:
+    std::shared_ptr<const segment_list> segments; // Only ever replaced, never modified, so readers need no lock.
+    std::mutex update_mutex; // Serializes replacing segments.
+    std::mutex compaction_mutex; // At most one compaction at a time.
+    const char separator;
+    const size_t fanout, min_segment_size, SA_sample_rate;
+
+    size_t tier(const size_t segment_size) const;
+
+    void replace_segments(const segment_list & old_segments,
+                          const std::shared_ptr<const FMIndex> & new_segment);
+
+public:
+    SegmentedIndex(const char separator = '\n',
+                   const size_t fanout = 4,
+                   const size_t min_segment_size = 1 << 20,
+                   const size_t SA_sample_rate = 32);
+
+    void append(const std::string & s);
+
+    bool compact(void); // Merges one run of segments if any tier has a full one; returns whether it did.
+
+    std::shared_ptr<const segment_list> snapshot(void) const;
+
+    size_t n_segments(void) const;
+
+    size_t size(void) const;
+
+    size_t findn(const std::string & pattern) const;
+
+    /* The iterators refer into the segments so are invalidated if compact()
+       frees their segment; hold a snapshot() across their use if need be. */
+    size_t find(std::list<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> & matches,
+                const std::string & pattern,
+                const size_t max_context = 100) const;
+
+    std::list<std::string> find_lines(const std::string & pattern,
+                                      const char new_line_char = '\n',
+                                      const size_t max_context = 100) const;
+};
+
+#endif /* defined(__FM_Index__SegmentedIndex__) */
@@ -0,0 +1,94 @@
+#include <stdexcept>
+
+#include "SparseBitVector.h"
+#include "serializing.h"
+
+SparseBitVector::SparseBitVector(const std::vector<size_t> & positions, const size_t n)
+    : n(n),
+      m(positions.size()),
+      low_width(0)
+{
+    if(n == 0) throw std::length_error("Cannot construct zero-length SparseBitVector");
+    while(m > 0 && (n / m) >> (low_width + 1) > 0) low_width++; // floor(log2(n / m))
+    low_bits.assign((m * low_width + 63) / 64 + 1, 0);
+
+    std::vector<bool> high((n >> low_width) + m + 1);
+    for(size_t k = 0; k < m; k++)
+    {
+        if(positions[k] >= n) throw std::invalid_argument("SparseBitVector position out of range");
+        if(k > 0 && positions[k] <= positions[k-1]) throw std::invalid_argument("SparseBitVector positions must increase");
+        size_t x = positions[k] & ((uint64_t(1) << low_width) - 1), bit = k * low_width;
+        if(low_width > 0)
+        {
+            low_bits[bit / 64] |= uint64_t(x) << (bit % 64);
+            if(bit % 64 + low_width > 64) low_bits[bit / 64 + 1] |= uint64_t(x) >> (64 - bit % 64);
+        }
+        high[(positions[k] >> low_width) + k] = true;
+    }
+    high_bits = std::unique_ptr<BitVector>(new BitVector(high));
+}
+
+size_t SparseBitVector::low(const size_t k) const
+{
+    if(low_width == 0) return 0;
+    size_t bit = k * low_width;
+    uint64_t x = low_bits[bit / 64] >> (bit % 64);
+    if(bit % 64 + low_width > 64) x |= low_bits[bit / 64 + 1] << (64 - bit % 64);
+    return x & ((uint64_t(1) << low_width) - 1);
+}
+
+size_t SparseBitVector::size(void) const
+{
+    return n;
+}
+
+size_t SparseBitVector::ones(void) const
+{
+    return m;
+}
+
+size_t SparseBitVector::rank1(const size_t i) const
+{
+    if(i >= n) throw std::out_of_range("SparseBitVector rank out of range");
+
+    // The positions with high part less than i's end at the (i >> low_width)-th unset bit; then scan those with the same high part.
+    size_t high = i >> low_width, low_i = i & ((uint64_t(1) << low_width) - 1);
+    size_t k = high == 0 ? 0 : high_bits->select0(high - 1) + 1 - high;
+    for(size_t b = high + k; k < m && high_bits->select(b) && low(k) <= low_i; b++) k++;
+    return k;
+}
+
+size_t SparseBitVector::select1(const size_t k) const
+{
+    if(k >= m) throw std::out_of_range("SparseBitVector select1 out of range");
+    return ((high_bits->select1(k) - k) << low_width) | low(k);
+}
+
+size_t SparseBitVector::bytes(void) const
+{
+    return sizeof(uint64_t) * low_bits.size() + high_bits->bytes_of_bits() + high_bits->bytes_of_rank_directory();
+}
+
+SparseBitVector::SparseBitVector(std::istreambuf_iterator<char> serial_data)
+{
+    deserialize_from_chars(serial_data, n);
+    deserialize_from_chars(serial_data, m);
+    deserialize_from_chars(serial_data, low_width);
+    size_t n_words;
+    deserialize_from_chars(serial_data, n_words);
+    low_bits.resize(n_words);
+    for(size_t i = 0; i < n_words; i++)
+        deserialize_from_chars(serial_data, low_bits[i]);
+    high_bits = std::unique_ptr<BitVector>(new BitVector(serial_data));
+}
+
+void SparseBitVector::serialize(std::ostreambuf_iterator<char> serial_data) const
+{
+    serialize_as_chars(serial_data, n);
+    serialize_as_chars(serial_data, m);
+    serialize_as_chars(serial_data, low_width);
+    serialize_as_chars(serial_data, low_bits.size());
+    for(size_t i = 0; i < low_bits.size(); i++)
+        serialize_as_chars(serial_data, low_bits[i]);
+    high_bits->serialize(serial_data);
+}
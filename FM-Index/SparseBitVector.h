@@ -0,0 +1,43 @@
+#ifndef __FM_Index__SparseBitVector__
+#define __FM_Index__SparseBitVector__
+
+#include <vector>
+#include <memory>
+#include <iterator>
+
+#include "BitVector.h"
+
+/* A bit vector with few set bits, stored as the Elias-Fano code of their
+   positions: the low bits of each position packed in an array and the high
+   bits in unary in a BitVector, so about 2 + log(size / ones) bits per set
+   bit however large the size. */
+class SparseBitVector
+{
+private:
+    size_t n, m; // Size and number of set bits.
+    size_t low_width;
+    std::vector<uint64_t> low_bits;
+    std::unique_ptr<BitVector> high_bits; // Bit (position >> low_width) + k set for the k-th position.
+
+    size_t low(const size_t k) const;
+
+public:
+    // The bit vector of size n whose set bits are at the given positions, which must increase.
+    SparseBitVector(const std::vector<size_t> & positions, const size_t n);
+
+    SparseBitVector(std::istreambuf_iterator<char> serial_data);
+
+    size_t size(void) const;
+
+    size_t ones(void) const;
+
+    size_t rank1(const size_t i) const; // Number of set bits in [0, i].
+
+    size_t select1(const size_t k) const; // Position of the k-th (counting from 0) set bit.
+
+    size_t bytes(void) const;
+
+    void serialize(std::ostreambuf_iterator<char> serial_data) const;
+};
+
+#endif /* defined(__FM_Index__SparseBitVector__) */
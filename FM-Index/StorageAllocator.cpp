@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <new>
+
+#include "StorageAllocator.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace
+{
+    std::mutex default_mutex;
+    std::shared_ptr<StorageAllocator> default_allocator;
+    thread_local std::shared_ptr<StorageAllocator> thread_allocator;
+
+#ifdef __linux__
+    std::string read_first_line(const std::string & filename)
+    {
+        std::ifstream f(filename);
+        std::string line;
+        std::getline(f, line);
+        return line;
+    }
+
+    // Parses a kernel list such as "0-3,8,10-11".
+    std::vector<int> parse_list(const std::string & list)
+    {
+        std::vector<int> values;
+        std::istringstream in(list);
+        std::string range;
+        while(std::getline(in, range, ','))
+        {
+            if(range.empty()) continue;
+            size_t dash = range.find('-');
+            int first = std::atoi(range.substr(0, dash).c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.substr(dash + 1).c_str());
+            for(int v = first; v <= last; v++) values.push_back(v);
+        }
+        return values;
+    }
+#endif
+
+    size_t read_huge_page_size(void)
+    {
+        std::ifstream f("/proc/meminfo");
+        std::string key;
+        size_t kB;
+        while(f >> key)
+        {
+            if(key == "Hugepagesize:" && f >> kB) return kB << 10;
+            f.ignore(256, '\n');
+        }
+        return 2 << 20;
+    }
+}
+
+std::shared_ptr<StorageAllocator> StorageAllocator::current(void)
+{
+    return thread_allocator ? thread_allocator : get_default();
+}
+
+std::shared_ptr<StorageAllocator> StorageAllocator::get_default(void)
+{
+    std::lock_guard<std::mutex> lock(default_mutex);
+    if(!default_allocator) default_allocator = std::make_shared<SystemStorageAllocator>();
+    return default_allocator;
+}
+
+void StorageAllocator::set_default(const std::shared_ptr<StorageAllocator> & allocator)
+{
+    if(!allocator) throw std::invalid_argument("Default StorageAllocator cannot be null");
+    std::lock_guard<std::mutex> lock(default_mutex);
+    default_allocator = allocator;
+}
+
+StorageAllocator::thread_scope::thread_scope(const std::shared_ptr<StorageAllocator> & allocator)
+    : previous(thread_allocator)
+{
+    thread_allocator = allocator;
+}
+
+StorageAllocator::thread_scope::~thread_scope(void)
+{
+    thread_allocator = previous;
+}
+
+SystemStorageAllocator::SystemStorageAllocator(const policy & p)
+    : p(p),
+      huge_page_size(read_huge_page_size()),
+      min_mapped_bytes(p.min_mapped_bytes == 0 ? huge_page_size : p.min_mapped_bytes),
+      s()
+{
+    if(p.placement == bind_to_node && p.node < 0) throw std::invalid_argument("NUMA node must be non-negative");
+}
+
+bool SystemStorageAllocator::maps(const size_t bytes) const
+{
+#ifdef __linux__
+    return (p.huge_pages != no_huge_pages || p.placement != first_touch) && bytes >= min_mapped_bytes;
+#else
+    return false;
+#endif
+}
+
+void * SystemStorageAllocator::allocate(const size_t bytes)
+{
+    if(!maps(bytes))
+    {
+        void * q = std::calloc(bytes, 1);
+        if(q == nullptr) throw std::bad_alloc();
+        std::lock_guard<std::mutex> lock(mutex);
+        s.calloc_bytes += bytes;
+        return q;
+    }
+
+#ifdef __linux__
+    // Round up to whole huge pages: deallocate unmaps the same length.
+    const size_t length = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    void * q = MAP_FAILED;
+    bool fallback = false;
+    if(p.huge_pages == explicit_huge_pages)
+    {
+        q = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        fallback = q == MAP_FAILED;
+    }
+    bool explicit_pages = q != MAP_FAILED;
+    bool advised = false;
+    if(q == MAP_FAILED)
+    {
+        // Over-map by a huge page and trim so that the mapping is aligned and huge pages can back all of it.
+        char * raw = static_cast<char *>(mmap(nullptr, length + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if(raw == MAP_FAILED) throw std::bad_alloc();
+        char * aligned = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + huge_page_size - 1) / huge_page_size * huge_page_size);
+        if(aligned > raw) munmap(raw, aligned - raw);
+        if(raw + huge_page_size > aligned) munmap(aligned + length, raw + huge_page_size - aligned);
+        q = aligned;
+        if(p.huge_pages != no_huge_pages)
+        {
+            advised = madvise(q, length, MADV_HUGEPAGE) == 0;
+            fallback = fallback || !advised;
+        }
+    }
+    place(q, length); // Before the pages are touched, as they are placed when first faulted in.
+
+    std::lock_guard<std::mutex> lock(mutex);
+    (explicit_pages ? s.explicit_huge_page_bytes : advised ? s.transparent_huge_page_bytes : s.normal_page_bytes) += length;
+    if(fallback) s.huge_page_fallbacks++;
+    return q;
+#else
+    throw std::logic_error("SystemStorageAllocator cannot map memory on this platform");
+#endif
+}
+
+void SystemStorageAllocator::place(void * addr, const size_t length)
+{
+#ifdef __linux__
+    if(p.placement == first_touch) return;
+
+    const int MPOL_BIND_ = 2, MPOL_INTERLEAVE_ = 3; // From linux/mempolicy.h, which may not be installed.
+    std::vector<int> nodes = p.placement == bind_to_node ? std::vector<int>(1, p.node) : numa_nodes();
+    const size_t bits_per_word = 8 * sizeof(unsigned long);
+    int max_node = 0;
+    for(int node : nodes) max_node = std::max(max_node, node);
+    std::vector<unsigned long> mask(max_node / bits_per_word + 1, 0);
+    for(int node : nodes) mask[node / bits_per_word] |= 1UL << (node % bits_per_word);
+    long result = syscall(SYS_mbind, addr, length,
+                          p.placement == bind_to_node ? MPOL_BIND_ : MPOL_INTERLEAVE_,
+                          mask.data(), mask.size() * bits_per_word + 1, 0);
+    if(result != 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        s.placement_failures++;
+    }
+#else
+    (void) addr;
+    (void) length;
+#endif
+}
+
+void SystemStorageAllocator::deallocate(void * q, const size_t bytes)
+{
+#ifdef __linux__
+    if(maps(bytes))
+    {
+        munmap(q, (bytes + huge_page_size - 1) / huge_page_size * huge_page_size);
+        return;
+    }
+#endif
+    std::free(q);
+}
+
+const SystemStorageAllocator::policy & SystemStorageAllocator::get_policy(void) const
+{
+    return p;
+}
+
+SystemStorageAllocator::statistics SystemStorageAllocator::stats(void) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return s;
+}
+
+std::string SystemStorageAllocator::report(void) const
+{
+    static const char * huge_pages_names[] = {"none", "transparent", "explicit"};
+    static const char * placement_names[] = {"first-touch", "interleave", "bind"};
+    system_info info = probe_system();
+    statistics st = stats();
+
+    std::ostringstream out;
+    out << "huge pages: " << huge_pages_names[p.huge_pages]
+        << " (page size " << (info.huge_page_size >> 10) << " kB, transparent " << info.transparent_huge_pages
+        << ", " << info.free_explicit_huge_pages << " explicit free)"
+        << "; placement: " << placement_names[p.placement];
+    if(p.placement == bind_to_node) out << " node " << p.node;
+    out << " (" << info.numa_nodes.size() << " NUMA node" << (info.numa_nodes.size() == 1 ? "" : "s") << ")"
+        << "; allocated: " << st.explicit_huge_page_bytes << " B explicit, "
+        << st.transparent_huge_page_bytes << " B transparent, "
+        << st.normal_page_bytes << " B normal pages, "
+        << st.calloc_bytes << " B calloc"
+        << "; " << st.huge_page_fallbacks << " huge page fallbacks, "
+        << st.placement_failures << " placement failures";
+    return out.str();
+}
+
+SystemStorageAllocator::system_info SystemStorageAllocator::probe_system(void)
+{
+    system_info info;
+    info.huge_page_size = read_huge_page_size();
+    info.transparent_huge_pages = "unavailable";
+    info.free_explicit_huge_pages = 0;
+#ifdef __linux__
+    // The mode in use is bracketed, e.g., "always [madvise] never".
+    std::string modes = read_first_line("/sys/kernel/mm/transparent_hugepage/enabled");
+    size_t open = modes.find('['), close = modes.find(']');
+    if(open != std::string::npos && close != std::string::npos && close > open)
+        info.transparent_huge_pages = modes.substr(open + 1, close - open - 1);
+    std::ostringstream pool;
+    pool << "/sys/kernel/mm/hugepages/hugepages-" << (info.huge_page_size >> 10) << "kB/free_hugepages";
+    info.free_explicit_huge_pages = std::strtoul(read_first_line(pool.str()).c_str(), nullptr, 10);
+#endif
+    info.numa_nodes = numa_nodes();
+    return info;
+}
+
+std::vector<int> numa_nodes(void)
+{
+    std::vector<int> nodes;
+#ifdef __linux__
+    nodes = parse_list(read_first_line("/sys/devices/system/node/online"));
+#endif
+    if(nodes.empty()) nodes.push_back(0);
+    return nodes;
+}
+
+int current_numa_node(void)
+{
+#ifdef __linux__
+    unsigned cpu, node;
+    if(syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) return static_cast<int>(node);
+#endif
+    return 0;
+}
+
+bool bind_current_thread_to_numa_node(const int node)
+{
+#ifdef __linux__
+    std::ostringstream cpulist;
+    cpulist << "/sys/devices/system/node/node" << node << "/cpulist";
+    std::vector<int> cpus = parse_list(read_first_line(cpulist.str()));
+    if(cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : cpus) if(cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return node == 0;
+#endif
+}
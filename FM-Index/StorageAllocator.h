@@ -0,0 +1,157 @@
+#ifndef __FM_Index__StorageAllocator__
+#define __FM_Index__StorageAllocator__
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/* Allocates the large arrays of an index, i.e., the bits and rank directories
+   of every BitVector. Memory returned by allocate is zeroed.
+
+   Allocations go to the allocator set for the calling thread by a
+   StorageAllocator::thread_scope, else to the default, which is a
+   SystemStorageAllocator with no huge pages or NUMA placement (i.e., plain
+   calloc, as before). Subclass to plug in another allocator. */
+class StorageAllocator
+{
+public:
+    virtual ~StorageAllocator(void) { }
+
+    virtual void * allocate(const size_t bytes) = 0;
+
+    virtual void deallocate(void * p, const size_t bytes) = 0;
+
+    static std::shared_ptr<StorageAllocator> current(void);
+
+    static std::shared_ptr<StorageAllocator> get_default(void);
+
+    static void set_default(const std::shared_ptr<StorageAllocator> & allocator);
+
+    // Directs the calling thread's allocations to allocator until destroyed.
+    class thread_scope
+    {
+    private:
+        std::shared_ptr<StorageAllocator> previous;
+
+    public:
+        explicit thread_scope(const std::shared_ptr<StorageAllocator> & allocator);
+
+        ~thread_scope(void);
+
+        thread_scope(const thread_scope &) = delete;
+
+        thread_scope & operator=(const thread_scope &) = delete;
+    };
+};
+
+/* Places arrays of at least min_mapped_bytes in their own anonymous mappings,
+   aligned to the huge page size, so that they can be backed by huge pages
+   and placed on NUMA nodes. Smaller arrays (and everything, if neither huge
+   pages nor a placement is asked for) come from calloc.
+
+   Explicit huge pages come from the pool reserved in /proc/sys/vm/nr_hugepages;
+   if that is empty the mapping falls back to transparent huge pages, and if
+   those are disabled to normal pages. Each fallback is counted in the
+   statistics rather than being an error. Only Linux supports huge pages and
+   placement: elsewhere everything comes from calloc. */
+class SystemStorageAllocator : public StorageAllocator
+{
+public:
+    enum huge_pages_t { no_huge_pages, transparent_huge_pages, explicit_huge_pages };
+
+    enum numa_placement_t { first_touch, interleave_nodes, bind_to_node };
+
+    struct policy
+    {
+        huge_pages_t huge_pages;
+        numa_placement_t placement;
+        int node; // For bind_to_node.
+        size_t min_mapped_bytes; // Zero means the huge page size.
+
+        policy(const huge_pages_t huge_pages = no_huge_pages,
+               const numa_placement_t placement = first_touch,
+               const int node = 0,
+               const size_t min_mapped_bytes = 0)
+            : huge_pages(huge_pages), placement(placement), node(node), min_mapped_bytes(min_mapped_bytes) { }
+    };
+
+    struct statistics
+    {
+        size_t calloc_bytes; // Small arrays, or no mapping needed.
+        size_t normal_page_bytes; // Mapped, but with normal pages.
+        size_t transparent_huge_page_bytes; // Mapped and advised to use huge pages.
+        size_t explicit_huge_page_bytes; // Mapped from the reserved huge page pool.
+        size_t huge_page_fallbacks; // Mappings that did not get the kind of huge pages asked for.
+        size_t placement_failures; // Mappings whose NUMA policy could not be set.
+    };
+
+    // What the system supports, read from /proc and /sys.
+    struct system_info
+    {
+        size_t huge_page_size; // Bytes; 2 MB if unknown.
+        std::string transparent_huge_pages; // Mode: always, madvise, never, or unavailable.
+        size_t free_explicit_huge_pages;
+        std::vector<int> numa_nodes; // Online nodes; just node 0 if not NUMA.
+    };
+
+private:
+    const policy p;
+    const size_t huge_page_size, min_mapped_bytes;
+    mutable std::mutex mutex;
+    statistics s;
+
+    bool maps(const size_t bytes) const;
+
+    void place(void * addr, const size_t length);
+
+public:
+    explicit SystemStorageAllocator(const policy & p = policy());
+
+    void * allocate(const size_t bytes);
+
+    void deallocate(void * p, const size_t bytes);
+
+    const policy & get_policy(void) const;
+
+    statistics stats(void) const;
+
+    std::string report(void) const; // One line summary of the policy, system and statistics.
+
+    static system_info probe_system(void);
+};
+
+std::vector<int> numa_nodes(void); // Online NUMA nodes; just node 0 if not NUMA.
+
+int current_numa_node(void); // Node of the CPU the calling thread is running on.
+
+bool bind_current_thread_to_numa_node(const int node); // Restricts the calling thread to the CPUs of node.
+
+/* Arrays allocated by StorageAllocator::current and freed by the allocator
+   which allocated them. */
+template <typename T>
+struct storage_deleter
+{
+    std::shared_ptr<StorageAllocator> allocator;
+    size_t bytes;
+
+    void operator()(T * p) const
+    {
+        if(p != nullptr) allocator->deallocate(p, bytes);
+    }
+};
+
+template <typename T>
+using storage_array = std::unique_ptr<T[], storage_deleter<T>>;
+
+// Zeroed array of n elements of a trivial type.
+template <typename T>
+storage_array<T> allocate_storage(const size_t n)
+{
+    storage_deleter<T> deleter{StorageAllocator::current(), n * sizeof(T)};
+    T * p = n == 0 ? nullptr : static_cast<T *>(deleter.allocator->allocate(deleter.bytes));
+    return storage_array<T>(p, deleter);
+}
+
+#endif /* defined(__FM_Index__StorageAllocator__) */
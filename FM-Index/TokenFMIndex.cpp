@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+#include <tuple>
+
+#include "TokenFMIndex.h"
+#include "serializing.h"
+#include "suffix_sorting.h"
+
+namespace
+{
+    /* As for FMIndex, serialized indexes start with the magic bytes and the
+       version of their layout, then the size of a symbol so that an index of
+       one symbol type is not read as another. */
+    const char serial_magic[8] = {'T', 'o', 'k', 'e', 'n', 'F', 'M', 'I'};
+    const size_t serial_version = 1;
+}
+
+template <typename symbol_t>
+TokenFMIndex<symbol_t>::TokenFMIndex(const std::vector<symbol_t> & s, const size_t SA_sample_rate)
+    : SA_sample_rate(SA_sample_rate)
+{
+    if(s.empty()) throw std::length_error("Cannot construct zero-length TokenFMIndex");
+    const size_t n = s.size();
+
+    alphabet = s;
+    std::sort(alphabet.begin(), alphabet.end());
+    alphabet.erase(std::unique(alphabet.begin(), alphabet.end()), alphabet.end());
+    alphabet.shrink_to_fit();
+
+    std::vector<size_t> codes(n);
+    C.assign(alphabet.size() + 2, 0);
+    for(size_t i = 0; i < n; i++)
+    {
+        codes[i] = code(s[i]);
+        C[codes[i] + 1]++;
+    }
+    C[1] = 1; // The end of the text.
+    for(size_t k = 1; k < C.size(); k++) C[k] += C[k-1];
+
+    // Row 0 is the empty suffix, which sorts first; suffix_sort gives the rest.
+    std::vector<size_t> SA = suffix_sort(codes);
+    std::vector<size_t> BWT_codes(n + 1);
+    BWT_codes[0] = codes[n-1];
+    for(size_t row = 1; row <= n; row++) BWT_codes[row] = SA[row-1] == 0 ? 0 : codes[SA[row-1] - 1];
+    BWT = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(BWT_codes));
+
+    if(SA_sample_rate > 0)
+    {
+        std::vector<bool> sampled(n + 1);
+        std::vector<std::pair<size_t, size_t>> samples; // (row, SA value)
+        if(n % SA_sample_rate == 0) samples.push_back(std::make_pair(0, n));
+        for(size_t row = 1; row <= n; row++)
+            if(SA[row-1] % SA_sample_rate == 0) samples.push_back(std::make_pair(row, SA[row-1]));
+        for(auto & sample : samples) sampled[sample.first] = true;
+        SA_sampled_rows = std::unique_ptr<BitVector>(new BitVector(sampled));
+        SA_samples.reserve(samples.size());
+        for(auto & sample : samples) SA_samples.push_back(sample.second);
+    }
+}
+
+template <typename symbol_t>
+size_t TokenFMIndex<symbol_t>::code(const symbol_t c) const
+{
+    typename std::vector<symbol_t>::const_iterator it = std::lower_bound(alphabet.begin(), alphabet.end(), c);
+    return (it == alphabet.end() || *it != c) ? 0 : 1 + (it - alphabet.begin());
+}
+
+template <typename symbol_t>
+size_t TokenFMIndex<symbol_t>::rank_before_row(const size_t i, const size_t k) const
+{
+    return i == 0 ? 0 : BWT->rank(i-1, k);
+}
+
+template <typename symbol_t>
+size_t TokenFMIndex<symbol_t>::LF(const size_t i) const
+{
+    size_t k = BWT->select(i);
+    return C[k] + rank_before_row(i, k);
+}
+
+template <typename symbol_t>
+size_t TokenFMIndex<symbol_t>::size(void) const
+{
+    return BWT->size() - 1;
+}
+
+template <typename symbol_t>
+size_t TokenFMIndex<symbol_t>::alphabet_size(void) const
+{
+    return alphabet.size();
+}
+
+template <typename symbol_t>
+std::pair<size_t, size_t> TokenFMIndex<symbol_t>::find_interval(const symbol_t * pattern, const size_t length) const
+{
+    if(length == 0) throw std::length_error("Cannot search for zero-length pattern");
+
+    std::pair<size_t, size_t> no_matches(1, 0);
+    size_t k = code(pattern[length-1]);
+    if(k == 0) return no_matches;
+    size_t lb = C[k], ub = C[k+1];
+    for(size_t i = length - 1; i > 0; i--)
+    {
+        k = code(pattern[i-1]);
+        if(k == 0) return no_matches;
+        lb = C[k] + rank_before_row(lb, k);
+        ub = C[k] + rank_before_row(ub, k);
+        if(ub <= lb) return no_matches;
+    }
+    return std::make_pair(lb, ub);
+}
+
+template <typename symbol_t>
+std::pair<size_t, size_t> TokenFMIndex<symbol_t>::find_interval(const std::vector<symbol_t> & pattern) const
+{
+    return find_interval(pattern.data(), pattern.size());
+}
+
+template <typename symbol_t>
+size_t TokenFMIndex<symbol_t>::findn(const std::vector<symbol_t> & pattern) const
+{
+    std::pair<size_t, size_t> interval = find_interval(pattern);
+    return interval.second <= interval.first ? 0 : interval.second - interval.first;
+}
+
+template <typename symbol_t>
+void TokenFMIndex<symbol_t>::findn_batch(const symbol_t * const * patterns,
+                                         const size_t * lengths,
+                                         const size_t n_patterns,
+                                         size_t * counts,
+                                         size_t * lbs) const
+{
+    for(size_t i = 0; i < n_patterns; i++)
+    {
+        std::pair<size_t, size_t> interval = find_interval(patterns[i], lengths[i]);
+        counts[i] = interval.second <= interval.first ? 0 : interval.second - interval.first;
+        if(lbs != nullptr) lbs[i] = interval.first;
+    }
+}
+
+template <typename symbol_t>
+size_t TokenFMIndex<symbol_t>::locate(size_t row) const
+{
+    if(SA_sample_rate == 0) throw std::logic_error("TokenFMIndex has no suffix array samples");
+    if(row > size()) throw std::out_of_range("TokenFMIndex locate out of range");
+
+    // Step back through the text until we reach a sampled row. (The row of the text itself is always sampled.)
+    size_t steps = 0;
+    for(; !SA_sampled_rows->select(row); steps++) row = LF(row);
+    return SA_samples[SA_sampled_rows->rank1(row) - 1] + steps;
+}
+
+template <typename symbol_t>
+std::vector<size_t> TokenFMIndex<symbol_t>::locate(const std::vector<symbol_t> & pattern) const
+{
+    size_t lb, ub;
+    std::tie(lb, ub) = find_interval(pattern);
+    std::vector<size_t> positions;
+    for(size_t row = lb; row < ub; row++) positions.push_back(locate(row));
+    return positions;
+}
+
+template <typename symbol_t>
+TokenFMIndex<symbol_t>::TokenFMIndex(std::istreambuf_iterator<char> serial_data)
+{
+    char magic[sizeof(serial_magic)];
+    deserialize_from_chars(serial_data, magic);
+    if(!std::equal(magic, magic + sizeof(magic), serial_magic))
+        throw std::runtime_error("Not a serialized TokenFMIndex, or one from before format versions: rebuild it");
+    size_t version, symbol_size;
+    deserialize_from_chars(serial_data, version);
+    if(version != serial_version)
+        throw std::runtime_error("Serialized TokenFMIndex has format version " + std::to_string(version) +
+                                 " but only version " + std::to_string(serial_version) + " can be read");
+    deserialize_from_chars(serial_data, symbol_size);
+    if(symbol_size != sizeof(symbol_t))
+        throw std::runtime_error("Serialized TokenFMIndex has " + std::to_string(symbol_size) + "-byte symbols, not " +
+                                 std::to_string(sizeof(symbol_t)));
+
+    size_t alphabet_size;
+    deserialize_from_chars(serial_data, alphabet_size);
+    alphabet.resize(alphabet_size);
+    for(size_t i = 0; i < alphabet_size; i++)
+        deserialize_from_chars(serial_data, alphabet[i]);
+    C.resize(alphabet_size + 2);
+    for(size_t k = 0; k < C.size(); k++)
+        deserialize_from_chars(serial_data, C[k]);
+    BWT = std::unique_ptr<WaveletMatrix>(new WaveletMatrix(serial_data));
+    deserialize_from_chars(serial_data, SA_sample_rate);
+    if(SA_sample_rate > 0)
+    {
+        SA_sampled_rows = std::unique_ptr<BitVector>(new BitVector(serial_data));
+        size_t n_samples;
+        deserialize_from_chars(serial_data, n_samples);
+        SA_samples.resize(n_samples);
+        for(size_t i = 0; i < n_samples; i++)
+            deserialize_from_chars(serial_data, SA_samples[i]);
+    }
+}
+
+template <typename symbol_t>
+void TokenFMIndex<symbol_t>::serialize(std::ostreambuf_iterator<char> serial_data) const
+{
+    serialize_as_chars(serial_data, serial_magic);
+    serialize_as_chars(serial_data, serial_version);
+    serialize_as_chars(serial_data, sizeof(symbol_t));
+    serialize_as_chars(serial_data, alphabet.size());
+    for(size_t i = 0; i < alphabet.size(); i++)
+        serialize_as_chars(serial_data, alphabet[i]);
+    for(size_t k = 0; k < C.size(); k++)
+        serialize_as_chars(serial_data, C[k]);
+    BWT->serialize(serial_data);
+    serialize_as_chars(serial_data, SA_sample_rate);
+    if(SA_sample_rate > 0)
+    {
+        SA_sampled_rows->serialize(serial_data);
+        serialize_as_chars(serial_data, SA_samples.size());
+        for(size_t i = 0; i < SA_samples.size(); i++)
+            serialize_as_chars(serial_data, SA_samples[i]);
+    }
+}
+
+template <typename symbol_t>
+void TokenFMIndex<symbol_t>::serialize_to_file(const std::string & filename) const
+{
+    std::ofstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
+    serialize(std::ostreambuf_iterator<char>{f});
+}
+
+template <typename symbol_t>
+TokenFMIndex<symbol_t> * TokenFMIndex<symbol_t>::new_from_serialized_file(const std::string & filename)
+{
+    std::ifstream f{filename, std::ios::binary};
+    if(!f) throw std::system_error(errno, std::generic_category(), "Cannot open " + filename);
+    return new TokenFMIndex<symbol_t>{std::istreambuf_iterator<char>{f}};
+}
+
+template class TokenFMIndex<uint16_t>;
+template class TokenFMIndex<uint32_t>;
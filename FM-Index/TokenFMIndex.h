@@ -0,0 +1,72 @@
+#ifndef __FM_Index__TokenFMIndex__
+#define __FM_Index__TokenFMIndex__
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <iterator>
+
+#include "BitVector.h"
+#include "WaveletMatrix.h"
+
+/* An FM index of a text of integer tokens (e.g., word identifiers) rather
+   than bytes. Instantiated for uint16_t and uint32_t symbols.
+
+   The tokens which occur are numbered 1, 2, ... in increasing order (0 stands
+   for the end of the text) so the BWT is stored as a WaveletMatrix with no
+   per-node alphabet, and C is a plain array over just the tokens present: a
+   token is found in it by binary search of the sorted alphabet.
+
+   Only counting and locating are supported: there is no reverse BWT. */
+template <typename symbol_t>
+class TokenFMIndex
+{
+private:
+    std::vector<symbol_t> alphabet; // Distinct tokens, in increasing order.
+    std::vector<size_t> C; // C[k] is the number of symbols (including the end) with code < k.
+    std::unique_ptr<WaveletMatrix> BWT; // Codes, with 0 in the row of the text itself.
+    size_t SA_sample_rate; // Zero if no samples are kept.
+    std::unique_ptr<BitVector> SA_sampled_rows;
+    std::vector<size_t> SA_samples;
+
+    size_t code(const symbol_t c) const; // Zero if c does not occur.
+
+    size_t rank_before_row(const size_t i, const size_t k) const;
+
+    size_t LF(const size_t i) const;
+
+public:
+    TokenFMIndex(const std::vector<symbol_t> & s, const size_t SA_sample_rate = 32);
+
+    TokenFMIndex(std::istreambuf_iterator<char> serial_data);
+
+    size_t size(void) const; // Number of tokens.
+
+    size_t alphabet_size(void) const; // Number of distinct tokens.
+
+    // Rows [lb, ub) of the suffix array prefixed by the pattern (ub <= lb if none).
+    std::pair<size_t, size_t> find_interval(const symbol_t * pattern, const size_t length) const;
+
+    std::pair<size_t, size_t> find_interval(const std::vector<symbol_t> & pattern) const;
+
+    size_t findn(const std::vector<symbol_t> & pattern) const;
+
+    // As FMIndex::findn_batch.
+    void findn_batch(const symbol_t * const * patterns,
+                     const size_t * lengths,
+                     const size_t n_patterns,
+                     size_t * counts,
+                     size_t * lbs = nullptr) const;
+
+    size_t locate(size_t row) const; // Token position of the suffix in row.
+
+    std::vector<size_t> locate(const std::vector<symbol_t> & pattern) const;
+
+    void serialize(std::ostreambuf_iterator<char> serial_data) const;
+
+    void serialize_to_file(const std::string & filename) const;
+
+    static TokenFMIndex * new_from_serialized_file(const std::string & filename);
+};
+
+#endif /* defined(__FM_Index__TokenFMIndex__) */
@@ -0,0 +1,215 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include "WaveletMatrix.h"
+#include "serializing.h"
+
+WaveletMatrix::WaveletMatrix(const std::vector<size_t> & s)
+{
+    if(s.size() == 0) throw std::length_error("Cannot construct zero-length WaveletMatrix");
+
+    size_t max_c = *std::max_element(s.begin(), s.end());
+    for(n_levels = 1; n_levels < 8 * sizeof(size_t) && (max_c >> n_levels) > 0; n_levels++);
+
+    /* Each level is built from the symbols stably sorted by the bits
+       of the previous levels: those with a 0 bit first. */
+    std::vector<size_t> s_level(s), s_next(s.size());
+    std::vector<bool> data_v(s.size());
+    for(size_t level = 0; level < n_levels; level++)
+    {
+        size_t shift = n_levels - level - 1;
+        size_t n_zeros_level = 0;
+        for(size_t i = 0; i < s_level.size(); i++)
+        {
+            data_v[i] = ((s_level[i] >> shift) & 1) == 1;
+            if(!data_v[i]) n_zeros_level++;
+        }
+        size_t j0 = 0, j1 = n_zeros_level;
+        for(size_t i = 0; i < s_level.size(); i++)
+            s_next[data_v[i] ? j1++ : j0++] = s_level[i];
+        levels.push_back(std::unique_ptr<BitVector>(new BitVector(data_v)));
+        n_zeros.push_back(n_zeros_level);
+        s_level.swap(s_next);
+    }
+}
+
+size_t WaveletMatrix::rank0_before(const size_t level, const size_t i) const
+{
+    return i - rank1_before(level, i);
+}
+
+size_t WaveletMatrix::rank1_before(const size_t level, const size_t i) const
+{
+    return i == 0 ? 0 : levels[level]->rank1(i-1);
+}
+
+size_t WaveletMatrix::size(void) const
+{
+    return levels[0]->size();
+}
+
+size_t WaveletMatrix::rank(const size_t i, const size_t c) const
+{
+    if(i >= size()) throw std::out_of_range("WaveletMatrix rank out of range");
+    if(n_levels < 8 * sizeof(size_t) && (c >> n_levels) > 0) return 0; // c outside alphabet.
+
+    // Track the range [lb, ub) of symbols sharing c's top bits, where lb is where c's first occurrence would be.
+    size_t lb = 0, ub = i+1;
+    for(size_t level = 0; level < n_levels; level++)
+    {
+        if(((c >> (n_levels - level - 1)) & 1) == 1)
+        {
+            lb = n_zeros[level] + rank1_before(level, lb);
+            ub = n_zeros[level] + rank1_before(level, ub);
+        }
+        else
+        {
+            lb = rank0_before(level, lb);
+            ub = rank0_before(level, ub);
+        }
+    }
+    return ub - lb;
+}
+
+size_t WaveletMatrix::select(size_t i) const
+{
+    if(i >= size()) throw std::out_of_range("WaveletMatrix select out of range");
+    size_t c = 0;
+    for(size_t level = 0; level < n_levels; level++)
+    {
+        if(levels[level]->select(i))
+        {
+            c = (c << 1) | 1;
+            i = n_zeros[level] + rank1_before(level, i);
+        }
+        else
+        {
+            c <<= 1;
+            i = rank0_before(level, i);
+        }
+    }
+    return c;
+}
+
+void WaveletMatrix::distinct(const size_t level,
+                             const size_t lb,
+                             const size_t ub,
+                             const size_t prefix,
+                             std::vector<std::pair<size_t, size_t>> & values) const
+{
+    if(ub <= lb) return;
+    if(level == n_levels)
+    {
+        values.push_back(std::make_pair(prefix, ub - lb));
+        return;
+    }
+    size_t lb0 = rank0_before(level, lb), ub0 = rank0_before(level, ub);
+    distinct(level + 1, lb0, ub0, prefix << 1, values);
+    distinct(level + 1, n_zeros[level] + (lb - lb0), n_zeros[level] + (ub - ub0), (prefix << 1) | 1, values);
+}
+
+void WaveletMatrix::distinct(const size_t lb,
+                             const size_t ub,
+                             std::vector<std::pair<size_t, size_t>> & values) const
+{
+    if(ub > size()) throw std::out_of_range("WaveletMatrix distinct out of range");
+    distinct(0, lb, ub, 0, values);
+}
+
+size_t WaveletMatrix::count_less(const size_t lb, const size_t ub, const size_t c) const
+{
+    if(n_levels < 8 * sizeof(size_t) && (c >> n_levels) > 0) return ub - lb; // All symbols are less than c.
+
+    // As rank, following c's bits, but counting the symbols which branch off below c.
+    size_t lb_level = lb, ub_level = ub, n_less = 0;
+    for(size_t level = 0; level < n_levels; level++)
+    {
+        size_t lb0 = rank0_before(level, lb_level), ub0 = rank0_before(level, ub_level);
+        if(((c >> (n_levels - level - 1)) & 1) == 1)
+        {
+            n_less += ub0 - lb0;
+            lb_level = n_zeros[level] + (lb_level - lb0);
+            ub_level = n_zeros[level] + (ub_level - ub0);
+        }
+        else
+        {
+            lb_level = lb0;
+            ub_level = ub0;
+        }
+    }
+    return n_less;
+}
+
+size_t WaveletMatrix::count_range(const size_t lb,
+                                  const size_t ub,
+                                  const size_t min_c,
+                                  const size_t max_c) const
+{
+    if(ub > size()) throw std::out_of_range("WaveletMatrix count_range out of range");
+    if(ub <= lb || max_c <= min_c) return 0;
+    return count_less(lb, ub, max_c) - count_less(lb, ub, min_c);
+}
+
+void WaveletMatrix::report_range(const size_t level,
+                                 const size_t lb,
+                                 const size_t ub,
+                                 const size_t prefix,
+                                 const size_t min_c,
+                                 const size_t max_c,
+                                 std::vector<size_t> & values) const
+{
+    // As distinct, but only into the subtrees whose symbols [prefix << bits left, (prefix + 1) << bits left) meet [min_c, max_c).
+    if(ub <= lb) return;
+    if(level == n_levels)
+    {
+        values.insert(values.end(), ub - lb, prefix);
+        return;
+    }
+    const size_t shift = n_levels - level - 1;
+    size_t lb0 = rank0_before(level, lb), ub0 = rank0_before(level, ub);
+    size_t prefix0 = prefix << 1, prefix1 = (prefix << 1) | 1;
+    if(min_c >> shift <= prefix0)
+        report_range(level + 1, lb0, ub0, prefix0, min_c, max_c, values);
+    if((max_c - 1) >> shift >= prefix1)
+        report_range(level + 1, n_zeros[level] + (lb - lb0), n_zeros[level] + (ub - ub0), prefix1, min_c, max_c, values);
+}
+
+void WaveletMatrix::report_range(const size_t lb,
+                                 const size_t ub,
+                                 const size_t min_c,
+                                 const size_t max_c,
+                                 std::vector<size_t> & values) const
+{
+    if(ub > size()) throw std::out_of_range("WaveletMatrix report_range out of range");
+    if(max_c <= min_c || (n_levels < 8 * sizeof(size_t) && (min_c >> n_levels) > 0)) return;
+    report_range(0, lb, ub, 0, min_c, max_c, values);
+}
+
+size_t WaveletMatrix::bytes(void) const
+{
+    size_t n = n_zeros.capacity() * sizeof(size_t);
+    for(auto & level : levels) n += level->bytes_of_bits() + level->bytes_of_rank_directory();
+    return n;
+}
+
+WaveletMatrix::WaveletMatrix(std::istreambuf_iterator<char> serial_data)
+{
+    deserialize_from_chars(serial_data, n_levels);
+    for(size_t level = 0; level < n_levels; level++)
+    {
+        size_t n_zeros_level;
+        deserialize_from_chars(serial_data, n_zeros_level);
+        n_zeros.push_back(n_zeros_level);
+        levels.push_back(std::unique_ptr<BitVector>(new BitVector(serial_data)));
+    }
+}
+
+void WaveletMatrix::serialize(std::ostreambuf_iterator<char> serial_data) const
+{
+    serialize_as_chars(serial_data, n_levels);
+    for(size_t level = 0; level < n_levels; level++)
+    {
+        serialize_as_chars(serial_data, n_zeros[level]);
+        levels[level]->serialize(serial_data);
+    }
+}
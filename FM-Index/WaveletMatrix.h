@@ -0,0 +1,75 @@
+#ifndef __FM_Index__WaveletMatrix__
+#define __FM_Index__WaveletMatrix__
+
+#include <vector>
+#include <memory>
+#include <iterator>
+
+#include "BitVector.h"
+
+/* A wavelet tree for (unsigned) integer symbols, laid out level by level as
+   in Claude & Navarro's "wavelet matrix". Unlike WaveletTree there is no
+   per-node alphabet so it remains small for very large alphabets (e.g.,
+   document identifiers). */
+class WaveletMatrix
+{
+private:
+    size_t n_levels; // Number of bits per symbol.
+    std::vector<std::unique_ptr<BitVector>> levels;
+    std::vector<size_t> n_zeros; // Number of 0 bits in each level.
+
+    size_t rank0_before(const size_t level, const size_t i) const;
+
+    size_t rank1_before(const size_t level, const size_t i) const;
+
+    void distinct(const size_t level,
+                  const size_t lb,
+                  const size_t ub,
+                  const size_t prefix,
+                  std::vector<std::pair<size_t, size_t>> & values) const;
+
+    size_t count_less(const size_t lb, const size_t ub, const size_t c) const;
+
+    void report_range(const size_t level,
+                      const size_t lb,
+                      const size_t ub,
+                      const size_t prefix,
+                      const size_t min_c,
+                      const size_t max_c,
+                      std::vector<size_t> & values) const;
+
+public:
+    WaveletMatrix(const std::vector<size_t> & s);
+
+    WaveletMatrix(std::istreambuf_iterator<char> serial_data);
+
+    size_t size(void) const;
+
+    size_t rank(const size_t i, const size_t c) const;
+
+    size_t select(const size_t i) const;
+
+    // Appends the distinct symbols in [lb, ub) together with their frequencies, in increasing order of symbol.
+    void distinct(const size_t lb,
+                  const size_t ub,
+                  std::vector<std::pair<size_t, size_t>> & values) const;
+
+    // Number of symbols in [lb, ub) with values in [min_c, max_c), in O(levels) steps.
+    size_t count_range(const size_t lb,
+                       const size_t ub,
+                       const size_t min_c,
+                       const size_t max_c) const;
+
+    // Appends the symbols in [lb, ub) with values in [min_c, max_c), in increasing order.
+    void report_range(const size_t lb,
+                      const size_t ub,
+                      const size_t min_c,
+                      const size_t max_c,
+                      std::vector<size_t> & values) const;
+
+    size_t bytes(void) const;
+
+    void serialize(std::ostreambuf_iterator<char> serial_data) const;
+};
+
+#endif /* defined(__FM_Index__WaveletMatrix__) */
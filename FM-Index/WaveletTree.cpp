@@ -1,7 +1,11 @@
 #include <stdexcept>
+#include <fstream>
+#include <cstdio>
 
 #include "WaveletTree.h"
 #include "serializing.h"
+#include "instrumentation.h"
+#include "misc.h"
 
 bool WaveletTree::is_leaf(void) const
 {
@@ -35,32 +39,162 @@ WaveletTree::WaveletTree(std::string & s,
     : alphabet_begin(alphabet_begin),
       alphabet_end(alphabet_end)
 {
-    if(s.size() == 0) throw std::length_error("Cannot construct zero-length WaveletTree");
-    if(alphabet_begin == nullptr) fill_alphabet(s.c_str(), s.size());
+    build(s, clear_s);
+}
 
-    std::string s_left, s_right;
+WaveletTree::WaveletTree(const std::string & filename,
+                         const size_t max_in_memory,
+                         const char * alphabet_begin,
+                         const char * alphabet_end)
+    : alphabet_begin(alphabet_begin),
+      alphabet_end(alphabet_end)
+{
+    /* As the constructor from a string, but the string is read from a file and
+       only loaded into memory once a node's share of it has at most
+       max_in_memory bytes. Larger nodes stream the file, writing the strings
+       for their children to files named after it. */
+    std::ifstream f(filename, std::ios::binary | std::ios::ate);
+    if(!f) throw std::runtime_error("Cannot open " + filename);
+    const size_t n = f.tellg();
+    f.seekg(0);
+    if(n <= max_in_memory)
+    {
+        std::string s(n, '\0');
+        f.read(&s[0], n);
+        build(s, true);
+        return;
+    }
+
+    std::vector<char> buf(1 << 20);
+    if(this->alphabet_begin == nullptr)
+    {
+        std::vector<bool> present(256);
+        for(size_t i = 0; i < n; i += buf.size())
+        {
+            size_t len = std::min(buf.size(), n - i);
+            f.read(&buf[0], len);
+            for(size_t k = 0; k < len; k++) present[static_cast<unsigned char>(buf[k])] = true;
+        }
+        std::string alphabet;
+        for(int c = 0; c < 256; c++)
+            if(present[c]) alphabet.push_back(static_cast<char>(c));
+        fill_alphabet(alphabet.c_str(), alphabet.size());
+        f.seekg(0);
+    }
+
+    const size_t alphabet_size = this->alphabet_end - this->alphabet_begin;
+    const scratch_file file_left(filename + ".0"), file_right(filename + ".1");
+    const std::string & filename_left = file_left.filename, & filename_right = file_right.filename;
+    std::ofstream f_left, f_right;
+    if(alphabet_size > 2)
+    {
+        f_left.open(filename_left, std::ios::binary);
+        f_right.open(filename_right, std::ios::binary);
+        if(!f_left || !f_right) throw std::runtime_error("Cannot create " + filename_left);
+    }
     std::vector<bool> data_v;
-    for(std::string::iterator it = s.begin(); it != s.end(); it++)
+    data_v.reserve(n);
+    std::string s_left, s_right;
+    for(size_t i = 0; i < n; i += buf.size())
     {
-        if(belongs_left(*it))
+        size_t len = std::min(buf.size(), n - i);
+        f.read(&buf[0], len);
+        for(size_t k = 0; k < len; k++)
         {
-            s_left.push_back(*it);
-            data_v.push_back(1);
+            if(belongs_left(buf[k]))
+            {
+                s_left.push_back(buf[k]);
+                data_v.push_back(1);
+            }
+            else
+            {
+                s_right.push_back(buf[k]);
+                data_v.push_back(0);
+            }
         }
-        else
+        if(alphabet_size > 2)
         {
-            s_right.push_back(*it);
-            data_v.push_back(0);
+            f_left.write(s_left.data(), s_left.size());
+            f_right.write(s_right.data(), s_right.size());
         }
+        s_left.clear();
+        s_right.clear();
+    }
+    data = std::unique_ptr<BitVector>(new BitVector(data_v));
+    data_v.clear();
+    data_v.shrink_to_fit();
+
+    if(alphabet_size <= 2)
+    {
+        left = nullptr;
+        right = nullptr;
     }
+    else
+    {
+        f_left.close();
+        f_right.close();
+        if(!f_left || !f_right) throw std::runtime_error("Cannot write " + filename_left);
+        const char *alphabet_mid = this->alphabet_begin + (1 + alphabet_size) / 2;
+        left = std::unique_ptr<WaveletTree>(new WaveletTree(filename_left, max_in_memory, this->alphabet_begin, alphabet_mid));
+        std::remove(filename_left.c_str()); // Free its disk space before building right.
+        right = std::unique_ptr<WaveletTree>(new WaveletTree(filename_right, max_in_memory, alphabet_mid, this->alphabet_end));
+    }
+}
+
+WaveletTree * WaveletTree::new_from_file(const std::string & filename, const size_t max_in_memory)
+{
+    return new WaveletTree(filename, max_in_memory, nullptr, nullptr);
+}
+
+WaveletTree::WaveletTree(char * s,
+                         char * scratch,
+                         const size_t n,
+                         const char * alphabet_begin,
+                         const char * alphabet_end)
+    : alphabet_begin(alphabet_begin),
+      alphabet_end(alphabet_end)
+{
+    build(s, scratch, n);
+}
+
+void WaveletTree::build(std::string & s, const bool clear_s)
+{
+    if(s.size() == 0) throw std::length_error("Cannot construct zero-length WaveletTree");
+    if(alphabet_begin == nullptr) fill_alphabet(s.c_str(), s.size());
+
+    /* Each node partitions its symbols between its children into a second
+       buffer, in which the children then partition theirs back into the
+       first: two buffers the size of s in all, rather than new strings at
+       every node. Unless clear_s, s is left alone, so a copy is the first. */
+    std::string scratch(s.size(), '\0');
     if(clear_s)
     {
+        build(&s[0], &scratch[0], s.size());
         s.clear();
         s.shrink_to_fit();
     }
+    else
+    {
+        std::string s_copy(s);
+        build(&s_copy[0], &scratch[0], s_copy.size());
+    }
+}
+
+void WaveletTree::build(char * s, char * scratch, const size_t n)
+{
+    if(n == 0) throw std::length_error("Cannot construct zero-length WaveletTree");
+
+    size_t n_left = 0;
+    std::vector<bool> data_v(n);
+    for(size_t i = 0; i < n; i++)
+    {
+        if(belongs_left(s[i]))
+        {
+            data_v[i] = 1;
+            n_left++;
+        }
+    }
     data = std::unique_ptr<BitVector>(new BitVector(data_v));
-    data_v.clear();
-    data_v.shrink_to_fit();
 
     size_t alphabet_size = this->alphabet_end - this->alphabet_begin;
     const char *alphabet_mid = this->alphabet_begin + (1 + alphabet_size) / 2;
@@ -68,12 +202,13 @@ WaveletTree::WaveletTree(std::string & s,
     {
         left = nullptr;
         right = nullptr;
+        return;
     }
-    else
-    {
-        left = std::unique_ptr<WaveletTree>(new WaveletTree(s_left, true, this->alphabet_begin, alphabet_mid));
-        right = std::unique_ptr<WaveletTree>(new WaveletTree(s_right, true, alphabet_mid, this->alphabet_end));
-    }
+    for(size_t i = 0, i_left = 0, i_right = n_left; i < n; i++) scratch[data_v[i] ? i_left++ : i_right++] = s[i];
+    data_v.clear();
+    data_v.shrink_to_fit();
+    left = std::unique_ptr<WaveletTree>(new WaveletTree(scratch, s, n_left, this->alphabet_begin, alphabet_mid));
+    right = std::unique_ptr<WaveletTree>(new WaveletTree(scratch + n_left, s + n_left, n - n_left, alphabet_mid, this->alphabet_end));
 }
 
 size_t WaveletTree::size(void) const
@@ -103,6 +238,7 @@ size_t WaveletTree::cum_freq(const char c) const
 size_t WaveletTree::rank(const size_t i, const char c) const
 {
     if(i >= data->size()) throw std::out_of_range("WaveletTree rank out of range");
+    FM_INDEX_COUNT(wavelet_levels, 1);
     if(is_leaf())
     {
         if(c != *alphabet_begin && c != *(alphabet_end-1)) return 0; // c outside alphabet.
@@ -111,18 +247,109 @@ size_t WaveletTree::rank(const size_t i, const char c) const
     }
     else
     {
-        if(belongs_left(c)) return data->rank1(i) >= 1 ? left->rank(data->rank1(i)-1, c) : 0;
-        else return data->rank0(i) >= 1 ? right->rank(data->rank0(i)-1, c) : 0;
+        size_t rk = belongs_left(c) ? data->rank1(i) : data->rank0(i);
+        if(rk == 0) return 0;
+        return belongs_left(c) ? left->rank(rk-1, c) : right->rank(rk-1, c);
+    }
+}
+
+size_t WaveletTree::rank_less(const size_t i, const char c) const
+{
+    if(i >= data->size()) throw std::out_of_range("WaveletTree rank_less out of range");
+    FM_INDEX_COUNT(wavelet_levels, 1);
+    if(is_leaf())
+    {
+        size_t rk = 0;
+        if(static_cast<unsigned char>(c) > static_cast<unsigned char>(*alphabet_begin)) rk += data->rank1(i);
+        if(alphabet_end - alphabet_begin == 2 &&
+           static_cast<unsigned char>(c) > static_cast<unsigned char>(*(alphabet_end-1))) rk += data->rank0(i);
+        return rk;
+    }
+    else
+    {
+        // Every symbol on the left is less than c if c belongs right, none on the right is if c belongs left.
+        size_t rk1 = data->rank1(i);
+        if(belongs_left(c)) return rk1 >= 1 ? left->rank_less(rk1-1, c) : 0;
+        else return rk1 + (i+1 - rk1 >= 1 ? right->rank_less(i - rk1, c) : 0);
     }
 }
 
 char WaveletTree::select(const size_t i) const
 {
     if(i >= data->size()) throw std::out_of_range("WaveletTree select out of range");
+    FM_INDEX_COUNT(wavelet_levels, 1);
     if(is_leaf()) return alphabet_begin[1-data->select(i)]; // NB: true == 1 is in C++ spec.
     else return data->select(i) == 1 ? left->select(data->rank1(i)-1) : right->select(data->rank0(i)-1);
 }
 
+std::pair<char, size_t> WaveletTree::select_with_rank(const size_t i) const
+{
+    if(i >= data->size()) throw std::out_of_range("WaveletTree select out of range");
+    FM_INDEX_COUNT(wavelet_levels, 1);
+    if(is_leaf())
+    {
+        if(data->select(i)) return std::make_pair(alphabet_begin[0], data->rank1(i));
+        else return std::make_pair(alphabet_begin[1], data->rank0(i));
+    }
+    else return data->select(i) ? left->select_with_rank(data->rank1(i)-1) : right->select_with_rank(data->rank0(i)-1);
+}
+
+WaveletTree::space_usage WaveletTree::space_breakdown(void) const
+{
+    space_usage space;
+    space.bits = data->bytes_of_bits();
+    space.rank_directories = data->bytes_of_rank_directory();
+    space.alphabets = alphabet_owner ? alphabet_end - alphabet_begin : 0; // Children share their root's unless deserialized.
+    space.nodes = sizeof(WaveletTree) + sizeof(BitVector);
+    if(!is_leaf())
+    {
+        for(const WaveletTree * child : {left.get(), right.get()})
+        {
+            space_usage child_space = child->space_breakdown();
+            space.bits += child_space.bits;
+            space.rank_directories += child_space.rank_directories;
+            space.alphabets += child_space.alphabets;
+            space.nodes += child_space.nodes;
+        }
+    }
+    return space;
+}
+
+std::string WaveletTree::extract(void) const
+{
+    std::string s(size(), '\0');
+    if(is_leaf())
+    {
+        for(size_t i = 0; i < s.size(); i++) s[i] = alphabet_begin[1-data->select(i)];
+    }
+    else
+    {
+        std::string s_left = left->extract(), s_right = right->extract();
+        std::string::const_iterator it_left = s_left.begin(), it_right = s_right.begin();
+        for(size_t i = 0; i < s.size(); i++) s[i] = data->select(i) ? *it_left++ : *it_right++;
+    }
+    return s;
+}
+
+void WaveletTree::distinct(const size_t i,
+                           const size_t j,
+                           std::vector<std::tuple<char, size_t, size_t>> & symbols) const
+{
+    if(j > data->size()) throw std::out_of_range("WaveletTree distinct out of range");
+    if(j <= i) return;
+    size_t i1 = i > 0 ? data->rank1(i-1) : 0, j1 = data->rank1(j-1);
+    if(is_leaf())
+    {
+        if(j1 > i1) symbols.push_back(std::make_tuple(alphabet_begin[0], i1, j1));
+        if(j - j1 > i - i1) symbols.push_back(std::make_tuple(alphabet_begin[1], i - i1, j - j1));
+    }
+    else
+    {
+        left->distinct(i1, j1, symbols);
+        right->distinct(i - i1, j - j1, symbols);
+    }
+}
+
 WaveletTree::WaveletTree(std::istreambuf_iterator<char> serial_data)
 {
     size_t alphabet_size;
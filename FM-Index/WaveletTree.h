@@ -3,11 +3,19 @@
 
 #include <set>
 #include <string>
+#include <vector>
+#include <tuple>
 
 #include "BitVector.h"
 
 class WaveletTree
 {
+public:
+    struct space_usage // In bytes.
+    {
+        size_t bits, rank_directories, alphabets, nodes;
+    };
+
 private:
     std::unique_ptr<char[]> alphabet_owner;
     const char *alphabet_begin, *alphabet_end;
@@ -20,6 +28,21 @@ private:
 
     void fill_alphabet(const char * s, const size_t len_s);
 
+    void build(std::string & s, const bool clear_s);
+
+    void build(char * s, char * scratch, const size_t n);
+
+    WaveletTree(char * s,
+                char * scratch,
+                const size_t n,
+                const char * alphabet_begin,
+                const char * alphabet_end);
+
+    WaveletTree(const std::string & filename,
+                const size_t max_in_memory,
+                const char * alphabet_begin,
+                const char * alphabet_end);
+
 public:
     WaveletTree(std::string & s,
                 const bool clear_s = true,
@@ -28,6 +51,9 @@ public:
 
     WaveletTree(std::istreambuf_iterator<char> serial_data);
 
+    // The same tree as from the contents of the file, using about max_in_memory bytes beyond the tree itself.
+    static WaveletTree * new_from_file(const std::string & filename, const size_t max_in_memory);
+
     size_t size(void) const;
 
     std::string get_alphabet(void) const;
@@ -36,8 +62,23 @@ public:
 
     size_t rank(const size_t i, const char c) const;
 
+    size_t rank_less(const size_t i, const char c) const; // Number of symbols strictly less than c in [0, i].
+
     char select(const size_t i) const;
 
+    std::pair<char, size_t> select_with_rank(const size_t i) const; // (select(i), rank(i, select(i))) in one descent.
+
+    std::string extract(void) const; // All symbols, in order. Much faster than select for each in turn.
+
+    /* Appends (c, number of c in [0, i), number of c in [0, j)) for each distinct
+       symbol c in [i, j), in increasing order of c. Only visits nodes whose symbols
+       occur in the range so costs O(log alphabet size) per symbol found. */
+    void distinct(const size_t i,
+                  const size_t j,
+                  std::vector<std::tuple<char, size_t, size_t>> & symbols) const;
+
+    space_usage space_breakdown(void) const;
+
     void serialize(std::ostreambuf_iterator<char> serial_data) const;
 };
 
@@ -0,0 +1,36 @@
+#ifndef FM_Index_instrumentation_h
+#define FM_Index_instrumentation_h
+
+#include <cstddef>
+
+/* Counters of the work done by queries, kept per thread so that they need no
+   synchronisation: read them before and after a query on the same thread.
+   They are only updated if the library is compiled with -DFM_INDEX_INSTRUMENT;
+   otherwise FM_INDEX_COUNT compiles to nothing and they stay zero. */
+struct query_counters
+{
+    size_t rank_calls; // BitVector rank0 and rank1.
+    size_t select_calls; // BitVector select (i.e., access) and select1.
+    size_t wavelet_levels; // WaveletTree nodes visited by rank, rank_less, select and select_with_rank.
+    size_t LF_steps; // Steps back through the text, e.g., to extract context or locate.
+    size_t bytes_produced; // Bytes of text (e.g., lines) returned.
+};
+
+inline query_counters & thread_query_counters(void)
+{
+    static thread_local query_counters counters = query_counters();
+    return counters;
+}
+
+inline void reset_thread_query_counters(void)
+{
+    thread_query_counters() = query_counters();
+}
+
+#ifdef FM_INDEX_INSTRUMENT
+#define FM_INDEX_COUNT(counter, n) (thread_query_counters().counter += (n))
+#else
+#define FM_INDEX_COUNT(counter, n) ((void) (n)) // Still uses n, so a variable only counted is not unused.
+#endif
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef FM_Index_misc_h
 #define FM_Index_misc_h
 
+#include <cstdio>
+#include <string>
+
 template <class InputIterator, class Size, class OutputIterator, class UnaryPredicate>
 OutputIterator copy_n_until(InputIterator first, Size n, OutputIterator result, UnaryPredicate pred)
 {
@@ -13,4 +16,16 @@ OutputIterator copy_n_until(InputIterator first, Size n, OutputIterator result,
     return result;
 }
 
+// Removes the named file when it goes out of scope, so scratch files do not outlive an exception.
+class scratch_file
+{
+public:
+    explicit scratch_file(const std::string & filename) : filename(filename) {}
+    ~scratch_file() { std::remove(filename.c_str()); }
+    scratch_file(const scratch_file &) = delete;
+    scratch_file & operator=(const scratch_file &) = delete;
+
+    const std::string filename;
+};
+
 #endif
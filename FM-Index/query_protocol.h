@@ -0,0 +1,114 @@
+#ifndef FM_Index_query_protocol_h
+#define FM_Index_query_protocol_h
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // E.g., macOS, where sockets are set SO_NOSIGPIPE instead.
+#endif
+
+/* The binary protocol spoken by QueryServer and QueryClient over a Unix domain
+   socket. Integers are in native byte order since both ends are on one host.
+
+   Request:  uint32 size of the rest | uint32 id | uint8 op | fields | pattern
+       findn, locate:  pattern is the rest of the frame
+       find_lines:     uint8 new_line_char | uint32 max_context | pattern
+       stats:          no fields
+
+   Response: uint32 size of the rest | uint32 id | uint8 status | body
+       findn:          uint64 count
+       locate:         uint64 n | n uint64 text positions, in increasing order
+       find_lines:     uint32 n | n times (uint32 length | line)
+       stats:          report text
+       error status:   message text
+
+   A client may send any number of requests before reading the responses,
+   which carry the id of their request but may arrive in any order. */
+namespace query_protocol
+{
+    enum op_t : uint8_t { findn = 1, locate = 2, find_lines = 3, stats = 4 };
+
+    enum status_t : uint8_t { ok = 0, error = 1 };
+
+    const size_t header_size = 9; // size, id and op or status.
+    const size_t max_frame_size = 64 << 20;
+
+    template <typename T>
+    void put(std::string & frame, const T x)
+    {
+        frame.append(reinterpret_cast<const char *>(&x), sizeof(T));
+    }
+
+    template <typename T>
+    T get(const char * & p, const char * end)
+    {
+        if(end - p < static_cast<ptrdiff_t>(sizeof(T))) throw std::runtime_error("Truncated query protocol frame");
+        T x;
+        std::memcpy(&x, p, sizeof(T));
+        p += sizeof(T);
+        return x;
+    }
+
+    // Starts a frame; finish_frame fills in its size.
+    inline void start_frame(std::string & frame, const uint32_t id, const uint8_t op_or_status)
+    {
+        put<uint32_t>(frame, 0);
+        put<uint32_t>(frame, id);
+        put<uint8_t>(frame, op_or_status);
+    }
+
+    inline void finish_frame(std::string & frame, const size_t frame_start)
+    {
+        uint32_t size = static_cast<uint32_t>(frame.size() - frame_start - sizeof(uint32_t));
+        std::memcpy(&frame[frame_start], &size, sizeof(size));
+    }
+
+    // False at end of file before any byte was read.
+    inline bool read_fully(const int fd, char * buffer, size_t n)
+    {
+        for(size_t done = 0; done < n; )
+        {
+            ssize_t k = ::read(fd, buffer + done, n - done);
+            if(k < 0 && errno == EINTR) continue;
+            if(k < 0) throw std::system_error(errno, std::generic_category(), "Cannot read from socket");
+            if(k == 0)
+            {
+                if(done == 0) return false;
+                throw std::runtime_error("Truncated query protocol frame");
+            }
+            done += k;
+        }
+        return true;
+    }
+
+    inline void write_fully(const int fd, const char * buffer, size_t n)
+    {
+        for(size_t done = 0; done < n; )
+        {
+            ssize_t k = ::send(fd, buffer + done, n - done, MSG_NOSIGNAL);
+            if(k < 0 && errno == EINTR) continue;
+            if(k < 0) throw std::system_error(errno, std::generic_category(), "Cannot write to socket");
+            done += k;
+        }
+    }
+
+    // Reads one frame (without its size) into frame; false at end of file.
+    inline bool read_frame(const int fd, std::string & frame)
+    {
+        uint32_t size;
+        if(!read_fully(fd, reinterpret_cast<char *>(&size), sizeof(size))) return false;
+        if(size < header_size - sizeof(size) || size > max_frame_size) throw std::runtime_error("Bad query protocol frame size");
+        frame.resize(size);
+        if(!read_fully(fd, &frame[0], size)) throw std::runtime_error("Truncated query protocol frame");
+        return true;
+    }
+}
+
+#endif
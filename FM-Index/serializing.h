@@ -3,6 +3,7 @@
 
 #include <sstream>
 #include <iterator>
+#include <stdexcept>
 
 // I suspect these functions are VERY slow. I'll wait and see if
 // speed becomes annoying before thinking about optimizing.
@@ -24,6 +25,7 @@ void deserialize_from_chars(std::istreambuf_iterator<char> s, T & x)
     char * p = reinterpret_cast<char *>(&x);
     for(size_t i = 0; i < sizeof(T); i++)
     {
+        if(s == std::istreambuf_iterator<char>()) throw std::runtime_error("Serialized data ends early");
         *p = *s;
         ++s; ++p;
     }
@@ -0,0 +1,54 @@
+#ifndef FM_Index_suffix_sorting_h
+#define FM_Index_suffix_sorting_h
+
+#include <vector>
+#include <algorithm>
+
+/* Suffix array of a string over an integer alphabet (a suffix sorts before
+   any longer suffix of which it is a prefix). Prefix doubling in the style of
+   Larsson & Sadakane: only groups of suffixes not yet told apart are sorted
+   again in each round, so strings with short repeats take few rounds. Meant
+   for the cases openbwt's BWT cannot handle; it is slower than that. */
+inline std::vector<size_t> suffix_sort(const std::vector<size_t> & s)
+{
+    const size_t n = s.size();
+    std::vector<size_t> sa(n), rank(n);
+    std::vector<std::pair<size_t, size_t>> keyed; // (sort key, suffix)
+    for(size_t i = 0; i < n; i++) keyed.push_back(std::make_pair(s[i], i));
+    std::sort(keyed.begin(), keyed.end());
+    for(size_t i = 0; i < n; i++) sa[i] = keyed[i].second;
+
+    // rank[i] is the position in sa of the first suffix in i's group.
+    std::vector<std::pair<size_t, size_t>> groups, next_groups; // Unsorted groups [start, end) of sa.
+    for(size_t k = 0, start = 0; k < n; k++)
+    {
+        if(k > 0 && s[sa[k]] != s[sa[k-1]]) start = k;
+        rank[sa[k]] = start;
+        if(k + 1 == n || s[sa[k+1]] != s[sa[k]])
+            if(k > start) groups.push_back(std::make_pair(start, k + 1));
+    }
+
+    for(size_t h = 1; !groups.empty(); h *= 2)
+    {
+        next_groups.clear();
+        for(auto & group : groups)
+        {
+            keyed.clear(); // Now (rank of suffix h further on, suffix)
+            for(size_t k = group.first; k < group.second; k++)
+                keyed.push_back(std::make_pair(sa[k] + h < n ? rank[sa[k] + h] + 1 : 0, sa[k]));
+            std::sort(keyed.begin(), keyed.end());
+            for(size_t k = 0, start = 0; k < keyed.size(); k++)
+            {
+                if(k > 0 && keyed[k].first != keyed[k-1].first) start = k;
+                sa[group.first + k] = keyed[k].second;
+                rank[keyed[k].second] = group.first + start;
+                if(k + 1 == keyed.size() || keyed[k+1].first != keyed[k].first)
+                    if(k > start) next_groups.push_back(std::make_pair(group.first + start, group.first + k + 1));
+            }
+        }
+        groups.swap(next_groups);
+    }
+    return sa;
+}
+
+#endif
@@ -1,12 +1,30 @@
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <system_error>
+#include <thread>
+#include <regex>
 
 #include "gtest/gtest.h"
 #include "BitVector.h"
 #include "WaveletTree.h"
 #include "FMIndex.h"
+#include "WaveletMatrix.h"
+#include "SparseBitVector.h"
+#include "DocumentCollection.h"
+#include "SegmentedIndex.h"
+#include "CachedFMIndex.h"
+#include "TokenFMIndex.h"
+#include "RLFMIndex.h"
+#include "StorageAllocator.h"
+#include "ReplicatedFMIndex.h"
+#include "QueryServer.h"
+#include "QueryClient.h"
+#include "FMIndexHandle.h"
 #include "openbwt.h"
 #include "serializing.h"
+#include "instrumentation.h"
 
 class BitVectorTest : public ::testing::Test
 {
@@ -97,6 +115,59 @@ TEST_F(BitVectorTest, SelectOutOfRange)
     ASSERT_THROW(random3_bv->select(random3_v.size()), std::out_of_range);
 }
 
+TEST_F(BitVectorTest, Select1)
+{
+    ASSERT_EQ(0, one_bv->select1(0));
+    ASSERT_THROW(zero_bv->select1(0), std::out_of_range);
+    size_t k = 0;
+    for(size_t i = 0; i < random3_v.size(); i++)
+        if(random3_v[i]) EXPECT_EQ(i, random3_bv->select1(k++)) << "when i = " << i;
+    ASSERT_THROW(random3_bv->select1(k), std::out_of_range);
+    std::vector<bool> long_v(5000);
+    for(size_t i = 0; i < long_v.size(); i += 7) long_v[i] = true;
+    BitVector long_bv(long_v);
+    for(size_t i = 0; i < long_v.size(); i += 7) EXPECT_EQ(i, long_bv.select1(i / 7));
+    std::vector<bool> whole_superblocks_v(3072); // No partial superblock at the end.
+    for(size_t i = 0; i < whole_superblocks_v.size(); i += 3) whole_superblocks_v[i] = true;
+    BitVector whole_superblocks_bv(whole_superblocks_v);
+    for(size_t i = 0; i < whole_superblocks_v.size(); i += 3) EXPECT_EQ(i, whole_superblocks_bv.select1(i / 3));
+}
+
+TEST_F(BitVectorTest, Select0)
+{
+    ASSERT_EQ(0, zero_bv->select0(0));
+    ASSERT_THROW(one_bv->select0(0), std::out_of_range);
+    std::vector<bool> long_v(5000, true);
+    for(size_t i = 0; i < long_v.size(); i += 7) long_v[i] = false;
+    BitVector long_bv(long_v);
+    for(size_t i = 0; i < long_v.size(); i += 7) EXPECT_EQ(i, long_bv.select0(i / 7));
+    ASSERT_THROW(long_bv.select0(long_v.size() / 7 + 1), std::out_of_range);
+}
+
+TEST(SparseBitVector, Basic)
+{
+    for(size_t n : {1, 10, 1000, 100000})
+        for(size_t step : {1, 3, 64, 1000})
+        {
+            std::vector<size_t> positions;
+            for(size_t i = step / 2; i < n; i += step + i % 5) positions.push_back(i);
+            SparseBitVector sbv(positions, n);
+            ASSERT_EQ(n, sbv.size());
+            ASSERT_EQ(positions.size(), sbv.ones());
+            for(size_t k = 0; k < positions.size(); k++) EXPECT_EQ(positions[k], sbv.select1(k));
+            for(size_t i = 0; i < n; i += 1 + n / 997)
+                EXPECT_EQ(std::upper_bound(positions.begin(), positions.end(), i) - positions.begin(), sbv.rank1(i));
+            std::ostringstream s;
+            sbv.serialize(std::ostreambuf_iterator<char>(s));
+            std::istringstream ss(s.str());
+            SparseBitVector sbv2{std::istreambuf_iterator<char>(ss)};
+            for(size_t k = 0; k < positions.size(); k++) EXPECT_EQ(positions[k], sbv2.select1(k));
+            if(step >= 64 && n >= 100000) EXPECT_LT(sbv.bytes(), n / 8 / 4);
+        }
+    ASSERT_THROW(SparseBitVector(std::vector<size_t>{3, 2}, 5), std::invalid_argument);
+    ASSERT_THROW(SparseBitVector(std::vector<size_t>{5}, 5), std::invalid_argument);
+}
+
 class WaveletTreeTest : public ::testing::Test
 {
 protected:
@@ -261,6 +332,45 @@ TEST_F(WaveletTreeTest, SelectOutOfRange)
     ASSERT_THROW(long_wt->select(long_wt->size()), std::out_of_range);
 }
 
+TEST(WaveletMatrix, Basic)
+{
+    const std::vector<size_t> s{5, 0, 3, 3, 1000, 5, 0, 2, 2, 5, 1, 7, 1000, 3};
+    WaveletMatrix wm(s);
+    ASSERT_EQ(s.size(), wm.size());
+    for(size_t i = 0; i < s.size(); i++)
+    {
+        EXPECT_EQ(s[i], wm.select(i)) << "when i = " << i;
+        for(size_t c : {0, 1, 2, 3, 4, 5, 7, 1000, 1001, 5000})
+            EXPECT_EQ(std::count(s.begin(), s.begin() + i + 1, c), wm.rank(i, c)) << "when i = " << i << " and c = " << c;
+    }
+    std::vector<std::pair<size_t, size_t>> values;
+    wm.distinct(2, 10, values);
+    ASSERT_EQ((std::vector<std::pair<size_t, size_t>>{{0, 1}, {2, 2}, {3, 2}, {5, 2}, {1000, 1}}), values);
+    values.clear();
+    wm.distinct(3, 3, values);
+    ASSERT_TRUE(values.empty());
+    for(size_t lb = 0; lb < s.size(); lb += 3)
+        for(size_t ub = lb; ub <= s.size(); ub += 2)
+            for(std::pair<size_t, size_t> range : {std::make_pair(0, 5000), {1, 4}, {3, 6}, {4, 5}, {6, 1000}, {1001, 2000}, {5, 3}})
+            {
+                std::vector<size_t> expected, reported;
+                for(size_t i = lb; i < ub; i++)
+                    if(s[i] >= range.first && s[i] < range.second) expected.push_back(s[i]);
+                std::sort(expected.begin(), expected.end());
+                EXPECT_EQ(expected.size(), wm.count_range(lb, ub, range.first, range.second));
+                wm.report_range(lb, ub, range.first, range.second, reported);
+                EXPECT_EQ(expected, reported);
+            }
+    ASSERT_THROW(WaveletMatrix(std::vector<size_t>()), std::length_error);
+
+    std::ostringstream ss_out;
+    wm.serialize(std::ostreambuf_iterator<char>(ss_out));
+    std::istringstream ss(ss_out.str());
+    WaveletMatrix wm2{std::istreambuf_iterator<char>(ss)};
+    for(size_t i = 0; i < s.size(); i++)
+        EXPECT_EQ(s[i], wm2.select(i));
+}
+
 class FMIndexTest : public ::testing::Test
 {
 protected:
@@ -351,6 +461,122 @@ TEST_F(FMIndexTest, Find)
     ASSERT_EQ(1, yet_another_fmi->findn(std::string("-de")));
 }
 
+TEST_F(FMIndexTest, FindnBatch)
+{
+    const char * text = "the hello a zzz";
+    std::vector<const char *> patterns{text, text + 4, text + 10, text + 12, text};
+    std::vector<size_t> lengths{3, 5, 1, 3, 0};
+    ASSERT_EQ(17, long_fmi->findn(text, 3));
+    ASSERT_THROW(long_fmi->findn(text, 0), std::length_error);
+    std::vector<size_t> counts(5), lbs(4);
+    ASSERT_THROW(long_fmi->findn_batch(patterns.data(), lengths.data(), 5, counts.data()), std::length_error);
+
+    long_fmi->findn_batch(patterns.data(), lengths.data(), 4, counts.data(), lbs.data());
+    for(size_t i = 0; i < 4; i++)
+    {
+        std::string pattern(patterns[i], lengths[i]);
+        EXPECT_EQ(long_fmi->findn(pattern), counts[i]);
+        EXPECT_EQ(long_fmi->find_interval(pattern).first, lbs[i]);
+    }
+}
+
+TEST_F(FMIndexTest, CountMany)
+{
+    // Many shared suffixes, duplicates, characters absent from the text and patterns longer than it.
+    std::vector<std::string> patterns{"the", "the", "e", "he", "zthe", "the~", "~he", long_str, long_str + "!", "--- the"};
+    for(size_t i = 0; i + 12 < long_str.size(); i += 13)
+        for(size_t len = 1; len < 12; len += 2) patterns.push_back(long_str.substr(i, len));
+    for(size_t k : {0, 1, 3})
+    {
+        if(k > 0) long_fmi->index_kmers(1 << 22, k);
+        std::vector<size_t> counts = long_fmi->count_many(patterns);
+        ASSERT_EQ(patterns.size(), counts.size());
+        for(size_t i = 0; i < patterns.size(); i++) EXPECT_EQ(long_fmi->findn(patterns[i]), counts[i]) << patterns[i];
+    }
+    EXPECT_EQ(std::vector<size_t>({5, 1, 0, 5}), aaaaa_fmi->count_many({"a", "aaaaa", "aaaaaa", "a"}));
+    EXPECT_TRUE(long_fmi->count_many({}).empty());
+    EXPECT_THROW(long_fmi->count_many({"the", ""}), std::length_error);
+}
+
+TEST_F(FMIndexTest, IteratorRanges)
+{
+    std::string text(long_str);
+    FMIndex moved(std::move(text));
+    EXPECT_TRUE(text.empty());
+    EXPECT_EQ(long_str.size(), moved.size());
+
+    std::vector<char> pattern{'t', 'h', 'e'};
+    EXPECT_EQ(long_fmi->findn("the"), moved.findn(pattern.begin(), pattern.end()));
+    EXPECT_EQ(long_fmi->find_interval("the"), moved.find_interval(pattern.begin(), pattern.end()));
+    EXPECT_EQ(long_fmi->locate("the"), moved.locate(pattern.begin(), pattern.end()));
+    EXPECT_EQ(long_fmi->find_lines("the"), moved.find_lines(pattern.begin(), pattern.end()));
+    std::list<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> matches;
+    ASSERT_EQ(long_fmi->findn("the"), moved.find(matches, pattern.begin(), pattern.end()));
+    std::vector<std::string> after, expected_after; // The text following each match.
+    for(auto & match : matches)
+    {
+        std::string context;
+        FMIndex::const_iterator it = match.first;
+        for(size_t i = 0; i < 10 && !it.at_end(); i++) context += *it++;
+        after.push_back(context);
+    }
+    for(size_t i = long_str.find("the"); i != std::string::npos; i = long_str.find("the", i + 1))
+        expected_after.push_back(long_str.substr(i + 3, 10));
+    std::sort(after.begin(), after.end());
+    std::sort(expected_after.begin(), expected_after.end());
+    EXPECT_EQ(expected_after, after);
+
+    const char * part = long_str.c_str() + 100; // Part of a larger string.
+    EXPECT_EQ(long_fmi->findn(long_str.substr(100, 7)), moved.findn(part, part + 7));
+    EXPECT_EQ(0, moved.findn(pattern.rbegin(), pattern.rend())); // "eht"
+    ASSERT_THROW(moved.findn(pattern.begin(), pattern.begin()), std::length_error);
+
+    FMIndex zeros{std::string(test_str)};
+    EXPECT_EQ(test_fmi->locate(std::string{'\0'}), zeros.locate(test_str.begin(), test_str.begin() + 1));
+}
+
+TEST_F(FMIndexTest, FromBufferAndFile)
+{
+    std::unique_ptr<FMIndex> fmi(FMIndex::new_from_buffer(long_str.data(), long_str.size()));
+    ASSERT_EQ(long_str, get_text(*fmi));
+    ASSERT_EQ(17, fmi->findn("the"));
+    ASSERT_EQ(long_fmi->locate("the"), fmi->locate("the"));
+    ASSERT_THROW(FMIndex::new_from_buffer(long_str.data(), 0), std::length_error);
+    fmi.reset(FMIndex::new_from_buffer(long_str.data(), long_str.size(), 4, true));
+    ASSERT_EQ(long_fmi->suffix_array(), fmi->suffix_array());
+    ASSERT_EQ(long_fmi->find_lines("the", ','), fmi->find_lines("the", ','));
+
+    const std::string filename = "from_file_test.txt";
+    {
+        std::ofstream f(filename, std::ios::binary);
+        f << long_str;
+    }
+    fmi.reset(FMIndex::new_from_file(filename, 0));
+    std::remove(filename.c_str());
+    ASSERT_EQ(long_str, get_text(*fmi));
+    ASSERT_EQ(17, fmi->findn("the"));
+    ASSERT_THROW(FMIndex::new_from_file(filename), std::system_error);
+    ASSERT_THROW(FMIndex::new_from_serialized_file(filename), std::system_error);
+}
+
+TEST_F(FMIndexTest, FromFileExternal)
+{
+    const std::string filename = "from_file_external_test.txt";
+    {
+        std::ofstream f(filename, std::ios::binary);
+        f << long_str;
+    }
+    const std::vector<size_t> SA = long_fmi->suffix_array();
+    for(size_t memory_budget : {50 * 40, 50 * 1000, 1 << 30})
+    {
+        std::unique_ptr<FMIndex> fmi(FMIndex::new_from_file_external(filename, ".", memory_budget));
+        ASSERT_EQ(long_str, get_text(*fmi));
+        ASSERT_EQ(SA, fmi->suffix_array()); // With the text, determines both BWTs.
+        ASSERT_EQ(long_fmi->locate("the"), fmi->locate("the"));
+    }
+    std::remove(filename.c_str());
+}
+
 TEST_F(FMIndexTest, Scan)
 {
     long_fmi->find(matches, std::string("individual"));
@@ -360,6 +586,855 @@ TEST_F(FMIndexTest, Scan)
     ASSERT_EQ(long_str, get_text(*long_fmi));
 }
 
+TEST_F(FMIndexTest, FindSlice)
+{
+    long_fmi->find(matches, std::string("the"));
+    std::vector<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> all(matches.begin(), matches.end());
+    std::list<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> slice;
+    ASSERT_EQ(17, long_fmi->find_slice(slice, std::string("the"), 5, 4));
+    ASSERT_EQ(4, slice.size());
+    size_t i = 5;
+    for(auto & match : slice)
+    {
+        EXPECT_EQ(scan_back(all[i].second, 10), scan_back(match.second, 10)) << "when i = " << i;
+        EXPECT_EQ(scan_forward(all[i].first, 10), scan_forward(match.first, 10)) << "when i = " << i;
+        i++;
+    }
+    slice.clear();
+    ASSERT_EQ(17, long_fmi->find_slice(slice, std::string("the"), 15, 10));
+    ASSERT_EQ(2, slice.size());
+    slice.clear();
+    ASSERT_EQ(17, long_fmi->find_slice(slice, std::string("the"), 17, 10));
+    ASSERT_EQ(0, slice.size());
+    ASSERT_EQ(0, long_fmi->find_slice(slice, std::string("xyz"), 0, 10));
+
+    // Each match's context before and after must belong to the same occurrence.
+    ASSERT_EQ(5, aaaaa_fmi->find_slice(slice, std::string("a"), 0, 5));
+    for(auto & match : slice)
+    {
+        size_t n_before = 0, n_after = 0;
+        for(FMIndex::const_reverse_iterator it = match.second; !it.at_end(); ++it) n_before++;
+        for(FMIndex::const_iterator it = match.first; !it.at_end(); ++it) n_after++;
+        EXPECT_EQ(4, n_before + n_after);
+    }
+
+    std::list<std::string> lines = long_fmi->find_lines(std::string("the"));
+    std::list<std::string> paged;
+    for(size_t offset = 0; offset < 17; offset += 5)
+        paged.splice(paged.end(), long_fmi->find_lines_slice(std::string("the"), offset, 5));
+    ASSERT_EQ(lines, paged);
+
+    // Also where matches have the same max_context characters before them.
+    FMIndex ties(std::string("ababbbbabababaaa"));
+    for(size_t max_context = 0; max_context < 8; max_context++)
+        EXPECT_EQ(ties.find_lines(std::string("ab"), '\n', max_context),
+                  ties.find_lines_slice(std::string("ab"), 0, 5, '\n', max_context)) << "with max_context " << max_context;
+}
+
+TEST_F(FMIndexTest, Locate)
+{
+    std::vector<size_t> SA = long_fmi->suffix_array();
+    ASSERT_EQ(long_str.size() + 1, SA.size());
+    for(size_t i = 1; i < SA.size(); i++)
+        EXPECT_LT(long_str.substr(SA[i-1]), long_str.substr(SA[i])) << "when i = " << i;
+    for(size_t i = 0; i < SA.size(); i++)
+        EXPECT_EQ(SA[i], long_fmi->locate(i)) << "when i = " << i;
+
+    std::vector<size_t> positions = long_fmi->locate(std::string("the"));
+    std::sort(positions.begin(), positions.end());
+    std::vector<size_t> expected;
+    for(size_t i = long_str.find("the"); i != std::string::npos; i = long_str.find("the", i+1)) expected.push_back(i);
+    ASSERT_EQ(expected, positions);
+    ASSERT_TRUE(long_fmi->locate(std::string("xyz")).empty());
+
+    FMIndex unsampled(long_str, 0);
+    ASSERT_THROW(unsampled.locate(0), std::logic_error);
+}
+
+TEST_F(FMIndexTest, InRange)
+{
+    FMIndex indexed(long_str);
+    indexed.index_positions();
+    ASSERT_TRUE(indexed.has_position_index());
+    ASSERT_FALSE(long_fmi->has_position_index());
+    for(const std::string pattern : {"the", "e", "unknown", "xyz"})
+        for(size_t begin = 0; begin < long_str.size(); begin += 211)
+            for(size_t end : {begin, begin + 2, begin + 300, begin + 1000, long_str.size() + 5})
+            {
+                std::vector<size_t> expected;
+                for(size_t i = long_str.find(pattern, begin); i != std::string::npos && i + pattern.size() <= end; i = long_str.find(pattern, i + 1))
+                    expected.push_back(i);
+                EXPECT_EQ(expected.size(), indexed.count_in_range(pattern, begin, end));
+                EXPECT_EQ(expected, indexed.locate_in_range(pattern, begin, end));
+                EXPECT_EQ(expected.size(), long_fmi->count_in_range(pattern, begin, end));
+                EXPECT_EQ(expected, long_fmi->locate_in_range(pattern, begin, end));
+            }
+
+    // The position index also answers locate, even without samples, and is serialized.
+    FMIndex unsampled(long_str, 0);
+    unsampled.index_positions();
+    std::vector<size_t> SA = long_fmi->suffix_array();
+    for(size_t i = 0; i < SA.size(); i++) EXPECT_EQ(SA[i], unsampled.locate(i));
+    std::ostringstream s;
+    unsampled.serialize(std::ostreambuf_iterator<char>(s));
+    std::istringstream ss(s.str());
+    FMIndex unsampled2{std::istreambuf_iterator<char>(ss)};
+    ASSERT_TRUE(unsampled2.has_position_index());
+    ASSERT_EQ(indexed.locate_in_range("the", 100, 2000), unsampled2.locate_in_range("the", 100, 2000));
+    EXPECT_LT(0, unsampled2.space_breakdown().position_index);
+}
+
+TEST_F(FMIndexTest, Reconstruct)
+{
+    std::string text;
+    for(auto & fmi_s : std::vector<std::pair<FMIndex *, std::string>>{{zero_fmi, zero_str}, {aaaaa_fmi, aaaaa_str}, {test_fmi, test_str}, {long_fmi, long_str}})
+        for(size_t n_threads : {1, 3, 8})
+        {
+            fmi_s.first->reconstruct(text, n_threads);
+            EXPECT_EQ(fmi_s.second, text) << "with " << n_threads << " threads";
+        }
+    std::string longer;
+    while(longer.size() < 100000) longer += long_str;
+    for(size_t SA_sample_rate : {0, 1, 7, 32})
+    {
+        FMIndex fmi(longer, SA_sample_rate);
+        fmi.reconstruct(text, 5);
+        EXPECT_EQ(longer, text) << "with SA sample rate " << SA_sample_rate;
+    }
+    FMIndex whole_superblocks(longer.substr(0, 1023), 1); // 1024 rows, every one of them sampled.
+    whole_superblocks.reconstruct(text, 3);
+    EXPECT_EQ(longer.substr(0, 1023), text);
+}
+
+TEST_F(FMIndexTest, ParallelQueries)
+{
+    std::list<std::string> lines = long_fmi->find_lines("e", ' ', 20);
+    std::vector<size_t> positions = long_fmi->locate("e");
+    std::list<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> matches;
+    long_fmi->find(matches, "th");
+    ASSERT_LT(40, lines.size());
+
+    FMIndex::set_thread_query_parallelism(4, 10);
+    EXPECT_EQ(lines, long_fmi->find_lines("e", ' ', 20));
+    EXPECT_EQ(positions, long_fmi->locate("e"));
+    std::list<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> parallel_matches;
+    EXPECT_EQ(matches.size(), long_fmi->find(parallel_matches, "th"));
+    // Iterators into the text at the same places (no two matches have the same max_context characters either side).
+    auto contexts = [](const std::list<std::pair<FMIndex::const_iterator, FMIndex::const_reverse_iterator>> & matches)
+    {
+        std::vector<std::string> contexts;
+        for(auto & match : matches)
+        {
+            std::string after, before;
+            FMIndex::const_iterator it = match.first;
+            for(size_t i = 0; i < 5 && !it.at_end(); i++) after += *it++;
+            FMIndex::const_reverse_iterator rit = match.second;
+            for(size_t i = 0; i < 5 && !rit.at_end(); i++) before += *rit++;
+            contexts.push_back(before + "|" + after);
+        }
+        return contexts;
+    };
+    EXPECT_EQ(contexts(matches), contexts(parallel_matches));
+
+    // The same order even where matches have the same max_context characters before them.
+    FMIndex ties(std::string("ababbbbabababaaa"));
+    for(size_t max_context = 0; max_context < 8; max_context++)
+    {
+        FMIndex::set_thread_query_parallelism(1);
+        std::list<std::string> serial = ties.find_lines(std::string("ab"), '\n', max_context);
+        FMIndex::set_thread_query_parallelism(4, 1);
+        EXPECT_EQ(serial, ties.find_lines(std::string("ab"), '\n', max_context)) << "with max_context " << max_context;
+    }
+    FMIndex::set_thread_query_parallelism(4, 10);
+
+    std::thread other([&]() { EXPECT_EQ(positions, long_fmi->locate("e")); }); // Settings are per thread.
+    other.join();
+    ASSERT_THROW(FMIndex(long_str, 0).locate("e"), std::logic_error);
+    FMIndex::set_thread_query_parallelism(1);
+}
+
+TEST_F(FMIndexTest, Pattern)
+{
+    const std::vector<std::pair<std::string, std::string>> patterns{ // (Pattern, equivalent std::regex)
+        {"th?", "th."}, {"h[aeiou]{1,2}m", "h[aeiou]{1,2}m"}, {"[^a-z ]", "[^a-z ]"}, {"?n?", ".n."},
+        {"o{0,2}n", "o{0,2}n"}, {"[A-Z]", "[A-Z]"}, {"\\?", "\\?"}, {"[-]{3}", "-{3}"}};
+    for(auto & p : patterns)
+    {
+        size_t expected = 0;
+        std::regex r(p.second);
+        for(size_t i = 0; i < long_str.size(); i++)
+            for(size_t len = 1; len <= 4 && i + len <= long_str.size(); len++)
+                if(std::regex_match(long_str.substr(i, len), r)) expected++;
+        EXPECT_EQ(expected, long_fmi->findn(Pattern(p.first))) << "when pattern = " << p.first;
+    }
+
+    std::map<std::string, size_t> matches;
+    ASSERT_EQ(17 + 1, long_fmi->find_distinct(matches, Pattern("THE", true)));
+    ASSERT_EQ((std::map<std::string, size_t>{{"The", 1}, {"the", 17}}), matches);
+    ASSERT_EQ(18, long_fmi->find_lines(Pattern("tHe", true)).size());
+    ASSERT_THROW(Pattern("[abc"), std::invalid_argument);
+    ASSERT_THROW(Pattern("a{2,1}"), std::invalid_argument);
+    ASSERT_THROW(long_fmi->findn(Pattern("")), std::length_error);
+}
+
+TEST_F(FMIndexTest, SMEMs)
+{
+    const std::string query("the universe of the humility of Christian love");
+    std::vector<FMIndex::SMEM> smems = long_fmi->smems(query);
+    // Check against the definition, slowly.
+    std::vector<std::pair<size_t, size_t>> expected;
+    for(size_t i = 0; i < query.size(); i++)
+    {
+        size_t j = i;
+        while(j < query.size() && long_str.find(query.substr(i, j + 1 - i)) != std::string::npos) j++;
+        if(j > i && (i == 0 || long_str.find(query.substr(i - 1, j + 1 - i)) == std::string::npos) &&
+           (expected.empty() || j > expected.back().second)) expected.push_back(std::make_pair(i, j));
+    }
+    ASSERT_EQ(expected.size(), smems.size());
+    for(size_t i = 0; i < smems.size(); i++)
+    {
+        EXPECT_EQ(expected[i], std::make_pair(smems[i].begin, smems[i].end));
+        EXPECT_EQ(long_fmi->findn(query.substr(smems[i].begin, smems[i].end - smems[i].begin)), smems[i].ub - smems[i].lb);
+    }
+
+    for(auto & smem : long_fmi->smems(query, 10))
+        EXPECT_LE(10, smem.end - smem.begin);
+    for(auto & smem : long_fmi->smems(query, 1, 3))
+        EXPECT_LE(3, smem.ub - smem.lb);
+}
+
+TEST_F(FMIndexTest, Repeats)
+{
+    // Brute force: the substrings occurring at least twice followed by different characters (or the end).
+    const std::string part = long_str.substr(0, 300);
+    for(const std::string * text : {&part, &test_str, &aaaaa_str, &yet_another_str})
+    {
+        std::map<std::string, std::set<int>> followers;
+        for(size_t i = 0; i < text->size(); i++)
+            for(size_t j = i + 1; j <= text->size(); j++)
+                followers[text->substr(i, j - i)].insert(j < text->size() ? static_cast<unsigned char>((*text)[j]) : -1);
+        FMIndex fmi(*text);
+        std::map<std::string, size_t> expected, expected_long;
+        for(auto & f : followers)
+        {
+            size_t n = fmi.findn(f.first);
+            if(n < 2 || f.second.size() < 2) continue;
+            expected[f.first] = n;
+            if(f.first.size() >= 3 && n >= 3) expected_long[f.first] = n;
+        }
+
+        for(bool parallel : {false, true})
+        {
+            std::map<std::string, size_t> found, found_long;
+            for(auto & r : fmi.right_maximal_repeats(1, 2, parallel))
+            {
+                found[r.substring] = r.ub - r.lb;
+                EXPECT_EQ(fmi.find_interval(r.substring), std::make_pair(r.lb, r.ub));
+            }
+            for(auto & r : fmi.right_maximal_repeats(3, 3, parallel)) found_long[r.substring] = r.ub - r.lb;
+            EXPECT_EQ(expected, found);
+            EXPECT_EQ(expected_long, found_long);
+
+            // The most frequent, ties broken by the strings.
+            std::vector<std::pair<size_t, std::string>> by_frequency;
+            for(auto & e : expected)
+                if(e.first.size() >= 3) by_frequency.push_back(std::make_pair(e.second, e.first));
+            std::sort(by_frequency.begin(), by_frequency.end(),
+                      [](const std::pair<size_t, std::string> & a, const std::pair<size_t, std::string> & b)
+                      { return a.first != b.first ? a.first > b.first : a.second < b.second; });
+            std::vector<FMIndex::repeat> top = fmi.frequent_substrings(5, 3, parallel);
+            ASSERT_EQ(std::min<size_t>(5, by_frequency.size()), top.size());
+            for(size_t i = 0; i < top.size(); i++)
+            {
+                EXPECT_EQ(by_frequency[i].second, top[i].substring);
+                EXPECT_EQ(by_frequency[i].first, top[i].ub - top[i].lb);
+            }
+        }
+    }
+    EXPECT_TRUE(long_fmi->frequent_substrings(0).empty());
+    FMIndex::repeat top = long_fmi->frequent_substrings(1, 3, true)[0];
+    EXPECT_LE(long_fmi->findn("the"), top.ub - top.lb);
+    EXPECT_EQ(top.ub - top.lb, long_fmi->findn(top.substring));
+}
+
+TEST_F(FMIndexTest, TopCompletions)
+{
+    // Brute force: count what follows each occurrence up to the delimiter.
+    auto completions = [this](const std::string & prefix, const char delimiter, const size_t max_length)
+    {
+        std::map<std::string, size_t> counts;
+        for(size_t i = long_str.find(prefix); i != std::string::npos; i = long_str.find(prefix, i + 1))
+        {
+            size_t end = std::min(long_str.find(delimiter, i + prefix.size()), i + prefix.size() + max_length);
+            counts[long_str.substr(i, end - i)]++;
+        }
+        return counts;
+    };
+    for(auto & query : std::vector<std::tuple<std::string, char, size_t>>{std::make_tuple("th", ' ', 100),
+                                                                         std::make_tuple("u", ' ', 100),
+                                                                         std::make_tuple("the ", ' ', 100),
+                                                                         std::make_tuple("spirit", ' ', 100),
+                                                                         std::make_tuple("e", ',', 3),
+                                                                         std::make_tuple("W", '\n', 0)})
+    {
+        std::map<std::string, size_t> expected = completions(std::get<0>(query), std::get<1>(query), std::get<2>(query));
+        std::vector<size_t> expected_counts;
+        for(auto & e : expected) expected_counts.push_back(e.second);
+        std::sort(expected_counts.rbegin(), expected_counts.rend());
+        for(size_t k : {1, 3, 10, 1000})
+        {
+            std::vector<std::pair<std::string, size_t>> top = long_fmi->top_completions(std::get<0>(query), k, std::get<1>(query), std::get<2>(query));
+            ASSERT_EQ(std::min(k, expected.size()), top.size()) << std::get<0>(query);
+            std::set<std::string> seen;
+            for(size_t i = 0; i < top.size(); i++)
+            {
+                EXPECT_EQ(expected_counts[i], top[i].second) << top[i].first; // Ties may come in any order.
+                EXPECT_EQ(expected[top[i].first], top[i].second) << top[i].first;
+                EXPECT_TRUE(seen.insert(top[i].first).second);
+            }
+        }
+    }
+    EXPECT_TRUE(long_fmi->top_completions("zzz", 5).empty());
+    EXPECT_TRUE(long_fmi->top_completions("the", 0).empty());
+    EXPECT_THROW(long_fmi->top_completions("", 5), std::length_error);
+    std::vector<std::pair<std::string, size_t>> top = long_fmi->top_completions("hum", 1);
+    ASSERT_EQ(1, top.size());
+    EXPECT_EQ(std::make_pair(std::string("humility"), size_t(2)), top[0]);
+}
+
+TEST_F(FMIndexTest, KmerTable)
+{
+    std::vector<std::string> patterns{"Chris", "the", "th", "t", " of ", "\n", "zzzz", "iq", "thee~", "~the"};
+    for(size_t i = 0; i + 8 < long_str.size(); i += 97)
+        for(size_t len = 1; len < 8; len++) patterns.push_back(long_str.substr(i, len));
+    std::vector<std::pair<size_t, size_t>> intervals;
+    std::vector<std::list<std::string>> lines;
+    for(auto & pattern : patterns)
+    {
+        intervals.push_back(long_fmi->find_interval(pattern));
+        lines.push_back(long_fmi->find_lines(pattern));
+    }
+
+    long_fmi->index_kmers(16, 3);
+    ASSERT_EQ(0, long_fmi->kmer_table_length());
+    long_fmi->index_kmers(1 << 22, 3);
+    ASSERT_EQ(3, long_fmi->kmer_table_length());
+    std::ostringstream s;
+    long_fmi->serialize(std::ostreambuf_iterator<char>(s));
+    std::istringstream ss(s.str());
+    FMIndex fmi{std::istreambuf_iterator<char>(ss)};
+    ASSERT_EQ(3, fmi.kmer_table_length());
+    for(size_t i = 0; i < patterns.size(); i++)
+    {
+        std::pair<size_t, size_t> interval = long_fmi->find_interval(patterns[i]);
+        if(intervals[i].second <= intervals[i].first) EXPECT_LE(interval.second, interval.first);
+        else EXPECT_EQ(intervals[i], interval);
+        EXPECT_EQ(interval, fmi.find_interval(patterns[i]));
+        EXPECT_EQ(lines[i], long_fmi->find_lines(patterns[i]));
+    }
+
+    aaaaa_fmi->index_kmers(1 << 10);
+    EXPECT_EQ(5, aaaaa_fmi->findn("a"));
+    EXPECT_EQ(1, aaaaa_fmi->findn("aaaaa"));
+    EXPECT_EQ(0, aaaaa_fmi->findn("aaaaaa"));
+}
+
+TEST_F(FMIndexTest, Instrumentation)
+{
+    FMIndex::space_usage space = long_fmi->space_breakdown();
+    EXPECT_LE(long_str.size() / 8, space.BWT.bits); // At least the root's bit per character.
+    EXPECT_EQ(space.BWT.bits, space.BWTr.bits); // Same symbols so same shape.
+    EXPECT_EQ(std::set<char>(long_str.begin(), long_str.end()).size(), space.BWT.alphabets); // Only the root's.
+    EXPECT_LT(0, space.SA_samples);
+    EXPECT_EQ(0, space.kmer_table);
+    long_fmi->index_kmers(1 << 20, 2);
+    EXPECT_LT(0, long_fmi->space_breakdown().kmer_table);
+    EXPECT_LT(space.BWT.bits + space.BWTr.bits + space.SA_samples, space.total());
+
+    reset_thread_query_counters();
+    std::list<std::string> lines = long_fmi->find_lines("the");
+    query_counters counters = thread_query_counters();
+    size_t bytes = 0;
+    for(auto & line : lines) bytes += line.size();
+#ifdef FM_INDEX_INSTRUMENT
+    EXPECT_LT(0, counters.rank_calls);
+    EXPECT_LT(0, counters.select_calls);
+    EXPECT_LE(counters.LF_steps, counters.wavelet_levels);
+    EXPECT_LE(bytes - 3 * lines.size(), counters.LF_steps); // Each context character takes a step.
+    EXPECT_EQ(bytes, counters.bytes_produced);
+#else
+    EXPECT_EQ(0, counters.rank_calls + counters.select_calls + counters.wavelet_levels + counters.LF_steps);
+    EXPECT_EQ(0, counters.bytes_produced);
+    EXPECT_LT(0, bytes);
+#endif
+}
+
+TEST_F(FMIndexTest, Merge)
+{
+    const FMIndex * pairs[][2] = {{long_fmi, test_fmi}, {test_fmi, long_fmi}, {aaaaa_fmi, aaaaa_fmi},
+                                  {zero_fmi, extra_fmi}, {yet_another_fmi, yet_another_fmi}};
+    for(auto & pair : pairs)
+    {
+        std::unique_ptr<FMIndex> merged(FMIndex::merge(*pair[0], *pair[1]));
+        std::string s = get_text(*pair[0]) + get_text(*pair[1]);
+        FMIndex expected(s);
+        ASSERT_EQ(s, get_text(*merged));
+        ASSERT_EQ(expected.suffix_array(), merged->suffix_array());
+        for(size_t i = 0; i + 3 <= s.size(); i++)
+            EXPECT_EQ(expected.findn(s.substr(i, 3)), merged->findn(s.substr(i, 3)));
+        ASSERT_EQ(expected.find_lines("e"), merged->find_lines("e"));
+    }
+}
+
+TEST_F(FMIndexTest, MergeRepetitive)
+{
+    // Small alphabets and periodic texts, where many suffixes of a are prefixes of others.
+    std::vector<std::string> texts{"a", "b", "aa", "ab", "ba", "aaaaaaa", "abababab", "abaababaabaab", "aabaabaab"};
+    unsigned int x = 1;
+    for(size_t len = 1; len < 40; len += 3)
+    {
+        std::string s;
+        for(size_t i = 0; i < len; i++)
+        {
+            x = x * 1103515245 + 12345;
+            s.push_back("aab"[(x >> 16) % 3]);
+        }
+        texts.push_back(s);
+    }
+    for(auto & a : texts)
+        for(auto & b : texts)
+        {
+            FMIndex a_fmi(a, 1), b_fmi(b, 1);
+            std::unique_ptr<FMIndex> merged(FMIndex::merge(a_fmi, b_fmi));
+            FMIndex expected(a + b, 1);
+            ASSERT_EQ(expected.suffix_array(), merged->suffix_array()) << a << " " << b;
+            ASSERT_EQ(a + b, get_text(*merged));
+        }
+
+    std::vector<std::unique_ptr<FMIndex>> fmis;
+    std::vector<const FMIndex *> to_merge;
+    std::string s;
+    for(size_t i = 0; i < 5; i++)
+    {
+        fmis.push_back(std::unique_ptr<FMIndex>(new FMIndex(texts[texts.size() - 1 - i])));
+        to_merge.push_back(fmis.back().get());
+        s += texts[texts.size() - 1 - i];
+    }
+    std::unique_ptr<FMIndex> merged(FMIndex::merge(to_merge));
+    ASSERT_EQ(FMIndex(s).suffix_array(), merged->suffix_array());
+    ASSERT_THROW(FMIndex::merge(std::vector<const FMIndex *>{to_merge[0]}), std::invalid_argument);
+}
+
+TEST(DocumentCollection, Basic)
+{
+    DocumentCollection dc(std::vector<std::string>{"hello world", "say hello", "goodbye", "", "hello hello"});
+    ASSERT_EQ(5, dc.n_documents());
+    ASSERT_EQ(std::make_pair(1UL, 4UL), dc.document_of(16));
+    ASSERT_EQ(22, dc.document_start(2));
+    ASSERT_EQ(30, dc.document_start(3));
+    ASSERT_EQ((std::vector<std::pair<size_t, size_t>>{{0, 1}, {1, 1}, {4, 2}}), dc.list_documents("hello"));
+    ASSERT_EQ(3, dc.document_frequency("hello"));
+    ASSERT_EQ(1, dc.document_frequency("bye"));
+    ASSERT_EQ(0, dc.document_frequency("worldsay"));
+    std::vector<std::pair<size_t, size_t>> matches = dc.locate("hello");
+    std::sort(matches.begin(), matches.end());
+    ASSERT_EQ((std::vector<std::pair<size_t, size_t>>{{0, 0}, {1, 4}, {4, 0}, {4, 6}}), matches);
+
+    std::ostringstream s;
+    dc.serialize(std::ostreambuf_iterator<char>(s));
+    std::istringstream ss(s.str());
+    DocumentCollection dc2{std::istreambuf_iterator<char>(ss)};
+    ASSERT_EQ(dc.list_documents("o"), dc2.list_documents("o"));
+    ASSERT_EQ(dc.n_documents(), dc2.n_documents());
+
+    ASSERT_THROW(DocumentCollection(std::vector<std::string>{"one", std::string("t\0wo", 4)}), std::invalid_argument);
+    ASSERT_THROW(DocumentCollection(std::vector<std::string>{"one\ntwo"}, '\n'), std::invalid_argument);
+    ASSERT_THROW(dc.locate(std::string("world\0say", 9)), std::invalid_argument);
+    ASSERT_THROW(dc.document_frequency(std::string("world\0", 6)), std::invalid_argument);
+    ASSERT_THROW(dc.serialize_to_file("/nonexistent/directory/dc"), std::system_error);
+    ASSERT_THROW(DocumentCollection::new_from_serialized_file("/nonexistent/directory/dc"), std::system_error);
+}
+
+TEST(DocumentCollection, WholeSuperblocks)
+{
+    // 64 documents of 16 bytes with their separators: 1024 bits of doc_starts, no partial superblock.
+    std::vector<std::string> documents;
+    for(size_t i = 0; i < 64; i++) documents.push_back("document " + std::to_string(100000 + i));
+    DocumentCollection dc(documents, '\n', 1);
+    ASSERT_EQ(64, dc.n_documents());
+    for(size_t i = 0; i < documents.size(); i++)
+    {
+        EXPECT_EQ(16 * i, dc.document_start(i)) << "when i = " << i;
+        EXPECT_EQ(std::make_pair(i, 3UL), dc.document_of(16 * i + 3)) << "when i = " << i;
+    }
+}
+
+TEST(SegmentedIndex, AppendAndCompact)
+{
+    const std::vector<std::string> lines{"the cat sat", "on the mat", "the end", "or is it", "not the end"};
+    SegmentedIndex si('\n', 2, 8);
+    for(auto & line : lines) si.append(line);
+    ASSERT_EQ(5, si.n_segments());
+    ASSERT_EQ(4, si.findn("the"));
+    std::list<std::string> found = si.find_lines("the");
+    found.sort();
+    ASSERT_EQ((std::list<std::string>{"not the end", "on the mat", "the cat sat", "the end"}), found);
+
+    std::thread compactor([&si]() { while(si.compact()); });
+    for(size_t i = 0; i < 100; i++)
+        EXPECT_EQ(4, si.findn("the"));
+    compactor.join();
+    ASSERT_LT(si.n_segments(), 5);
+    ASSERT_EQ(4, si.findn("the"));
+    ASSERT_EQ(0, si.findn("matthe"));
+    found = si.find_lines("the");
+    found.sort();
+    ASSERT_EQ((std::list<std::string>{"not the end", "on the mat", "the cat sat", "the end"}), found);
+}
+
+TEST(SegmentedIndex, CompactionKeepsTextOrder)
+{
+    // With fanout 2 and min_segment_size 8, the long line is in a higher tier than the short ones.
+    SegmentedIndex si('\n', 2, 8);
+    const std::vector<std::string> lines{"ab", "a line long enough for a higher tier", "cd", "ef"};
+    auto text = [&si]()
+    {
+        std::string all, segment;
+        std::shared_ptr<const SegmentedIndex::segment_list> segments = si.snapshot();
+        for(auto & fmi : *segments)
+        {
+            fmi->reconstruct(segment, 1);
+            all += segment;
+        }
+        return all;
+    };
+    si.append(lines[0]);
+    si.append(lines[1]);
+    si.append(lines[2]);
+    ASSERT_FALSE(si.compact()); // The two short segments are not neighbours.
+    si.append(lines[3]);
+    ASSERT_TRUE(si.compact());
+    ASSERT_EQ(3, si.n_segments());
+    ASSERT_EQ("ab\na line long enough for a higher tier\ncd\nef\n", text());
+}
+
+TEST(CachedFMIndex, Basic)
+{
+    std::shared_ptr<const FMIndex> fmi = std::make_shared<const FMIndex>("the cat sat\non the mat\nthe end\n");
+    CachedFMIndex cache(fmi, 1 << 16, 4);
+    ASSERT_EQ(3, cache.findn("the"));
+    ASSERT_EQ(3, cache.findn("the"));
+    ASSERT_EQ(fmi->find_interval("at"), cache.find_interval("at"));
+    ASSERT_EQ(0, cache.findn("dog"));
+    ASSERT_EQ(0, cache.findn("dog"));
+    std::list<std::string> lines = cache.find_lines("at");
+    ASSERT_EQ(fmi->find_lines("at"), lines);
+    ASSERT_EQ(lines, cache.find_lines("at"));
+    ASSERT_EQ(fmi->find_lines("at", ' '), cache.find_lines("at", ' '));
+    CachedFMIndex::statistics st = cache.stats();
+    EXPECT_EQ(3, st.hits);
+    EXPECT_EQ(5, st.misses);
+    EXPECT_EQ(5, st.n_entries);
+    EXPECT_LE(st.bytes, 1 << 16);
+
+    // One-off queries should not displace a popular one once the cache is full.
+    CachedFMIndex small(fmi, 1024, 1);
+    for(size_t i = 0; i < 5; i++) small.findn("the");
+    for(char c = 'a'; c <= 'z'; c++) small.findn(std::string("t") + c + "e");
+    st = small.stats();
+    EXPECT_LT(0, st.rejections);
+    EXPECT_LE(st.bytes, 1024);
+    size_t hits = st.hits;
+    small.findn("the");
+    EXPECT_EQ(hits + 1, small.stats().hits);
+
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < 4; t++)
+        threads.push_back(std::thread([&cache, &fmi]()
+        {
+            for(size_t i = 0; i < 200; i++)
+            {
+                std::string pattern = std::string("the cat sat").substr(i % 7, 1 + i % 5);
+                EXPECT_EQ(fmi->findn(pattern), cache.findn(pattern));
+            }
+        }));
+    for(auto & thread : threads) thread.join();
+}
+
+TEST(TokenFMIndex, Basic)
+{
+    // Tokens from a large, sparse alphabet, with plenty of repeats.
+    std::vector<uint32_t> text;
+    for(uint32_t i = 0; i < 2000; i++) text.push_back(((i * i) % 37) * 100000007u % 4000000000u);
+    TokenFMIndex<uint32_t> fmi(text, 4);
+    ASSERT_EQ(text.size(), fmi.size());
+    ASSERT_EQ(19, fmi.alphabet_size()); // The squares mod 37.
+    for(size_t begin = 0; begin < 40; begin++)
+        for(size_t len = 1; len < 5; len++)
+        {
+            std::vector<uint32_t> pattern(text.begin() + begin, text.begin() + begin + len);
+            std::vector<size_t> expected;
+            for(size_t i = 0; i + len <= text.size(); i++)
+                if(std::equal(pattern.begin(), pattern.end(), text.begin() + i)) expected.push_back(i);
+            ASSERT_EQ(expected.size(), fmi.findn(pattern));
+            std::vector<size_t> positions = fmi.locate(pattern);
+            std::sort(positions.begin(), positions.end());
+            ASSERT_EQ(expected, positions);
+        }
+    ASSERT_EQ(0, fmi.findn(std::vector<uint32_t>{1}));
+    ASSERT_EQ(0, fmi.findn(std::vector<uint32_t>{text[0], text[0]}));
+    ASSERT_THROW(fmi.findn(std::vector<uint32_t>()), std::length_error);
+
+    std::vector<const uint32_t *> patterns{&text[5], &text[100]};
+    std::vector<size_t> lengths{2, 3}, counts(2);
+    fmi.findn_batch(patterns.data(), lengths.data(), 2, counts.data());
+    ASSERT_EQ(fmi.findn(std::vector<uint32_t>(&text[5], &text[7])), counts[0]);
+    ASSERT_EQ(fmi.findn(std::vector<uint32_t>(&text[100], &text[103])), counts[1]);
+
+    std::ostringstream s;
+    fmi.serialize(std::ostreambuf_iterator<char>(s));
+    std::istringstream ss(s.str());
+    TokenFMIndex<uint32_t> fmi2{std::istreambuf_iterator<char>(ss)};
+    ASSERT_EQ(fmi.locate(std::vector<uint32_t>(&text[7], &text[9])), fmi2.locate(std::vector<uint32_t>(&text[7], &text[9])));
+    std::istringstream ss16(s.str());
+    ASSERT_THROW(TokenFMIndex<uint16_t>{std::istreambuf_iterator<char>(ss16)}, std::runtime_error); // Other symbol size.
+    std::ostringstream s_fmi;
+    FMIndex(std::string("not tokens")).serialize(std::ostreambuf_iterator<char>(s_fmi));
+    std::istringstream ss_fmi(s_fmi.str());
+    ASSERT_THROW(TokenFMIndex<uint32_t>{std::istreambuf_iterator<char>(ss_fmi)}, std::runtime_error);
+    ASSERT_THROW(fmi.serialize_to_file("/nonexistent/directory/tokens"), std::system_error);
+    ASSERT_THROW(TokenFMIndex<uint32_t>::new_from_serialized_file("/nonexistent/directory/tokens"), std::system_error);
+
+    std::vector<uint16_t> words{3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 9, 1, 4};
+    TokenFMIndex<uint16_t> fmi16(words);
+    ASSERT_EQ(2, fmi16.findn(std::vector<uint16_t>{1, 4}));
+    ASSERT_EQ(2, fmi16.findn(std::vector<uint16_t>{5, 9}));
+    std::vector<size_t> positions = fmi16.locate(std::vector<uint16_t>{4});
+    std::sort(positions.begin(), positions.end());
+    ASSERT_EQ((std::vector<size_t>{2, 13}), positions);
+}
+
+TEST(RLFMIndex, Basic)
+{
+    // Many slightly edited copies of one document, with bytes of every kind.
+    std::string document;
+    for(size_t i = 0; i < 1500; i++) document += static_cast<char>((i * i * 7 + i / 3) % 251);
+    std::string text;
+    for(size_t copy = 0; copy < 200; copy++)
+    {
+        document[(copy * 7919) % document.size()] = static_cast<char>(copy);
+        text += document;
+    }
+    RLFMIndex rlfmi(text);
+    ASSERT_EQ(text.size(), rlfmi.size());
+    ASSERT_LT(rlfmi.n_runs(), text.size() / 20);
+    for(size_t begin = 0; begin < text.size(); begin += 2999)
+        for(size_t len : {1, 2, 5, 40, 3000})
+        {
+            std::string pattern = text.substr(begin, len);
+            std::vector<size_t> expected;
+            for(size_t i = text.find(pattern); i != std::string::npos; i = text.find(pattern, i + 1)) expected.push_back(i);
+            ASSERT_EQ(expected.size(), rlfmi.findn(pattern)) << "when begin = " << begin << ", len = " << len;
+            std::vector<size_t> positions = rlfmi.locate(pattern);
+            std::sort(positions.begin(), positions.end());
+            ASSERT_EQ(expected, positions) << "when begin = " << begin << ", len = " << len;
+        }
+    ASSERT_EQ(0, rlfmi.findn(std::string("\xff\xff")));
+    ASSERT_TRUE(rlfmi.locate(std::string("\xff\xff")).empty());
+    ASSERT_THROW(rlfmi.findn(""), std::length_error);
+
+    std::ostringstream s, fs;
+    rlfmi.serialize(std::ostreambuf_iterator<char>(s));
+    FMIndex(text).serialize(std::ostreambuf_iterator<char>(fs));
+    EXPECT_LT(s.str().size() * 4, fs.str().size());
+    std::istringstream ss(s.str());
+    RLFMIndex rlfmi2{std::istreambuf_iterator<char>(ss)};
+    ASSERT_EQ(rlfmi.locate(text.substr(100, 3)), rlfmi2.locate(text.substr(100, 3)));
+    std::istringstream fss(fs.str());
+    ASSERT_THROW(RLFMIndex{std::istreambuf_iterator<char>(fss)}, std::runtime_error);
+    std::string stale = s.str();
+    stale[8] ^= 1; // The version, after the 8-byte magic.
+    std::istringstream sss(stale);
+    ASSERT_THROW(RLFMIndex{std::istreambuf_iterator<char>(sss)}, std::runtime_error);
+    ASSERT_THROW(RLFMIndex::new_from_serialized_file("/nonexistent/rlfmi"), std::system_error);
+
+    RLFMIndex mississippi("mississippi"), a("aaaaa");
+    ASSERT_EQ((std::vector<size_t>{10, 7, 4, 1}), mississippi.locate("i"));
+    ASSERT_EQ((std::vector<size_t>{4, 1}), mississippi.locate("issi"));
+    ASSERT_EQ((std::vector<size_t>{3, 2, 1, 0}), a.locate("aa"));
+    ASSERT_EQ(2, a.n_runs());
+    ASSERT_THROW(RLFMIndex(""), std::length_error);
+}
+
+TEST(StorageAllocator, Policies)
+{
+    class counting_allocator : public StorageAllocator
+    {
+    public:
+        size_t live_bytes = 0, n_allocations = 0;
+
+        void * allocate(const size_t bytes) { live_bytes += bytes; n_allocations++; return std::calloc(bytes, 1); }
+
+        void deallocate(void * p, const size_t bytes) { live_bytes -= bytes; std::free(p); }
+    };
+
+    std::string text;
+    for(size_t i = 0; i < 20000; i++) text += "acgt"[(i * i + i / 7) % 4];
+    FMIndex plain(text, 8);
+
+    std::shared_ptr<counting_allocator> counting = std::make_shared<counting_allocator>();
+    {
+        StorageAllocator::thread_scope scope(counting);
+        FMIndex fmi(text, 8);
+        ASSERT_LT(0, counting->n_allocations);
+        ASSERT_LT(0, counting->live_bytes);
+        ASSERT_EQ(plain.findn("acg"), fmi.findn("acg"));
+    }
+    ASSERT_EQ(0, counting->live_bytes);
+
+    // Map even small arrays so that every path is exercised; fallbacks are fine but results must not change.
+    for(auto huge_pages : {SystemStorageAllocator::transparent_huge_pages, SystemStorageAllocator::explicit_huge_pages})
+        for(auto placement : {SystemStorageAllocator::first_touch, SystemStorageAllocator::interleave_nodes})
+        {
+            std::shared_ptr<SystemStorageAllocator> system = std::make_shared<SystemStorageAllocator>(
+                SystemStorageAllocator::policy(huge_pages, placement, 0, 1024));
+            {
+                StorageAllocator::thread_scope scope(system);
+                FMIndex fmi(text, 8);
+                for(size_t i = 0; i < 100; i++)
+                {
+                    std::string pattern = text.substr(i * 97, 1 + i % 9);
+                    ASSERT_EQ(plain.findn(pattern), fmi.findn(pattern));
+                    ASSERT_EQ(plain.locate(pattern), fmi.locate(pattern));
+                }
+            }
+            SystemStorageAllocator::statistics st = system->stats();
+            ASSERT_LT(0, st.explicit_huge_page_bytes + st.transparent_huge_page_bytes + st.normal_page_bytes);
+            ASSERT_LT(0, st.calloc_bytes);
+            ASSERT_NE(std::string::npos, system->report().find("huge pages: "));
+        }
+
+    SystemStorageAllocator::system_info info = SystemStorageAllocator::probe_system();
+    ASSERT_LT(0, info.huge_page_size);
+    ASSERT_FALSE(info.numa_nodes.empty());
+}
+
+TEST(ReplicatedFMIndex, Basic)
+{
+    FMIndex fmi("the cat sat\non the mat\nthe end\n");
+    ReplicatedFMIndex replicated(fmi, SystemStorageAllocator::transparent_huge_pages);
+    ASSERT_EQ(numa_nodes().size(), replicated.n_replicas());
+    for(size_t i = 0; i < replicated.n_replicas(); i++)
+    {
+        ASSERT_EQ(fmi.find_lines("at"), replicated.replica(i).find_lines("at"));
+        std::thread query([&replicated, &fmi, i]()
+        {
+            ReplicatedFMIndex::bind_thread(replicated.node(i));
+            EXPECT_EQ(fmi.findn("the"), replicated.local().findn("the"));
+        });
+        query.join();
+    }
+    ASSERT_NE(std::string::npos, replicated.report().find("node "));
+}
+
+TEST(QueryServer, PipelinedClients)
+{
+    std::shared_ptr<const FMIndex> fmi = std::make_shared<const FMIndex>("the cat sat\non the mat\nthe end\n");
+    const std::string socket_path = "query_server_test.sock";
+    QueryServer server(fmi, socket_path, 2, 8);
+
+    QueryClient client(socket_path);
+    ASSERT_EQ(3, client.findn("the"));
+    ASSERT_EQ(fmi->find_lines("at"), client.find_lines("at"));
+    ASSERT_EQ(fmi->find_lines("at", ' ', 2), client.find_lines("at", ' ', 2));
+    std::vector<size_t> positions = fmi->locate("the");
+    std::sort(positions.begin(), positions.end());
+    ASSERT_EQ(positions, client.locate("the"));
+    ASSERT_THROW(client.findn(""), std::runtime_error);
+    ASSERT_EQ(0, client.findn("dog"));
+
+    const std::vector<std::string> patterns{"the", "at", "e", "dog", "t", "cat sat", "\n"};
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < 4; t++)
+        threads.push_back(std::thread([&socket_path, &fmi, &patterns]()
+        {
+            QueryClient c(socket_path);
+            std::map<uint32_t, std::string> sent;
+            for(size_t i = 0; i < 500; i++)
+            {
+                const std::string & pattern = patterns[i % patterns.size()];
+                sent[i % 3 == 0 ? c.send_find_lines(pattern) : c.send_findn(pattern)] = pattern;
+            }
+            for(size_t i = 0; i < 500; i++)
+            {
+                QueryClient::response r = c.receive();
+                ASSERT_TRUE(r.ok);
+                const std::string & pattern = sent.at(r.id);
+                if(r.id % 3 == 0) ASSERT_EQ(fmi->find_lines(pattern), r.lines());
+                else ASSERT_EQ(fmi->findn(pattern), r.count());
+            }
+        }));
+    for(auto & thread : threads) thread.join();
+
+    QueryServer::statistics st = server.stats();
+    EXPECT_EQ(5, st.connections);
+    EXPECT_EQ(4 * 333 + 3, st.findn.requests);
+    EXPECT_EQ(1, st.findn.errors);
+    EXPECT_EQ(4 * 167 + 2, st.find_lines.requests);
+    EXPECT_LE(st.batches, st.batched_requests);
+    EXPECT_LT(0, st.findn.latency_percentile_us(99));
+    ASSERT_NE(std::string::npos, client.stats().find("findn: 1335 requests"));
+
+    server.stop();
+    ASSERT_THROW(QueryClient{socket_path}, std::system_error);
+}
+
+TEST(FMIndexHandle, SwapUnderReaders)
+{
+    std::atomic<size_t> n_freed(0);
+    auto make = [&n_freed](const std::string & text)
+    {
+        return std::shared_ptr<const FMIndex>(new FMIndex(text), [&n_freed](const FMIndex * fmi) { delete fmi; n_freed++; });
+    };
+    FMIndexHandle handle(make("the cat sat on the mat"));
+
+    // Each reader sees one index or the other throughout, never a mixture or a freed one.
+    std::atomic<bool> done(false);
+    std::vector<std::thread> readers;
+    for(size_t t = 0; t < 4; t++)
+        readers.push_back(std::thread([&handle, &done]()
+        {
+            while(!done)
+            {
+                FMIndexHandle::reader fmi = handle.read();
+                size_t n = fmi->findn("the");
+                ASSERT_TRUE(n == 2 || n == 3);
+                ASSERT_EQ(n == 2 ? 22 : 29, fmi->size());
+            }
+        }));
+    for(size_t i = 0; i < 50; i++) handle.swap(make(i % 2 == 0 ? "the end of the story, the end" : "the cat sat on the mat"));
+    done = true;
+    for(auto & reader : readers) reader.join();
+    ASSERT_EQ(50, handle.generation());
+    ASSERT_EQ(50, n_freed);
+
+    // A swap waits for a reader of the old index, but new readers get the new one at once.
+    // (EXPECT rather than ASSERT while the reader is held: returning early would deadlock.)
+    std::unique_ptr<FMIndexHandle::reader> held(new FMIndexHandle::reader(handle.read()));
+    std::future<void> swapped = std::async(std::launch::async, [&]() { handle.swap(make("the end")); });
+    while(handle.generation() == 50) std::this_thread::yield();
+    EXPECT_EQ(1, handle.read()->findn("the"));
+    EXPECT_EQ(2, (*held)->findn("the"));
+    EXPECT_EQ(std::future_status::timeout, swapped.wait_for(std::chrono::milliseconds(50)));
+    EXPECT_EQ(50, n_freed);
+    held.reset();
+    swapped.get();
+    ASSERT_EQ(51, n_freed);
+
+    ASSERT_THROW(handle.swap_from_serialized_file("no_such_index").get(), std::system_error);
+    ASSERT_EQ(1, handle.read()->findn("the"));
+}
+
 TEST(Serializing, Basic)
 {
     const uint64_t x = 13446544033719551615LLU; // Random value.
@@ -403,6 +1478,16 @@ TEST_F(FMIndexTest, Serializing)
     FMIndex fmi{std::istreambuf_iterator<char>(ss)}; // Avoid "most vexing parse"
     ASSERT_EQ(long_fmi->size(), fmi.size());
     ASSERT_EQ(long_str, get_text(fmi));
+
+    // Truncated data, data without the header (as written before it) and other versions are rejected.
+    std::istringstream truncated(s.str().substr(0, s.str().size() / 2));
+    ASSERT_THROW(FMIndex{std::istreambuf_iterator<char>(truncated)}, std::runtime_error);
+    std::istringstream headerless_ss(s.str().substr(16));
+    ASSERT_THROW(FMIndex{std::istreambuf_iterator<char>(headerless_ss)}, std::runtime_error);
+    std::string next_version = s.str();
+    next_version[8]++;
+    std::istringstream next_version_ss(next_version);
+    ASSERT_THROW(FMIndex{std::istreambuf_iterator<char>(next_version_ss)}, std::runtime_error);
 }
 
 int main(int argc, char **argv)